@@ -36,6 +36,7 @@ extern "C" {
 #include "quicly/frame.h"
 #include "quicly/linklist.h"
 #include "quicly/loss.h"
+#include "quicly/pacer.h"
 #include "quicly/recvstate.h"
 #include "quicly/sendstate.h"
 #include "quicly/maxsender.h"
@@ -46,6 +47,20 @@ extern "C" {
 
 typedef struct st_quicly_datagram_t {
     ptls_iovec_t data;
+    /**
+     * if non-zero, `data` contains multiple UDP payloads of `segment_size` bytes each (the last one might be shorter), that are to be
+     * sent using UDP GSO (see quicly_context_t::max_gso_segments)
+     */
+    size_t segment_size;
+    /**
+     * if non-zero, the time at which the datagram is to be sent, on the clock of quicly_context_t::now; set only when
+     * quicly_context_t::pace_by_txtime is set
+     */
+    int64_t txtime;
+    /**
+     * ECN codepoint to be set in the IP header (QUICLY_ECN_*); set only when quicly_context_t::enable_ecn is set
+     */
+    uint8_t ecn;
     socklen_t salen;
     struct sockaddr sa;
 } quicly_datagram_t;
@@ -72,10 +87,17 @@ typedef enum en_quicly_event_type_t {
     QUICLY_EVENT_TYPE_CRYPTO_DECRYPT,
     QUICLY_EVENT_TYPE_CRYPTO_HANDSHAKE,
     QUICLY_EVENT_TYPE_CRYPTO_UPDATE_SECRET,
+    QUICLY_EVENT_TYPE_CRYPTO_KEY_UPDATE,
     QUICLY_EVENT_TYPE_CC_TLP,
     QUICLY_EVENT_TYPE_CC_RTO,
     QUICLY_EVENT_TYPE_CC_ACK_RECEIVED,
     QUICLY_EVENT_TYPE_CC_CONGESTION,
+    QUICLY_EVENT_TYPE_CC_ECN_CONGESTION,
+    QUICLY_EVENT_TYPE_CC_CAREFUL_RESUME,
+    QUICLY_EVENT_TYPE_ECN_DISABLE,
+    QUICLY_EVENT_TYPE_PMTU_PROBE,
+    QUICLY_EVENT_TYPE_PMTU_PROBE_LOST,
+    QUICLY_EVENT_TYPE_PMTU_UPDATE,
     QUICLY_EVENT_TYPE_STREAM_SEND,
     QUICLY_EVENT_TYPE_STREAM_RECEIVE,
     QUICLY_EVENT_TYPE_STREAM_ACKED,
@@ -119,6 +141,8 @@ typedef enum en_quicly_event_attribute_type_t {
     QUICLY_EVENT_ATTRIBUTE_STATE,
     QUICLY_EVENT_ATTRIBUTE_ERROR_CODE,
     QUICLY_EVENT_ATTRIBUTE_FRAME_TYPE,
+    QUICLY_EVENT_ATTRIBUTE_ECN_CE,
+    QUICLY_EVENT_ATTRIBUTE_KEY_GENERATION,
     QUICLY_EVENT_ATTRIBUTE_TYPE_INT_MAX,
     QUICLY_EVENT_ATTRIBUTE_TYPE_VEC_MIN = QUICLY_EVENT_ATTRIBUTE_TYPE_INT_MAX,
     QUICLY_EVENT_ATTRIBUTE_DCID = QUICLY_EVENT_ATTRIBUTE_TYPE_VEC_MIN,
@@ -143,6 +167,10 @@ typedef struct st_quicly_event_attribute_t {
 typedef struct st_quicly_context_t quicly_context_t;
 typedef struct st_quicly_conn_t quicly_conn_t;
 typedef struct st_quicly_stream_t quicly_stream_t;
+typedef struct st_quicly_conn_map_t quicly_conn_map_t;
+typedef struct st_quicly_timerwheel_t quicly_timerwheel_t;
+typedef struct st_quicly_timerwheel_timer_t quicly_timerwheel_timer_t;
+typedef struct st_quicly_decryptor_t quicly_decryptor_t;
 
 typedef quicly_datagram_t *(*quicly_alloc_packet_cb)(quicly_context_t *ctx, socklen_t salen, size_t payloadsize);
 typedef void (*quicly_free_packet_cb)(quicly_context_t *ctx, quicly_datagram_t *packet);
@@ -191,6 +219,25 @@ typedef struct st_quicly_transport_parameters_t {
     uint8_t max_ack_delay;
 } quicly_transport_parameters_t;
 
+/**
+ * characteristics of the network path observed by a connection, that can be remembered along with the session ticket and be
+ * provided to quicly_connect when resuming
+ */
+typedef struct st_quicly_path_state_t {
+    /**
+     * in microseconds; zero if there has been no RTT sample
+     */
+    uint32_t smoothed_rtt;
+    /**
+     * in microseconds
+     */
+    uint32_t min_rtt;
+    /**
+     * congestion window, in octets
+     */
+    uint32_t cwnd;
+} quicly_path_state_t;
+
 typedef struct st_quicly_cid_t {
     uint8_t cid[18];
     uint8_t len;
@@ -209,10 +256,49 @@ struct st_quicly_context_t {
      * MTU
      */
     uint16_t max_packet_size;
+    /**
+     * if greater than one, quicly_send packs up to the given number of full-sized short header packets back to back into one
+     * datagram, which is to be sent using UDP GSO (see quicly_datagram_t::segment_size)
+     */
+    uint16_t max_gso_segments;
+    /**
+     * if greater than max_packet_size, each connection probes the path for larger packet sizes up to the given value (DPLPMTUD),
+     * using padded PING frames that are tracked by the sentmap
+     */
+    uint16_t max_probed_packet_size;
     /**
      * loss detection parameters
      */
     quicly_loss_conf_t *loss;
+    /**
+     * pacing parameters (e.g., quicly_pacer_default_conf); pacing is disabled if set to NULL, which is the default
+     */
+    quicly_pacer_conf_t *pacer;
+    /**
+     * number of packets after which the endpoint initiates a 1-RTT key update; 0 disables automatic updates
+     */
+    uint64_t max_packets_per_key;
+    /**
+     * if set, quicly_send does not hold back the packets for pacing. Instead, the entire window is emitted, with each datagram
+     * being stamped with the time when the pacer would have released it (see quicly_datagram_t::txtime), so that pacing can be
+     * offloaded to the kernel (e.g., SO_TXTIME)
+     */
+    unsigned pace_by_txtime : 1;
+    /**
+     * if set, the packets are sent with ECT(0) (see quicly_datagram_t::ecn) until the path or the peer fails ECN validation
+     */
+    unsigned enable_ecn : 1;
+    /**
+     * if set, encryption of the short header packets is deferred until the end of quicly_send, so that the packets are sealed in
+     * batches instead of being interleaved with the building of the frames
+     */
+    unsigned defer_sealing : 1;
+    /**
+     * if set, the server does not process ClientHello within quicly_accept or quicly_receive. Instead, the functions return
+     * QUICLY_ERROR_HANDSHAKE_PENDING, and the application calls quicly_complete_handshake, possibly from a worker thread, so that
+     * the signature generation does not block the event loop
+     */
+    unsigned async_handshake : 1;
     /**
      * transport parameters
      */
@@ -246,9 +332,21 @@ struct st_quicly_context_t {
      */
     quicly_conn_close_cb on_conn_close;
     /**
-     * returns current time in milliseconds
+     * returns current time in microseconds; the clock is expected to be monotonic
      */
     quicly_now_cb now;
+    /**
+     * optional table of connections (see quicly/connmap.h); connections accepted by quicly_accept are registered to the table, and
+     * are unregistered when freed
+     */
+    quicly_conn_map_t *conn_map;
+    /**
+     * optional timer wheel (see quicly/timerwheel.h); when set, each connection keeps the value of quicly_get_first_timeout
+     * registered to the wheel, so that the connections to be served can be found without polling all of them. The wheel is not
+     * thread-safe; it is updated only by the functions called on the thread running the event loop (e.g., quicly_send,
+     * quicly_receive), and never by quicly_complete_handshake or quicly_decrypt_packet.
+     */
+    quicly_timerwheel_t *timer_wheel;
     /**
      * optional callback for debug logging
      */
@@ -485,9 +583,22 @@ typedef struct st_quicly_decoded_packet_t {
      */
     size_t encrypted_off;
     /**
-     * size of the datagram
+     * size of the datagram; quicly_decode_packet sets the number of bytes passed in, which the caller should overwrite when
+     * decoding the second and subsequent packets of a datagram, or a UDP datagram that is part of a buffer coalesced by GRO
      */
     size_t datagram_size;
+    /**
+     * ECN codepoint of the datagram (QUICLY_ECN_*); quicly_decode_packet sets QUICLY_ECN_NOT_ECT, which the caller should
+     * overwrite with the value read from the IP header (e.g., using IP_RECVTOS)
+     */
+    uint8_t ecn;
+    /**
+     * set by quicly_decrypt_packet; payload is {NULL, 0} unless the packet has been decrypted
+     */
+    struct {
+        ptls_iovec_t payload;
+        uint64_t pn;
+    } decrypted;
 } quicly_decoded_packet_t;
 
 extern const quicly_context_t quicly_default_context;
@@ -562,6 +673,22 @@ static void quicly_get_packet_stats(quicly_conn_t *conn, uint64_t *num_received,
  *
  */
 void quicly_get_max_data(quicly_conn_t *conn, uint64_t *send_permitted, uint64_t *sent, uint64_t *consumed);
+/**
+ * returns the size of the packets being sent, as determined by PMTU discovery
+ */
+uint16_t quicly_get_max_packet_size(quicly_conn_t *conn);
+/**
+ * returns the number of 1-RTT key updates that have been applied to the keys used for sending (if is_enc is set) or receiving
+ */
+uint64_t quicly_get_key_generation(quicly_conn_t *conn, int is_enc);
+/**
+ * requests a 1-RTT key update, which is initiated by quicly_send as soon as it is permitted
+ */
+void quicly_initiate_key_update(quicly_conn_t *conn);
+/**
+ * returns the characteristics of the path, to be remembered for resuming a connection
+ */
+void quicly_get_path_state(quicly_conn_t *conn, quicly_path_state_t *state);
 /**
  *
  */
@@ -577,9 +704,14 @@ void quicly_free(quicly_conn_t *conn);
  */
 int quicly_close(quicly_conn_t *conn, const uint16_t *app_error_code, const char *reason_phrase);
 /**
- *
+ * Returns the time at which quicly_send should be called next. When pacing is enabled and there is data to be sent, the value is
+ * the time when the pacer releases the next packet.
  */
 int64_t quicly_get_first_timeout(quicly_conn_t *conn);
+/**
+ * returns the connection that owns the timer returned by quicly_timerwheel_get_expired (see quicly_context_t::timer_wheel)
+ */
+quicly_conn_t *quicly_get_conn_by_timer(quicly_timerwheel_timer_t *timer);
 /**
  *
  */
@@ -598,6 +730,46 @@ int quicly_send(quicly_conn_t *conn, quicly_datagram_t **packets, size_t *num_pa
  *
  */
 int quicly_receive(quicly_conn_t *conn, quicly_decoded_packet_t *packet);
+/**
+ * Processes a set of packets that have been received at once and are destined to the same connection. The behavior is equivalent
+ * to calling quicly_receive for each packet, except that loss detection is run once for the entire batch. Packets that are
+ * ignored (e.g., due to decryption failure) are skipped. If any other error occurs, the function returns the error without
+ * processing the remaining packets.
+ */
+int quicly_receive_batch(quicly_conn_t *conn, quicly_decoded_packet_t *packets, size_t num_packets);
+/**
+ * Creates a decryptor, which is a private copy of the 1-RTT receive keys of the connection. Returns NULL if the 1-RTT keys are not
+ * yet available. The function must be called by the thread handling the connection. A decryptor holds the current key and the
+ * next one; it should be recreated once the peer updates the key (see quicly_get_key_generation).
+ */
+quicly_decryptor_t *quicly_new_decryptor(quicly_conn_t *conn);
+/**
+ *
+ */
+void quicly_free_decryptor(quicly_decryptor_t *decryptor);
+/**
+ * returns the 1-RTT packet number expected to be received next, to be passed to quicly_decrypt_packet
+ */
+uint64_t quicly_get_next_expected_packet_number(quicly_conn_t *conn);
+/**
+ * Removes header protection and decrypts a 1-RTT packet in place. Long header packets are left untouched. The function does not
+ * access the connection, and can therefore be called from any thread, as long as each decryptor is used by one thread at a time.
+ * The truncated packet number is decoded using `next_expected_pn`, which is updated as the packets are decrypted. The thread
+ * handling the connection should obtain the value by calling quicly_get_next_expected_packet_number each time it hands a batch of
+ * packets to a worker, as a decryptor that keeps its own value falls behind the connection while it sits idle.
+ * This allows the packets of one connection to be decrypted by a pool of worker threads, each owning a decryptor. The packets are
+ * then passed to quicly_receive or quicly_receive_batch by the thread handling the connection, which skips the decryption of the
+ * packets that have already been decrypted. Returns QUICLY_ERROR_PACKET_IGNORED if decryption fails, in which case the packet
+ * should be discarded.
+ */
+int quicly_decrypt_packet(quicly_decryptor_t *decryptor, uint64_t *next_expected_pn, quicly_decoded_packet_t *packet);
+/**
+ * Runs the handshake that has been suspended due to quicly_context_t::async_handshake (i.e. when quicly_accept, quicly_receive, or
+ * quicly_receive_batch returned QUICLY_ERROR_HANDSHAKE_PENDING). The function can be called from any thread, but no other function
+ * may be called for the connection until it returns. Once it returns zero, the application should call quicly_send to emit the
+ * handshake messages. A non-zero return value should be handled the same way as an error returned by quicly_receive.
+ */
+int quicly_complete_handshake(quicly_conn_t *conn);
 /**
  *
  */
@@ -612,11 +784,14 @@ int quicly_encode_transport_parameter_list(const quicly_transport_parameters_t *
 int quicly_decode_transport_parameter_list(quicly_transport_parameters_t *params, int is_client, const uint8_t *src,
                                            const uint8_t *end);
 /**
- *
+ * Initiates a connection. When resuming, `resumed_path_state` can be set to the characteristics of the path remembered from the
+ * previous connection (see quicly_get_path_state). The remembered smoothed RTT is used as the initial RTT, and once resumption
+ * succeeds and the RTT is confirmed to be similar, the congestion window is raised to half the remembered value (careful resume).
+ * The larger window is abandoned if any of the packets sent using it is deemed lost before it is validated.
  */
 int quicly_connect(quicly_conn_t **conn, quicly_context_t *ctx, const char *server_name, struct sockaddr *sa, socklen_t salen,
-                   ptls_handshake_properties_t *handshake_properties,
-                   const quicly_transport_parameters_t *resumed_transport_params);
+                   ptls_handshake_properties_t *handshake_properties, const quicly_transport_parameters_t *resumed_transport_params,
+                   const quicly_path_state_t *resumed_path_state);
 /**
  *
  */
@@ -675,7 +850,7 @@ quicly_stream_t *quicly_default_alloc_stream(quicly_context_t *ctx);
  */
 void quicly_default_free_stream(quicly_stream_t *stream);
 /**
- *
+ * returns the time of CLOCK_MONOTONIC in microseconds
  */
 int64_t quicly_default_now(quicly_context_t *ctx);
 /**
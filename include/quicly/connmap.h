@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2019 Fastly, Kazuho Oku
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#ifndef quicly_connmap_h
+#define quicly_connmap_h
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "quicly.h"
+
+/**
+ * Creates a table that maps connection IDs to connections. Once the table is set to quicly_context_t::conn_map, the connections
+ * accepted by quicly_accept are registered to the table, and are unregistered when being freed by quicly_free.
+ */
+quicly_conn_map_t *quicly_conn_map_create(void);
+/**
+ * Destroys the table. The connections registered to the table are not freed.
+ */
+void quicly_conn_map_destroy(quicly_conn_map_t *map);
+/**
+ * Registers the host CID of the connection, as well as the offered CID if the connection is a server-side one. If either of the
+ * CIDs is already registered to another connection, the existing mapping is retained and nothing is registered.
+ * @return 0 if successful, QUICLY_ERROR_CID_IN_USE if a CID is registered to another connection, or PTLS_ERROR_NO_MEMORY
+ */
+int quicly_conn_map_add(quicly_conn_map_t *map, quicly_conn_t *conn);
+/**
+ * Unregisters the connection. It is safe to call the function for connections that are not registered.
+ */
+void quicly_conn_map_remove(quicly_conn_map_t *map, quicly_conn_t *conn);
+/**
+ * Returns the connection to which the packet is destined, or NULL if not found. The semantics are equivalent to calling
+ * quicly_is_destination for every connection registered to the table.
+ */
+quicly_conn_t *quicly_conn_map_lookup(quicly_conn_map_t *map, quicly_decoded_packet_t *packet);
+/**
+ * returns the number of connections being registered
+ */
+size_t quicly_conn_map_size(quicly_conn_map_t *map);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -27,6 +27,13 @@
 
 #define QUICLY_NUM_PACKETS_BEFORE_ACK 2
 #define QUICLY_DELAYED_ACK_TIMEOUT 25 /* milliseconds */
+#define QUICLY_MAX_UDP_PAYLOAD_SIZE 65507 /* maximum size of a UDP datagram over IPv4, which also bounds a GSO datagram */
+
+/* ECN codepoints (the two least significant bits of IPv4 TOS / IPv6 traffic class) */
+#define QUICLY_ECN_NOT_ECT 0
+#define QUICLY_ECN_ECT1 1
+#define QUICLY_ECN_ECT0 2
+#define QUICLY_ECN_CE 3
 
 /* transport error codes */
 #define QUICLY_ERROR_NONE 0x0
@@ -47,8 +54,10 @@
 
 /* internal errors */
 #define QUICLY_ERROR_PACKET_IGNORED 0xff01
-#define QUICLY_ERROR_SENDBUF_FULL 0xff02    /* internal use only; the error code is never exposed to the application */
-#define QUICLY_ERROR_FREE_CONNECTION 0xff03 /* returned by quicly_send when the connection is freeable */
+#define QUICLY_ERROR_SENDBUF_FULL 0xff02      /* internal use only; the error code is never exposed to the application */
+#define QUICLY_ERROR_FREE_CONNECTION 0xff03   /* returned by quicly_send when the connection is freeable */
+#define QUICLY_ERROR_HANDSHAKE_PENDING 0xff04 /* returned by quicly_accept / quicly_receive when the handshake is suspended */
+#define QUICLY_ERROR_CID_IN_USE 0xff05        /* returned by quicly_conn_map_add when a CID is registered to another connection */
 
 #define QUICLY_BUILD_ASSERT(condition) ((void)sizeof(char[2 * !!(!__builtin_constant_p(condition) || (condition)) - 1]))
 
@@ -197,8 +197,21 @@ typedef struct st_quicly_stop_sending_frame_t {
 
 static int quicly_decode_stop_sending_frame(const uint8_t **src, const uint8_t *end, quicly_stop_sending_frame_t *frame);
 
+/**
+ * counters of ECN codepoints being carried by ACK_ECN frames
+ */
+typedef struct st_quicly_ecn_counts_t {
+    uint64_t ect0;
+    uint64_t ect1;
+    uint64_t ce;
+} quicly_ecn_counts_t;
+
 #define QUICLY_ENCODE_ACK_MAX_BLOCKS 63 /* exclusive, see encode_ack_frame */
-uint8_t *quicly_encode_ack_frame(uint8_t *dst, uint8_t *dst_end, quicly_ranges_t *ranges, uint64_t ack_delay);
+/**
+ * encodes an ACK frame, or an ACK_ECN frame if `ecn_counts` is non-NULL
+ */
+uint8_t *quicly_encode_ack_frame(uint8_t *dst, uint8_t *dst_end, quicly_ranges_t *ranges, const quicly_ecn_counts_t *ecn_counts,
+                                 uint64_t ack_delay);
 
 typedef struct st_quicly_ack_frame_t {
     uint64_t largest_acknowledged;
@@ -207,6 +220,10 @@ typedef struct st_quicly_ack_frame_t {
     uint64_t num_gaps;
     uint64_t ack_block_lengths[257];
     uint64_t gaps[256];
+    /**
+     * set to zero unless the frame is ACK_ECN
+     */
+    quicly_ecn_counts_t ecn_counts;
 } quicly_ack_frame_t;
 
 int quicly_decode_ack_frame(const uint8_t **src, const uint8_t *end, quicly_ack_frame_t *frame, int is_ack_ecn);
@@ -27,6 +27,9 @@
 #include <stdint.h>
 #include "quicly/constants.h"
 
+/**
+ * All the times handled by the loss recovery logic are in microseconds.
+ */
 typedef struct quicly_loss_conf_t {
     /**
      * Maximum number of tail loss probes before an RTO fires.
@@ -36,6 +39,10 @@ typedef struct quicly_loss_conf_t {
      * Maximum reordering in time space before time based loss detection considers a packet lost. In percentile (1/1024) of an RTT.
      */
     unsigned time_reordering_percentile;
+    /**
+     * Maximum reordering in packets before packet threshold loss detection considers a packet lost (kPacketThreshold).
+     */
+    unsigned packet_threshold;
     /**
      * Minimum time in the future a tail loss probe alarm may be set for.
      */
@@ -52,10 +59,11 @@ typedef struct quicly_loss_conf_t {
 
 #define QUICLY_LOSS_DEFAULT_MAX_TLPS 2
 #define QUICLY_LOSS_DEFAULT_TIME_REORDERING_PERCENTILE (1024 / 8)
-#define QUICLY_LOSS_DEFAULT_MIN_TLP_TIMEOUT 10
-#define QUICLY_LOSS_DEFAULT_MIN_RTO_TIMEOUT 200
-#define QUICLY_LOSS_DEFAULT_INITIAL_RTT 100
-#define QUICLY_LOSS_MAX_RTO_COUNT 16 /* 65 seconds under 1ms granurality */
+#define QUICLY_LOSS_DEFAULT_PACKET_THRESHOLD 3
+#define QUICLY_LOSS_DEFAULT_MIN_TLP_TIMEOUT 10000
+#define QUICLY_LOSS_DEFAULT_MIN_RTO_TIMEOUT 200000
+#define QUICLY_LOSS_DEFAULT_INITIAL_RTT 100000
+#define QUICLY_LOSS_MAX_RTO_COUNT 16 /* caps the exponential backoff of the RTO alarm */
 
 extern quicly_loss_conf_t quicly_loss_default_conf;
 
@@ -75,7 +83,7 @@ typedef struct quicly_loss_t {
      */
     const quicly_loss_conf_t *conf;
     /**
-     * pointer to transport parameter containing max_ack_delay
+     * pointer to transport parameter containing max_ack_delay (in milliseconds)
      */
     uint8_t *max_ack_delay;
     /**
@@ -131,6 +139,11 @@ static void quicly_loss_on_ack_received(quicly_loss_t *r, uint64_t largest_acked
 static int quicly_loss_on_alarm(quicly_loss_t *r, uint64_t largest_sent, uint64_t largest_acked, quicly_loss_do_detect_cb do_detect,
                                 size_t *num_packets_to_send);
 static int quicly_loss_detect_loss(quicly_loss_t *r, uint64_t largest_pn, quicly_loss_do_detect_cb do_detect);
+/**
+ * returns the time that should elapse since the emission of a packet before the packet is deemed lost, once a packet sent later is
+ * acknowledged
+ */
+static uint32_t quicly_loss_get_delay_until_lost(quicly_loss_t *r);
 
 /* inline definitions */
 
@@ -191,13 +204,13 @@ inline void quicly_loss_update_alarm(quicly_loss_t *r, int64_t now, int64_t last
             alarm_duration <<= r->tlp_count;
         } else {
             /* RTO or TLP alarm (FIXME observe and use max_ack_delay) */
-            alarm_duration = r->rtt.smoothed + 4 * r->rtt.variance + *r->max_ack_delay;
+            alarm_duration = r->rtt.smoothed + 4 * r->rtt.variance + *r->max_ack_delay * 1000;
             if (alarm_duration < r->conf->min_rto_timeout)
                 alarm_duration = r->conf->min_rto_timeout;
             alarm_duration <<= r->rto_count < QUICLY_LOSS_MAX_RTO_COUNT ? r->rto_count : QUICLY_LOSS_MAX_RTO_COUNT;
             if (r->tlp_count < r->conf->max_tlps) {
                 /* Tail Loss Probe */
-                int64_t tlp_alarm_duration = r->rtt.smoothed * 3 / 2 + *r->max_ack_delay;
+                int64_t tlp_alarm_duration = r->rtt.smoothed * 3 / 2 + *r->max_ack_delay * 1000;
                 if (tlp_alarm_duration < r->conf->min_tlp_timeout)
                     tlp_alarm_duration = r->conf->min_tlp_timeout;
                 if (tlp_alarm_duration < alarm_duration)
@@ -262,7 +275,7 @@ inline int quicly_loss_on_alarm(quicly_loss_t *r, uint64_t largest_sent, uint64_
 
 inline int quicly_loss_detect_loss(quicly_loss_t *r, uint64_t largest_pn, quicly_loss_do_detect_cb do_detect)
 {
-    uint32_t delay_until_lost = (r->rtt.latest > r->rtt.smoothed ? r->rtt.latest : r->rtt.smoothed) * 9 / 8;
+    uint32_t delay_until_lost = quicly_loss_get_delay_until_lost(r);
     int64_t loss_time;
     int ret;
 
@@ -276,4 +289,9 @@ inline int quicly_loss_detect_loss(quicly_loss_t *r, uint64_t largest_pn, quicly
     return 0;
 }
 
+inline uint32_t quicly_loss_get_delay_until_lost(quicly_loss_t *r)
+{
+    return (r->rtt.latest > r->rtt.smoothed ? r->rtt.latest : r->rtt.smoothed) * 9 / 8;
+}
+
 #endif
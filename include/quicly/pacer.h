@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) 2019 Fastly, Kazuho Oku
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#ifndef quicly_pacer_h
+#define quicly_pacer_h
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct st_quicly_pacer_conf_t {
+    /**
+     * Pacing rate relative to CWND / smoothed RTT, in units of 1/1024 (i.e. 1024 paces at CWND / smoothed RTT).
+     */
+    unsigned gain_1024ths;
+    /**
+     * Maximum number of full-sized packets that can be sent back to back, when the pacer has been idle.
+     */
+    unsigned max_burst_packets;
+} quicly_pacer_conf_t;
+
+#define QUICLY_PACER_DEFAULT_GAIN_1024THS (1024 * 5 / 4)
+#define QUICLY_PACER_DEFAULT_MAX_BURST_PACKETS 10
+
+extern quicly_pacer_conf_t quicly_pacer_default_conf;
+
+/**
+ * A token bucket that is refilled at the pacing rate. Time is in microseconds, and the bucket is in bytes.
+ */
+typedef struct st_quicly_pacer_t {
+    /**
+     * time when the bucket was last refilled
+     */
+    int64_t updated_at;
+    /**
+     * number of bytes that can be sent; becomes negative when a packet is sent using the last credits
+     */
+    int64_t credit;
+} quicly_pacer_t;
+
+static void quicly_pacer_init(quicly_pacer_t *pacer);
+/**
+ * returns the pacing rate in bytes per millisecond, given the RTT in microseconds
+ */
+static uint64_t quicly_pacer_calc_rate(const quicly_pacer_conf_t *conf, uint32_t cwnd, uint32_t rtt);
+/**
+ * returns the maximum size of the bucket, which is at least two milliseconds worth of the rate, so that the rate can be achieved
+ * even with timers of millisecond granularity
+ */
+static int64_t quicly_pacer_calc_burst(const quicly_pacer_conf_t *conf, uint64_t rate, uint16_t max_packet_size);
+/**
+ * refills the bucket
+ */
+static void quicly_pacer_update(quicly_pacer_t *pacer, int64_t now, uint64_t rate, int64_t burst);
+/**
+ * returns the time when the credit becomes at least `size` bytes
+ */
+static int64_t quicly_pacer_get_send_at(quicly_pacer_t *pacer, uint64_t rate, int64_t burst, size_t size);
+/**
+ * consumes the credit
+ */
+static void quicly_pacer_consume(quicly_pacer_t *pacer, size_t bytes);
+
+/* inline definitions */
+
+inline void quicly_pacer_init(quicly_pacer_t *pacer)
+{
+    pacer->updated_at = 0;
+    pacer->credit = 0;
+}
+
+inline uint64_t quicly_pacer_calc_rate(const quicly_pacer_conf_t *conf, uint32_t cwnd, uint32_t rtt)
+{
+    uint64_t rate = (uint64_t)cwnd * conf->gain_1024ths * 1000 / 1024 / (rtt != 0 ? rtt : 1);
+    return rate != 0 ? rate : 1;
+}
+
+inline int64_t quicly_pacer_calc_burst(const quicly_pacer_conf_t *conf, uint64_t rate, uint16_t max_packet_size)
+{
+    int64_t burst = (int64_t)conf->max_burst_packets * max_packet_size;
+    if (burst < (int64_t)rate * 2)
+        burst = (int64_t)rate * 2;
+    return burst;
+}
+
+inline void quicly_pacer_update(quicly_pacer_t *pacer, int64_t now, uint64_t rate, int64_t burst)
+{
+    if (now <= pacer->updated_at)
+        return;
+    if ((uint64_t)(now - pacer->updated_at) >= (uint64_t)burst * 1000 / rate + 1) {
+        pacer->credit = burst;
+        pacer->updated_at = now;
+    } else {
+        /* the fraction of a byte that has not been credited yet is carried over, by not advancing the clock that far */
+        int64_t refill = (now - pacer->updated_at) * (int64_t)rate;
+        pacer->credit += refill / 1000;
+        if (pacer->credit > burst)
+            pacer->credit = burst;
+        pacer->updated_at = now - refill % 1000 / (int64_t)rate;
+    }
+}
+
+inline int64_t quicly_pacer_get_send_at(quicly_pacer_t *pacer, uint64_t rate, int64_t burst, size_t size)
+{
+    int64_t shortage;
+
+    if (burst < (int64_t)size)
+        size = burst;
+    if ((shortage = (int64_t)size - pacer->credit) <= 0)
+        return pacer->updated_at;
+    return pacer->updated_at + (shortage * 1000 + (int64_t)rate - 1) / (int64_t)rate;
+}
+
+inline void quicly_pacer_consume(quicly_pacer_t *pacer, size_t bytes)
+{
+    pacer->credit -= bytes;
+}
+
+#endif
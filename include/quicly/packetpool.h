@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2019 Fastly, Kazuho Oku
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#ifndef quicly_packetpool_h
+#define quicly_packetpool_h
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "quicly.h"
+
+/**
+ * Statistics of the packet pool. The numbers are per-thread.
+ */
+typedef struct st_quicly_packet_pool_stats_t {
+    /**
+     * number of calls to quicly_pooled_alloc_packet
+     */
+    uint64_t num_allocs;
+    /**
+     * number of allocations served from the freelist
+     */
+    uint64_t num_hits;
+    /**
+     * number of datagrams allocated and not yet freed (wraps around if datagrams are freed by a thread other than the one that
+     * allocated them)
+     */
+    size_t num_in_use;
+    /**
+     * maximum value of num_in_use
+     */
+    size_t peak_in_use;
+    /**
+     * number of bytes being retained by the freelists
+     */
+    size_t bytes_cached;
+} quicly_packet_pool_stats_t;
+
+/**
+ * An allocator that can be set to quicly_context_t::alloc_packet. Memory is allocated in cache-aligned slots of fixed sizes
+ * (powers of two, up to 128KB), which are recycled through per-thread freelists. Allocations larger than the largest slot are
+ * forwarded to malloc.
+ */
+quicly_datagram_t *quicly_pooled_alloc_packet(quicly_context_t *ctx, socklen_t salen, size_t payloadsize);
+/**
+ * Frees a datagram allocated by quicly_pooled_alloc_packet, by returning the slot to the freelist of the calling thread. To be set
+ * to quicly_context_t::free_packet.
+ */
+void quicly_pooled_free_packet(quicly_context_t *ctx, quicly_datagram_t *packet);
+/**
+ * releases the memory being retained by the freelists of the calling thread
+ */
+void quicly_packet_pool_clear(void);
+/**
+ * returns the statistics of the calling thread
+ */
+void quicly_packet_pool_get_stats(quicly_packet_pool_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -31,11 +31,49 @@
 struct st_quicly_conn_t;
 typedef struct st_quicly_sent_t quicly_sent_t;
 
+/**
+ * The first two octets of every record being stored in the sentmap, used by the sentmap for retaining the type and the length of
+ * the record.
+ */
+#define QUICLY_SENT__HEADER                                                                                                        \
+    uint8_t _type;                                                                                                                 \
+    uint8_t _num_words
+
+/**
+ * types of the records
+ */
+typedef enum en_quicly_sent_type_t {
+    /**
+     * the record has been discarded
+     */
+    QUICLY_SENT_TYPE_DISCARDED,
+    /**
+     * packet header, followed by the records of the frames that were part of the packet
+     */
+    QUICLY_SENT_TYPE_PACKET,
+    QUICLY_SENT_TYPE_ACK,
+    QUICLY_SENT_TYPE_STREAM,
+    QUICLY_SENT_TYPE_MAX_STREAM_DATA,
+    QUICLY_SENT_TYPE_MAX_DATA,
+    QUICLY_SENT_TYPE_MAX_STREAMS,
+    QUICLY_SENT_TYPE_STREAMS_BLOCKED,
+    QUICLY_SENT_TYPE_RST_STREAM,
+    QUICLY_SENT_TYPE_STOP_SENDING,
+    QUICLY_SENT_TYPE_PMTU_PROBE,
+    /**
+     * a record that carries its own callback, used for events that are rare
+     */
+    QUICLY_SENT_TYPE_CALLBACK,
+    QUICLY_SENT__NUM_TYPES
+} quicly_sent_type_t;
+
 typedef struct st_quicly_sent_packet_t {
-    uint64_t packet_number;
-    int64_t sent_at;
+    QUICLY_SENT__HEADER;
     uint8_t ack_epoch;        /* epoch to be acked in */
     uint16_t bytes_in_flight; /* number of bytes in-flight for the packet (0 if not ACK-eliciting or once deemed lost) */
+    uint16_t seq;             /* order of the packet within the sentmap (modulo 2^16); PNs are shared by the sentmaps */
+    uint64_t packet_number;
+    int64_t sent_at;
 } quicly_sent_packet_t;
 
 typedef enum en_quicly_sentmap_event_t {
@@ -56,60 +94,93 @@ typedef enum en_quicly_sentmap_event_t {
 typedef int (*quicly_sent_acked_cb)(struct st_quicly_conn_t *conn, const quicly_sent_packet_t *packet, quicly_sent_t *data,
                                     quicly_sentmap_event_t event);
 
+/**
+ * A record of the sentmap. Records are variable-length; each record occupies the number of 8-byte words required for storing the
+ * member of `data` that corresponds to its type, rather than the size of the union. Small fields are packed into the octets that
+ * follow the header.
+ */
 struct st_quicly_sent_t {
-    quicly_sent_acked_cb acked;
     union {
+        struct {
+            QUICLY_SENT__HEADER;
+        } hdr;
         quicly_sent_packet_t packet;
         struct {
+            QUICLY_SENT__HEADER;
             quicly_range_t range;
         } ack;
         struct {
+            QUICLY_SENT__HEADER;
+            uint32_t length;
             quicly_stream_id_t stream_id;
-            quicly_sendstate_sent_t args;
+            uint64_t start;
         } stream;
         struct {
+            QUICLY_SENT__HEADER;
             quicly_stream_id_t stream_id;
             quicly_maxsender_sent_t args;
         } max_stream_data;
         struct {
+            QUICLY_SENT__HEADER;
             quicly_maxsender_sent_t args;
         } max_data;
         struct {
-            int uni;
+            QUICLY_SENT__HEADER;
+            uint8_t uni;
             quicly_maxsender_sent_t args;
         } max_streams;
         struct {
-            int uni;
+            QUICLY_SENT__HEADER;
+            uint8_t uni;
             quicly_maxsender_sent_t args;
         } streams_blocked;
         struct {
+            QUICLY_SENT__HEADER;
             quicly_stream_id_t stream_id;
-        } stream_state_sender;
+        } stream_state_sender; /* used by RST_STREAM and STOP_SENDING */
+        struct {
+            QUICLY_SENT__HEADER;
+            uint16_t size;
+        } pmtu_probe;
+        struct {
+            QUICLY_SENT__HEADER;
+            quicly_sent_acked_cb acked;
+        } callback;
     } data;
 };
 
+/**
+ * number of 8-byte words in each block
+ */
+#define QUICLY_SENTMAP_WORDS_PER_BLOCK 64
+
 struct st_quicly_sent_block_t {
     /**
      * next block if exists (or NULL)
      */
     struct st_quicly_sent_block_t *next;
     /**
-     * number of entries in the block
+     * previous block if exists (or NULL)
+     */
+    struct st_quicly_sent_block_t *prev;
+    /**
+     * number of records in the block that have not been discarded
      */
     size_t num_entries;
     /**
-     * insertion index within `entries`
+     * insertion offset within `words`
      */
     size_t next_insert_at;
     /**
-     * slots
+     * the records
      */
-    quicly_sent_t entries[16];
+    uint64_t words[QUICLY_SENTMAP_WORDS_PER_BLOCK];
 };
 
 /**
  * quicly_sentmap_t is a structure that holds a list of sent objects being tracked.  The list is a list of packet header and
- * frame-level objects of that packet.  Packet header is identified by quicly_sent_t::acked being quicly_sent__type_header.
+ * frame-level objects of that packet.  Packet header is identified by its type being QUICLY_SENT_TYPE_PACKET. The events of the
+ * frame-level objects are delivered to the callback being registered for each type of the object.
  *
  * The transport writes to the sentmap in the following way:
  * 1. call quicly_sentmap_prepare
@@ -124,16 +195,44 @@ struct st_quicly_sent_block_t {
  * 4. call quicly_sentmap_skip to move the iterator to the next packet header
  *
  * Note that quicly_sentmap_update also moves the iterator to the next packet header.
+ *
+ * Instead of iterating from the head, quicly_sentmap_find can be used for initializing an iterator that points to a specific packet.
+ * The packet headers are indexed by packet number, so that the cost of the lookup does not depend on the number of packets being
+ * tracked.
  */
 typedef struct st_quicly_sentmap_t {
     /**
      * the linked list includes entries that are deemed lost (up to 3*SRTT) as well
      */
     struct st_quicly_sent_block_t *head, *tail;
+    /**
+     * callbacks to be invoked for each type of the frame-level objects, indexed by quicly_sent_type_t
+     */
+    const quicly_sent_acked_cb *callbacks;
+    /**
+     * Ring buffer mapping the packet numbers to the packet headers. Slots are indexed by `packet_number & (capacity - 1)`, and cover
+     * the packet numbers in the range of [start, end). `start` always refers to a packet that exists, unless the map is empty.
+     */
+    struct {
+        struct st_quicly_sentmap_slot_t {
+            quicly_sent_t *packet;
+            struct st_quicly_sent_block_t *block;
+        } * slots;
+        /**
+         * bit vector indicating the slots that are occupied
+         */
+        uint64_t *occupied;
+        size_t capacity;
+        uint64_t start, end;
+    } index;
     /**
      * bytes in-flight
      */
     size_t bytes_in_flight;
+    /**
+     * seq of the packet to be prepared next (see quicly_sent_packet_t::seq)
+     */
+    uint16_t next_seq;
     /**
      * is non-NULL between prepare and commit, pointing to the packet header that is being written to
      */
@@ -142,21 +241,65 @@ typedef struct st_quicly_sentmap_t {
 
 typedef struct st_quicly_sentmap_iter_t {
     quicly_sent_t *p;
+    /**
+     * number of records in the block starting from `p` that have not been discarded (`p` is counted even if it has been discarded
+     * while being pointed to); zero indicates that `ref` already points to the next block
+     */
     size_t count;
     struct st_quicly_sent_block_t **ref;
 } quicly_sentmap_iter_t;
 
+/**
+ * Statistics of the pool that recycles the blocks of the sentmaps. The numbers are per-thread.
+ */
+typedef struct st_quicly_sentmap_pool_stats_t {
+    /**
+     * number of blocks allocated
+     */
+    uint64_t num_allocs;
+    /**
+     * number of allocations served from the pool
+     */
+    uint64_t num_hits;
+    /**
+     * number of blocks allocated and not yet freed
+     */
+    size_t num_in_use;
+    /**
+     * maximum value of num_in_use
+     */
+    size_t peak_in_use;
+    /**
+     * number of blocks being retained by the pool
+     */
+    size_t num_cached;
+} quicly_sentmap_pool_stats_t;
+
 extern const quicly_sent_t quicly_sentmap__end_iter;
+/**
+ * number of words occupied by each type of the records, indexed by quicly_sent_type_t
+ */
+extern const uint8_t quicly_sentmap__num_words[QUICLY_SENT__NUM_TYPES];
 
 /**
- * initializes the sentmap
+ * Initializes the sentmap. `callbacks` is an array of QUICLY_SENT__NUM_TYPES entries; it can be NULL if the only type of the
+ * frame-level objects being used is QUICLY_SENT_TYPE_CALLBACK.
  */
-static void quicly_sentmap_init(quicly_sentmap_t *map);
+static void quicly_sentmap_init(quicly_sentmap_t *map, const quicly_sent_acked_cb *callbacks);
 /**
  *
  */
 void quicly_sentmap_dispose(quicly_sentmap_t *map);
 
+/**
+ * releases the blocks being retained by the pool of the calling thread
+ */
+void quicly_sentmap_pool_clear(void);
+/**
+ * returns the statistics of the pool of the calling thread
+ */
+void quicly_sentmap_pool_get_stats(quicly_sentmap_pool_stats_t *stats);
+
 /**
  * prepares a write
  */
@@ -166,9 +309,9 @@ int quicly_sentmap_prepare(quicly_sentmap_t *map, uint64_t packet_number, int64_
  */
 static void quicly_sentmap_commit(quicly_sentmap_t *map, uint16_t bytes_in_flight);
 /**
- * Allocates a slot to contain a callback for a frame.  The function MUST be called after _prepare but before _commit.
+ * Allocates a record of given type for a frame.  The function MUST be called after _prepare but before _commit.
  */
-static quicly_sent_t *quicly_sentmap_allocate(quicly_sentmap_t *map, quicly_sent_acked_cb acked);
+static quicly_sent_t *quicly_sentmap_allocate(quicly_sentmap_t *map, quicly_sent_type_t type);
 
 /**
  * initializes the iterator
@@ -178,6 +321,11 @@ static void quicly_sentmap_init_iter(quicly_sentmap_t *map, quicly_sentmap_iter_
  * returns the current packet pointed to by the iterator
  */
 static const quicly_sent_packet_t *quicly_sentmap_get(quicly_sentmap_iter_t *iter);
+/**
+ * Initializes the iterator so that it points to the packet with given packet number, or if the packet is not being tracked, to the
+ * first packet with a larger packet number.
+ */
+void quicly_sentmap_find(quicly_sentmap_t *map, quicly_sentmap_iter_t *iter, uint64_t packet_number);
 /**
  * advances the iterator to the next packet
  */
@@ -189,14 +337,17 @@ int quicly_sentmap_update(quicly_sentmap_t *map, quicly_sentmap_iter_t *iter, qu
                           struct st_quicly_conn_t *conn);
 
 struct st_quicly_sent_block_t *quicly_sentmap__new_block(quicly_sentmap_t *map);
-int quicly_sentmap__type_packet(struct st_quicly_conn_t *conn, const quicly_sent_packet_t *packet, quicly_sent_t *sent,
-                                quicly_sentmap_event_t event);
+/**
+ * returns the record that follows the given one
+ */
+static quicly_sent_t *quicly_sentmap__next_record(quicly_sent_t *sent);
 
 /* inline definitions */
 
-inline void quicly_sentmap_init(quicly_sentmap_t *map)
+inline void quicly_sentmap_init(quicly_sentmap_t *map, const quicly_sent_acked_cb *callbacks)
 {
     *map = (quicly_sentmap_t){NULL};
+    map->callbacks = callbacks;
 }
 
 inline void quicly_sentmap_commit(quicly_sentmap_t *map, uint16_t bytes_in_flight)
@@ -210,19 +361,27 @@ inline void quicly_sentmap_commit(quicly_sentmap_t *map, uint16_t bytes_in_fligh
     map->_pending_packet = NULL;
 }
 
-inline quicly_sent_t *quicly_sentmap_allocate(quicly_sentmap_t *map, quicly_sent_acked_cb acked)
+inline quicly_sent_t *quicly_sentmap__next_record(quicly_sent_t *sent)
+{
+    return (quicly_sent_t *)((uint64_t *)sent + sent->data.hdr._num_words);
+}
+
+inline quicly_sent_t *quicly_sentmap_allocate(quicly_sentmap_t *map, quicly_sent_type_t type)
 {
     struct st_quicly_sent_block_t *block;
+    size_t num_words = quicly_sentmap__num_words[type];
 
-    if ((block = map->tail) == NULL || block->next_insert_at == sizeof(block->entries) / sizeof(block->entries[0])) {
+    if ((block = map->tail) == NULL || block->next_insert_at + num_words > QUICLY_SENTMAP_WORDS_PER_BLOCK) {
         if ((block = quicly_sentmap__new_block(map)) == NULL)
             return NULL;
     }
 
-    quicly_sent_t *sent = block->entries + block->next_insert_at++;
+    quicly_sent_t *sent = (quicly_sent_t *)(block->words + block->next_insert_at);
+    block->next_insert_at += num_words;
     ++block->num_entries;
 
-    sent->acked = acked;
+    sent->data.hdr._type = type;
+    sent->data.hdr._num_words = num_words;
 
     return sent;
 }
@@ -232,9 +391,10 @@ inline void quicly_sentmap_init_iter(quicly_sentmap_t *map, quicly_sentmap_iter_
     iter->ref = &map->head;
     if (map->head != NULL) {
         assert(map->head->num_entries != 0);
-        for (iter->p = map->head->entries; iter->p->acked == NULL; ++iter->p)
+        for (iter->p = (quicly_sent_t *)map->head->words; iter->p->data.hdr._type == QUICLY_SENT_TYPE_DISCARDED;
+             iter->p = quicly_sentmap__next_record(iter->p))
             ;
-        assert(iter->p->acked == quicly_sentmap__type_packet);
+        assert(iter->p->data.hdr._type == QUICLY_SENT_TYPE_PACKET);
         iter->count = map->head->num_entries;
     } else {
         iter->p = (quicly_sent_t *)&quicly_sentmap__end_iter;
@@ -244,7 +404,7 @@ inline void quicly_sentmap_init_iter(quicly_sentmap_t *map, quicly_sentmap_iter_
 
 inline const quicly_sent_packet_t *quicly_sentmap_get(quicly_sentmap_iter_t *iter)
 {
-    assert(iter->p->acked == quicly_sentmap__type_packet);
+    assert(iter->p->data.hdr._type == QUICLY_SENT_TYPE_PACKET);
     return &iter->p->data.packet;
 }
 
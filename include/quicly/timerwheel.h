@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2019 Fastly, Kazuho Oku
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#ifndef quicly_timerwheel_h
+#define quicly_timerwheel_h
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "quicly.h"
+
+#define QUICLY_TIMERWHEEL_BITS_PER_WHEEL 6
+#define QUICLY_TIMERWHEEL_SLOTS_PER_WHEEL (1 << QUICLY_TIMERWHEEL_BITS_PER_WHEEL)
+#define QUICLY_TIMERWHEEL_NUM_WHEELS ((63 + QUICLY_TIMERWHEEL_BITS_PER_WHEEL - 1) / QUICLY_TIMERWHEEL_BITS_PER_WHEEL)
+
+/**
+ * A timer that can be registered to the timer wheel. The structure is to be embedded in the object that owns the timer.
+ */
+struct st_quicly_timerwheel_timer_t {
+    /**
+     * link within the slot of the wheel; not linked when the timer is not registered
+     */
+    quicly_linklist_t _link;
+    /**
+     * the time at which the timer expires
+     */
+    int64_t at;
+};
+
+/**
+ * Creates a hierarchical timer wheel. Each wheel has QUICLY_TIMERWHEEL_SLOTS_PER_WHEEL slots, and each slot of a wheel spans the
+ * entire range of the wheel below. Registering, updating and unregistering a timer is O(1). Retrieving the expired timers is
+ * proportional to the number of timers being expired or moved to the lower wheels, rather than to the number of timers registered.
+ * Once the wheel is set to quicly_context_t::timer_wheel, the connections register their timeouts (i.e. the value returned by
+ * quicly_get_first_timeout) to the wheel, and update them as they change.
+ * @param now  current time, on the clock of quicly_context_t::now
+ */
+quicly_timerwheel_t *quicly_timerwheel_create(int64_t now);
+/**
+ * Destroys the wheel. The timers being registered are not touched.
+ */
+void quicly_timerwheel_destroy(quicly_timerwheel_t *wheel);
+/**
+ * initializes a timer
+ */
+static void quicly_timerwheel_init_timer(quicly_timerwheel_timer_t *timer);
+/**
+ * returns if the timer is registered to a wheel
+ */
+static int quicly_timerwheel_timer_is_active(quicly_timerwheel_timer_t *timer);
+/**
+ * (Re)registers the timer to expire at the given time. INT64_MAX unregisters the timer. A time in the past causes the timer to be
+ * returned by the next call to quicly_timerwheel_get_expired.
+ */
+void quicly_timerwheel_set(quicly_timerwheel_t *wheel, quicly_timerwheel_timer_t *timer, int64_t at);
+/**
+ * Unregisters the timer. It is safe to call the function for timers that are not registered.
+ */
+void quicly_timerwheel_unset(quicly_timerwheel_t *wheel, quicly_timerwheel_timer_t *timer);
+/**
+ * Returns the time at which quicly_timerwheel_get_expired should be called next, or INT64_MAX if no timers are registered. The
+ * value is the start time of the earliest slot being occupied, and therefore the cost does not depend on the number of timers. It
+ * is exact when the earliest timer is due within QUICLY_TIMERWHEEL_SLOTS_PER_WHEEL units of time. Otherwise, it is a lower bound,
+ * and the call to quicly_timerwheel_get_expired at that time moves the timers to a finer wheel, possibly returning none of them.
+ * A value not greater than the time of the last call to quicly_timerwheel_get_expired means that some timers have already expired.
+ */
+int64_t quicly_timerwheel_get_first_timeout(quicly_timerwheel_t *wheel);
+/**
+ * Unregisters up to `max_timers` timers that have expired by `now`, storing them to `timers`. The timers are returned in no
+ * specific order.
+ * @return number of timers being returned; if the value equals `max_timers`, there might be more timers that have expired
+ */
+size_t quicly_timerwheel_get_expired(quicly_timerwheel_t *wheel, int64_t now, quicly_timerwheel_timer_t **timers,
+                                     size_t max_timers);
+/**
+ * returns the number of timers being registered
+ */
+size_t quicly_timerwheel_size(quicly_timerwheel_t *wheel);
+
+/* inline definitions */
+
+inline void quicly_timerwheel_init_timer(quicly_timerwheel_timer_t *timer)
+{
+    quicly_linklist_init(&timer->_link);
+    timer->at = INT64_MAX;
+}
+
+inline int quicly_timerwheel_timer_is_active(quicly_timerwheel_timer_t *timer)
+{
+    return quicly_linklist_is_linked(&timer->_link);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,158 @@
+/*
+ * Copyright (c) 2019 Fastly, Kazuho Oku
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include "khash.h"
+#include "quicly/connmap.h"
+
+static inline khint_t hash_cid(const quicly_cid_t *cid)
+{
+    khint_t h = cid->len;
+    size_t i;
+
+    for (i = 0; i != cid->len; ++i)
+        h = (h << 5) - h + cid->cid[i];
+    return h;
+}
+
+static inline int cid_is_equal(const quicly_cid_t *x, const quicly_cid_t *y)
+{
+    return x->len == y->len && memcmp(x->cid, y->cid, x->len) == 0;
+}
+
+/* the keys point to the CIDs stored within the connections */
+KHASH_INIT(quicly_conn_map_t, const quicly_cid_t *, quicly_conn_t *, 1, hash_cid, cid_is_equal)
+
+struct st_quicly_conn_map_t {
+    /**
+     * host CIDs, used for matching packets of any type
+     */
+    khash_t(quicly_conn_map_t) * host_cids;
+    /**
+     * CIDs offered by the clients, used for matching long header packets that arrive before the clients switch to the host CIDs
+     */
+    khash_t(quicly_conn_map_t) * offered_cids;
+    size_t num_conns;
+};
+
+quicly_conn_map_t *quicly_conn_map_create(void)
+{
+    quicly_conn_map_t *map;
+
+    if ((map = malloc(sizeof(*map))) == NULL)
+        return NULL;
+    map->host_cids = kh_init(quicly_conn_map_t);
+    map->offered_cids = kh_init(quicly_conn_map_t);
+    map->num_conns = 0;
+    if (map->host_cids == NULL || map->offered_cids == NULL) {
+        quicly_conn_map_destroy(map);
+        return NULL;
+    }
+
+    return map;
+}
+
+void quicly_conn_map_destroy(quicly_conn_map_t *map)
+{
+    if (map->host_cids != NULL)
+        kh_destroy(quicly_conn_map_t, map->host_cids);
+    if (map->offered_cids != NULL)
+        kh_destroy(quicly_conn_map_t, map->offered_cids);
+    free(map);
+}
+
+static int add_cid(khash_t(quicly_conn_map_t) * table, const quicly_cid_t *cid, quicly_conn_t *conn, int *added)
+{
+    khiter_t iter;
+    int r;
+
+    *added = 0;
+    if (cid->len == 0)
+        return 0;
+    if ((iter = kh_put(quicly_conn_map_t, table, cid, &r)) == kh_end(table))
+        return PTLS_ERROR_NO_MEMORY;
+    if (r == 0)
+        return kh_val(table, iter) == conn ? 0 : QUICLY_ERROR_CID_IN_USE;
+    kh_val(table, iter) = conn;
+    *added = 1;
+    return 0;
+}
+
+static int remove_cid(khash_t(quicly_conn_map_t) * table, const quicly_cid_t *cid, quicly_conn_t *conn)
+{
+    khiter_t iter;
+
+    if (cid->len == 0)
+        return 0;
+    if ((iter = kh_get(quicly_conn_map_t, table, cid)) == kh_end(table) || kh_val(table, iter) != conn)
+        return 0;
+    kh_del(quicly_conn_map_t, table, iter);
+    return 1;
+}
+
+int quicly_conn_map_add(quicly_conn_map_t *map, quicly_conn_t *conn)
+{
+    int host_added, offered_added = 0, ret;
+
+    if ((ret = add_cid(map->host_cids, quicly_get_host_cid(conn), conn, &host_added)) != 0)
+        return ret;
+    if (!quicly_is_client(conn) && (ret = add_cid(map->offered_cids, quicly_get_offered_cid(conn), conn, &offered_added)) != 0) {
+        if (host_added)
+            remove_cid(map->host_cids, quicly_get_host_cid(conn), conn);
+        return ret;
+    }
+    if (host_added || offered_added)
+        ++map->num_conns;
+
+    return 0;
+}
+
+void quicly_conn_map_remove(quicly_conn_map_t *map, quicly_conn_t *conn)
+{
+    int removed = remove_cid(map->host_cids, quicly_get_host_cid(conn), conn);
+    removed |= remove_cid(map->offered_cids, quicly_get_offered_cid(conn), conn);
+    if (removed)
+        --map->num_conns;
+}
+
+quicly_conn_t *quicly_conn_map_lookup(quicly_conn_map_t *map, quicly_decoded_packet_t *packet)
+{
+    quicly_cid_t key;
+    khiter_t iter;
+
+    if (packet->cid.dest.len == 0 || packet->cid.dest.len > sizeof(key.cid))
+        return NULL;
+    memcpy(key.cid, packet->cid.dest.base, packet->cid.dest.len);
+    key.len = (uint8_t)packet->cid.dest.len;
+
+    if ((iter = kh_get(quicly_conn_map_t, map->host_cids, &key)) != kh_end(map->host_cids))
+        return kh_val(map->host_cids, iter);
+    if ((packet->octets.base[0] & 0x80) != 0 /* long header */ &&
+        (iter = kh_get(quicly_conn_map_t, map->offered_cids, &key)) != kh_end(map->offered_cids))
+        return kh_val(map->offered_cids, iter);
+
+    return NULL;
+}
+
+size_t quicly_conn_map_size(quicly_conn_map_t *map)
+{
+    return map->num_conns;
+}
@@ -31,7 +31,8 @@ uint8_t *quicly_encode_path_challenge_frame(uint8_t *dst, int is_response, const
     return dst;
 }
 
-uint8_t *quicly_encode_ack_frame(uint8_t *dst, uint8_t *dst_end, quicly_ranges_t *ranges, uint64_t ack_delay)
+uint8_t *quicly_encode_ack_frame(uint8_t *dst, uint8_t *dst_end, quicly_ranges_t *ranges, const quicly_ecn_counts_t *ecn_counts,
+                                 uint64_t ack_delay)
 {
 #define WRITE_BLOCK(start, end)                                                                                                    \
     do {                                                                                                                           \
@@ -46,7 +47,7 @@ uint8_t *quicly_encode_ack_frame(uint8_t *dst, uint8_t *dst_end, quicly_ranges_t
 
     assert(ranges->num_ranges != 0);
 
-    *dst++ = QUICLY_FRAME_TYPE_ACK;
+    *dst++ = ecn_counts != NULL ? QUICLY_FRAME_TYPE_ACK_ECN : QUICLY_FRAME_TYPE_ACK;
     dst = quicly_encodev(dst, ranges->ranges[range_index].end - 1); /* largest acknowledged */
     dst = quicly_encodev(dst, ack_delay);                           /* ack delay */
     dst = quicly_encodev(dst, ranges->num_ranges - 1);              /* ack blocks */
@@ -58,6 +59,14 @@ uint8_t *quicly_encode_ack_frame(uint8_t *dst, uint8_t *dst_end, quicly_ranges_t
         WRITE_BLOCK(ranges->ranges[range_index].end, ranges->ranges[range_index + 1].start);
     }
 
+    if (ecn_counts != NULL) {
+        if (dst_end - dst < 3 * 8)
+            return NULL;
+        dst = quicly_encodev(dst, ecn_counts->ect0);
+        dst = quicly_encodev(dst, ecn_counts->ect1);
+        dst = quicly_encodev(dst, ecn_counts->ce);
+    }
+
     return dst;
 
 #undef WRITE_BLOCK
@@ -98,10 +107,12 @@ int quicly_decode_ack_frame(const uint8_t **src, const uint8_t *end, quicly_ack_
     }
 
     if (is_ack_ecn) {
-        /* just skip ECT(0), ECT(1), ECT-CE counters for the time being */
-        for (i = 0; i != 3; ++i)
-            if (quicly_decodev(src, end) == UINT64_MAX)
-                goto Error;
+        if ((frame->ecn_counts.ect0 = quicly_decodev(src, end)) == UINT64_MAX ||
+            (frame->ecn_counts.ect1 = quicly_decodev(src, end)) == UINT64_MAX ||
+            (frame->ecn_counts.ce = quicly_decodev(src, end)) == UINT64_MAX)
+            goto Error;
+    } else {
+        frame->ecn_counts = (quicly_ecn_counts_t){0};
     }
     return 0;
 Error:
@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2019 Fastly, Kazuho Oku
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include "quicly/packetpool.h"
+
+#define CACHE_LINE_SIZE 64
+#define MIN_SLOT_SIZE_BITS 11 /* 2KB */
+#define NUM_SLOT_SIZES 7      /* up to 128KB */
+#define MAX_BYTES_CACHED_PER_SIZE (4 * 1024 * 1024)
+#define SLOT_SIZE(size_class) ((size_t)1 << (MIN_SLOT_SIZE_BITS + (size_class)))
+
+/**
+ * header of each slot, followed by the datagram; padded to the size of a cache line, so that the datagram is cache-aligned
+ */
+struct st_quicly_packet_pool_slot_t {
+    struct st_quicly_packet_pool_slot_t *next;
+    /**
+     * NUM_SLOT_SIZES if the slot has been allocated by malloc
+     */
+    size_t size_class;
+};
+
+#define SLOT_HEADER_SIZE ((sizeof(struct st_quicly_packet_pool_slot_t) + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE)
+
+static __thread struct {
+    struct {
+        struct st_quicly_packet_pool_slot_t *head;
+        size_t count;
+    } freelists[NUM_SLOT_SIZES];
+    quicly_packet_pool_stats_t stats;
+} pool;
+
+quicly_datagram_t *quicly_pooled_alloc_packet(quicly_context_t *ctx, socklen_t salen, size_t payloadsize)
+{
+    size_t size = SLOT_HEADER_SIZE + offsetof(quicly_datagram_t, sa) + salen + payloadsize, size_class;
+    struct st_quicly_packet_pool_slot_t *slot;
+    quicly_datagram_t *packet;
+
+    for (size_class = 0; size_class != NUM_SLOT_SIZES; ++size_class)
+        if (size <= SLOT_SIZE(size_class))
+            break;
+
+    if (size_class != NUM_SLOT_SIZES && (slot = pool.freelists[size_class].head) != NULL) {
+        pool.freelists[size_class].head = slot->next;
+        --pool.freelists[size_class].count;
+        pool.stats.bytes_cached -= SLOT_SIZE(size_class);
+        ++pool.stats.num_hits;
+    } else {
+        void *p;
+        if (posix_memalign(&p, CACHE_LINE_SIZE, size_class != NUM_SLOT_SIZES ? SLOT_SIZE(size_class) : size) != 0)
+            return NULL;
+        slot = p;
+        slot->size_class = size_class;
+    }
+    ++pool.stats.num_allocs;
+    if (++pool.stats.num_in_use > pool.stats.peak_in_use)
+        pool.stats.peak_in_use = pool.stats.num_in_use;
+
+    packet = (quicly_datagram_t *)((uint8_t *)slot + SLOT_HEADER_SIZE);
+    packet->salen = salen;
+    packet->data.base = (uint8_t *)packet + offsetof(quicly_datagram_t, sa) + salen;
+
+    return packet;
+}
+
+void quicly_pooled_free_packet(quicly_context_t *ctx, quicly_datagram_t *packet)
+{
+    struct st_quicly_packet_pool_slot_t *slot = (void *)((uint8_t *)packet - SLOT_HEADER_SIZE);
+    size_t size_class = slot->size_class;
+
+    --pool.stats.num_in_use;
+
+    if (size_class == NUM_SLOT_SIZES || (pool.freelists[size_class].count + 1) * SLOT_SIZE(size_class) > MAX_BYTES_CACHED_PER_SIZE) {
+        free(slot);
+        return;
+    }
+    slot->next = pool.freelists[size_class].head;
+    pool.freelists[size_class].head = slot;
+    ++pool.freelists[size_class].count;
+    pool.stats.bytes_cached += SLOT_SIZE(size_class);
+}
+
+void quicly_packet_pool_clear(void)
+{
+    size_t size_class;
+
+    for (size_class = 0; size_class != NUM_SLOT_SIZES; ++size_class) {
+        struct st_quicly_packet_pool_slot_t *slot;
+        while ((slot = pool.freelists[size_class].head) != NULL) {
+            pool.freelists[size_class].head = slot->next;
+            free(slot);
+        }
+        pool.freelists[size_class].count = 0;
+    }
+    pool.stats.bytes_cached = 0;
+}
+
+void quicly_packet_pool_get_stats(quicly_packet_pool_stats_t *stats)
+{
+    *stats = pool.stats;
+}
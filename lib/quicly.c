@@ -27,13 +27,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
-#include <sys/time.h>
+#include <time.h>
 #include "khash.h"
 #include "cc.h"
 #include "quicly.h"
+#include "quicly/connmap.h"
 #include "quicly/sentmap.h"
 #include "quicly/frame.h"
 #include "quicly/streambuf.h"
+#include "quicly/timerwheel.h"
 
 #define QUICLY_PROTOCOL_VERSION 0xff000011
 
@@ -51,8 +53,7 @@
 
 #define QUICLY_PACKET_IS_LONG_HEADER(first_byte) (((first_byte)&QUICLY_LONG_HEADER_BIT) != 0)
 
-#define QUICLY_MAX_PN_SIZE 4  /* maximum defined by the RFC used for calculating header protection sampling offset */
-#define QUICLY_SEND_PN_SIZE 2 /* size of PN used for sending */
+#define QUICLY_MAX_PN_SIZE 4 /* maximum defined by the RFC used for calculating header protection sampling offset */
 
 #define QUICLY_TLS_EXTENSION_TYPE_TRANSPORT_PARAMETERS 0xffa5
 #define QUICLY_TRANSPORT_PARAMETER_ID_ORIGINAL_CONNECTION_ID 0
@@ -70,12 +71,13 @@
 #define QUICLY_TRANSPORT_PARAMETER_ID_DISABLE_MIGRATION 12
 #define QUICLY_TRANSPORT_PARAMETER_ID_PREFERRED_ADDRESS 13
 
-#define QUICLY_ACK_DELAY_EXPONENT 10
+#define QUICLY_ACK_DELAY_EXPONENT 3
 
 #define QUICLY_EPOCH_INITIAL 0
 #define QUICLY_EPOCH_0RTT 1
 #define QUICLY_EPOCH_HANDSHAKE 2
 #define QUICLY_EPOCH_1RTT 3
+#define QUICLY_NUM_EPOCHS 4
 
 #define QUICLY_MAX_TOKEN_LEN 512 /* maximum length of token that we would accept */
 
@@ -84,6 +86,35 @@
  */
 #define MIN_SEND_WINDOW 64
 
+/**
+ * PMTU discovery stops once the search range becomes narrower than this value (in bytes)
+ */
+#define PMTUD_MIN_STEP 16
+/**
+ * number of probes of the same size that need to be lost in a row for the size to be deemed undeliverable
+ */
+#define PMTUD_MAX_PROBES 3
+/**
+ * interval (in microseconds) after which PMTU discovery is restarted once it has converged
+ */
+#define PMTUD_RAISE_INTERVAL (600 * 1000000)
+/**
+ * max number of packets that are sealed at once when quicly_context_t::defer_sealing is set
+ */
+#define SEAL_BATCH_SIZE 32
+/**
+ * initial congestion window (in bytes)
+ */
+#define INITIAL_CWND (1280 * 8)
+
+/**
+ * phases of careful resume (see quicly_connect)
+ */
+#define CAREFUL_RESUME_NONE 0
+#define CAREFUL_RESUME_RECONNAISSANCE 1 /* waiting for the handshake to complete and for the RTT to be measured */
+#define CAREFUL_RESUME_UNVALIDATED 2    /* sending using the raised window */
+#define CAREFUL_RESUME_VALIDATING 3     /* waiting for the packets sent using the raised window to be acknowledged */
+
 #define AEAD_BASE_LABEL "tls13 quic "
 
 #define STATELESS_RESET_TOKEN_SIZE 16
@@ -139,6 +170,14 @@ struct st_quicly_pn_space_t {
      * packet count before ack is sent
      */
     uint32_t unacked_count;
+    /**
+     * number of packets received with each ECN codepoint, to be reported using ACK_ECN frames
+     */
+    quicly_ecn_counts_t ecn_counts;
+    /**
+     * ECN counters last reported by the peer for the packets sent in this packet number space
+     */
+    quicly_ecn_counts_t peer_ecn_counts;
 };
 
 struct st_quicly_handshake_space_t {
@@ -159,10 +198,57 @@ struct st_quicly_application_space_t {
             ptls_aead_context_t *aead[2];
         } ingress;
         struct st_quicly_cipher_context_t egress;
+        /**
+         * 1-RTT key update. The AEAD contexts of the next generation are derived ahead of time (see prepare_next_keys), so that
+         * switching to them costs nothing on the packet path.
+         */
+        struct {
+            struct {
+                /**
+                 * secret of the current generation, also used for creating decryptors (see quicly_new_decryptor)
+                 */
+                uint8_t secret[PTLS_MAX_DIGEST_SIZE];
+                uint8_t next_secret[PTLS_MAX_DIGEST_SIZE];
+                uint64_t generation;
+                /**
+                 * if the AEAD slot not being used by the current generation holds the key of the next generation; otherwise, the
+                 * slot holds the key of the previous generation (or the 0-RTT key)
+                 */
+                int next_ready;
+                /**
+                 * the key of the previous generation is retained until this time (about 3 PTO after the update), so that packets
+                 * reordered across the update can be decrypted
+                 */
+                int64_t retain_prev_until;
+            } ingress;
+            struct {
+                uint8_t secret[PTLS_MAX_DIGEST_SIZE];
+                uint8_t next_secret[PTLS_MAX_DIGEST_SIZE];
+                uint64_t generation;
+                ptls_aead_context_t *next_aead;
+                /**
+                 * PN of the first packet sent using the current generation
+                 */
+                uint64_t first_pn;
+                /**
+                 * when a packet sent using the current generation was first acknowledged, or INT64_MAX if none has been
+                 */
+                int64_t confirmed_at;
+                /**
+                 * if the application has requested a key update (see quicly_initiate_key_update)
+                 */
+                int requested;
+            } egress;
+        } key_update;
     } cipher;
     int one_rtt_writable;
 };
 
+struct st_quicly_decryptor_t {
+    ptls_cipher_context_t *header_protection;
+    ptls_aead_context_t *aead[2];
+};
+
 struct st_quicly_conn_t {
     struct _st_quicly_conn_public_t super;
     /**
@@ -198,21 +284,49 @@ struct st_quicly_conn_t {
         struct {
             quicly_maxsender_t *uni, *bidi;
         } max_streams;
+        /**
+         * state of quicly_receive_batch; loss detection is deferred until all the packets in the batch are processed
+         */
+        struct {
+            uint8_t active : 1;
+            /**
+             * bit vector of the epochs in which ACK frames have been received
+             */
+            uint8_t ack_epochs;
+        } batch;
     } ingress;
     /**
      *
      */
     struct {
         /**
-         * contains actions that needs to be performed when an ack is being received
-         */
-        quicly_sentmap_t sentmap;
-        /**
-         * all packets where pn < max_lost_pn are deemed lost
+         * Packets being tracked and the state of loss detection, for each packet number space indexed by the epoch. The slot for
+         * 0-RTT is not used, as 0-RTT packets are acknowledged in the 1-RTT packet number space.
          */
-        uint64_t max_lost_pn;
+        struct st_quicly_sent_space_t {
+            /**
+             * contains actions that needs to be performed when an ack is being received
+             */
+            quicly_sentmap_t sentmap;
+            /**
+             * all packets where pn < max_lost_pn are deemed lost
+             */
+            uint64_t max_lost_pn;
+            /**
+             * the largest packet number acknowledged in the packet number space
+             */
+            uint64_t largest_acked;
+            /**
+             * seq of the packet carrying `largest_acked` (see quicly_sent_packet_t::seq)
+             */
+            uint16_t largest_acked_seq;
+            /**
+             * time at which the next packet will be deemed lost based on exceeding the reordering window in time (or INT64_MAX)
+             */
+            int64_t loss_time;
+        } spaces[QUICLY_NUM_EPOCHS];
         /**
-         * loss recovery
+         * loss recovery; `loss.loss_time` is the earliest of the `loss_time` of each packet number space
          */
         quicly_loss_t loss;
         /**
@@ -264,7 +378,60 @@ struct st_quicly_conn_t {
             struct cc_var ccv;
             uint64_t end_of_recovery;
             unsigned in_first_rto : 1;
+            /**
+             * careful resume
+             */
+            struct {
+                quicly_path_state_t remembered;
+                /**
+                 * the range of packet numbers that have been sent using the raised window, but are yet to be acknowledged
+                 */
+                uint64_t jump_pn, validate_pn;
+                uint8_t phase;
+            } careful_resume;
         } cc;
+        /**
+         * used only when quicly_context_t::pacer is set
+         */
+        quicly_pacer_t pacer;
+        /**
+         * ECN state (used only when quicly_context_t::enable_ecn is set)
+         */
+        struct {
+            /**
+             * if the packets are being marked ECT(0); cleared when the path or the peer fails ECN validation
+             */
+            unsigned is_capable : 1;
+        } ecn;
+        /**
+         * size of the packets being sent; starts from quicly_context_t::max_packet_size and is raised by PMTU discovery
+         */
+        uint16_t max_packet_size;
+        /**
+         * PMTU discovery state (used only when quicly_context_t::max_probed_packet_size is set)
+         */
+        struct {
+            /**
+             * largest packet size that has not been proven to be undeliverable
+             */
+            uint16_t search_high;
+            /**
+             * size of the probe in flight, or zero if none
+             */
+            uint16_t probe_size;
+            /**
+             * number of probes of the next size that have been lost in a row
+             */
+            uint8_t num_lost;
+            /**
+             * packet number of the probe in flight, or UINT64_MAX if none; the loss of the probe is not a sign of congestion
+             */
+            uint64_t probe_pn;
+            /**
+             * when the next probe can be sent
+             */
+            int64_t next_probe_at;
+        } pmtud;
     } egress;
     /**
      * crypto data
@@ -284,6 +451,10 @@ struct st_quicly_conn_t {
          * whether if the timer to discard the handshake contexts has been activated
          */
         uint8_t handshake_scheduled_for_discard;
+        /**
+         * if the handshake messages are waiting for quicly_complete_handshake to be called
+         */
+        uint8_t handshake_pending;
     } crypto;
     /**
      *
@@ -304,6 +475,10 @@ struct st_quicly_conn_t {
      * retry token
      */
     ptls_iovec_t token;
+    /**
+     * registered to quicly_context_t::timer_wheel, if set
+     */
+    quicly_timerwheel_timer_t timer;
 };
 
 static int crypto_stream_receive(quicly_stream_t *stream, size_t off, const void *src, size_t len);
@@ -313,12 +488,22 @@ static const quicly_stream_callbacks_t crypto_stream_callbacks = {quicly_streamb
 
 static int update_traffic_key_cb(ptls_update_traffic_key_t *self, ptls_t *tls, int is_enc, size_t epoch, const void *secret);
 static int discard_sentmap_by_epoch(quicly_conn_t *conn, unsigned ack_epochs);
+static void update_timer(quicly_conn_t *conn);
+static const quicly_sent_acked_cb sent_callbacks[QUICLY_SENT__NUM_TYPES];
 
 const quicly_context_t quicly_default_context = {
     NULL,                      /* tls */
     0,                         /* next_master_id */
     1280,                      /* max_packet_size */
+    0,                         /* max_gso_segments */
+    0,                         /* max_probed_packet_size */
     &quicly_loss_default_conf, /* loss */
+    NULL,                      /* pacer */
+    1 << 23,                   /* max_packets_per_key */
+    0,                         /* pace_by_txtime */
+    0,                         /* enable_ecn */
+    0,                         /* defer_sealing */
+    0,                         /* async_handshake */
     {
         {1 * 1024 * 1024, 1 * 1024 * 1024, 1 * 1024 * 1024}, /* max_stream_data */
         16 * 1024 * 1024,                                    /* max_data */
@@ -334,6 +519,8 @@ const quicly_context_t quicly_default_context = {
     NULL, /* on_stream_open */
     NULL, /* on_conn_close */
     quicly_default_now,
+    NULL,      /* conn_map */
+    NULL,      /* timer_wheel */
     {0, NULL}, /* event_log */
 };
 
@@ -351,7 +538,7 @@ static void update_now(quicly_context_t *ctx)
     assert(cc_hz == 100);
     if (base == 0)
         base = now;
-    int new_ticks = (int)((now - base) / 10);
+    int new_ticks = (int)((now - base) / 10000);
     if (cc_ticks != new_ticks)
         cc_ticks = new_ticks;
 }
@@ -401,7 +588,9 @@ size_t quicly_decode_packet(quicly_decoded_packet_t *packet, const uint8_t *src,
 
     packet->octets = ptls_iovec_init(src, len);
     packet->datagram_size = len;
+    packet->ecn = QUICLY_ECN_NOT_ECT;
     packet->token = ptls_iovec_init(NULL, 0);
+    packet->decrypted.payload = ptls_iovec_init(NULL, 0);
     ++src;
 
     if (QUICLY_PACKET_IS_LONG_HEADER(packet->octets.base[0])) {
@@ -485,9 +674,19 @@ uint64_t quicly_determine_packet_number(uint32_t bits, uint32_t mask, uint64_t n
     return actual;
 }
 
+static size_t get_bytes_in_flight(quicly_conn_t *conn)
+{
+    size_t epoch, bytes_in_flight = 0;
+
+    for (epoch = 0; epoch != QUICLY_NUM_EPOCHS; ++epoch)
+        bytes_in_flight += conn->egress.spaces[epoch].sentmap.bytes_in_flight;
+
+    return bytes_in_flight;
+}
+
 static void assert_consistency(quicly_conn_t *conn, int run_timers)
 {
-    if (conn->egress.sentmap.bytes_in_flight != 0) {
+    if (get_bytes_in_flight(conn) != 0) {
         assert(conn->egress.loss.alarm_at != INT64_MAX);
     } else {
         assert(conn->egress.loss.loss_time == INT64_MAX);
@@ -617,6 +816,7 @@ int quicly_stream_sync_sendbuf(quicly_stream_t *stream, int activate)
     }
 
     resched_stream_data(stream);
+    update_timer(stream->conn);
     return 0;
 }
 
@@ -624,8 +824,10 @@ void quicly_stream_sync_recvbuf(quicly_stream_t *stream, size_t shift_amount)
 {
     stream->recvstate.data_off += shift_amount;
     if (stream->stream_id >= 0) {
-        if (should_update_max_stream_data(stream))
+        if (should_update_max_stream_data(stream)) {
             sched_stream_control(stream);
+            update_timer(stream->conn);
+        }
     }
 }
 
@@ -666,15 +868,12 @@ static int write_crypto_data(quicly_conn_t *conn, ptls_buffer_t *tlsbuf, size_t
     return 0;
 }
 
-int crypto_stream_receive(quicly_stream_t *stream, size_t off, const void *src, size_t len)
+static int handle_crypto_messages(quicly_stream_t *stream)
 {
     size_t in_epoch = -(1 + stream->stream_id), epoch_offsets[5] = {0};
     ptls_iovec_t input;
     ptls_buffer_t output;
-    int ret;
-
-    if ((ret = quicly_streambuf_ingress_receive(stream, off, src, len)) != 0)
-        return ret;
+    int ret = 0;
 
     ptls_buffer_init(&output, "", 0);
 
@@ -701,6 +900,24 @@ Exit:
     return ret;
 }
 
+int crypto_stream_receive(quicly_stream_t *stream, size_t off, const void *src, size_t len)
+{
+    int ret;
+
+    if ((ret = quicly_streambuf_ingress_receive(stream, off, src, len)) != 0)
+        return ret;
+
+    /* when running asynchronously, ClientHello is kept in the buffer until the application calls quicly_complete_handshake, so
+     * that the costly operations (i.e. signing) can be run off the event loop */
+    if (stream->conn->super.ctx->async_handshake && !quicly_is_client(stream->conn) &&
+        stream->stream_id == -(quicly_stream_id_t)(1 + QUICLY_EPOCH_INITIAL)) {
+        stream->conn->crypto.handshake_pending = 1;
+        return 0;
+    }
+
+    return handle_crypto_messages(stream);
+}
+
 static void init_stream_properties(quicly_stream_t *stream, uint32_t initial_max_stream_data_local,
                                    uint64_t initial_max_stream_data_remote)
 {
@@ -823,10 +1040,41 @@ void quicly_get_max_data(quicly_conn_t *conn, uint64_t *send_permitted, uint64_t
         *consumed = conn->ingress.max_data.bytes_consumed;
 }
 
+uint16_t quicly_get_max_packet_size(quicly_conn_t *conn)
+{
+    return conn->egress.max_packet_size;
+}
+
+uint64_t quicly_get_key_generation(quicly_conn_t *conn, int is_enc)
+{
+    if (conn->application == NULL)
+        return 0;
+    return is_enc ? conn->application->cipher.key_update.egress.generation : conn->application->cipher.key_update.ingress.generation;
+}
+
+void quicly_get_path_state(quicly_conn_t *conn, quicly_path_state_t *state)
+{
+    state->smoothed_rtt = conn->egress.loss.rtt.smoothed;
+    state->min_rtt = conn->egress.loss.rtt.minimum;
+    state->cwnd = cc_get_cwnd(&conn->egress.cc.ccv);
+}
+
+void quicly_initiate_key_update(quicly_conn_t *conn)
+{
+    if (conn->application != NULL)
+        conn->application->cipher.key_update.egress.requested = 1;
+}
+
 static void update_loss_alarm(quicly_conn_t *conn)
 {
-    quicly_loss_update_alarm(&conn->egress.loss, now, conn->egress.last_retransmittable_sent_at,
-                             conn->egress.sentmap.bytes_in_flight != 0);
+    int has_outstanding = get_bytes_in_flight(conn) != 0;
+
+    if (!has_outstanding) {
+        size_t epoch;
+        for (epoch = 0; epoch != QUICLY_NUM_EPOCHS; ++epoch)
+            conn->egress.spaces[epoch].loss_time = INT64_MAX;
+    }
+    quicly_loss_update_alarm(&conn->egress.loss, now, conn->egress.last_retransmittable_sent_at, has_outstanding);
 }
 
 static int create_handshake_flow(quicly_conn_t *conn, size_t epoch)
@@ -863,6 +1111,8 @@ static struct st_quicly_pn_space_t *alloc_pn_space(size_t sz)
     space->largest_pn_received_at = INT64_MAX;
     space->next_expected_packet_number = 0;
     space->unacked_count = 0;
+    space->ecn_counts = (quicly_ecn_counts_t){0};
+    space->peer_ecn_counts = (quicly_ecn_counts_t){0};
     if (sz != sizeof(*space))
         memset((uint8_t *)space + sizeof(*space), 0, sz - sizeof(*space));
 
@@ -875,10 +1125,25 @@ static void do_free_pn_space(struct st_quicly_pn_space_t *space)
     free(space);
 }
 
-static int record_receipt(quicly_conn_t *conn, struct st_quicly_pn_space_t *space, uint64_t pn, int is_ack_only, size_t epoch)
+static int record_receipt(quicly_conn_t *conn, struct st_quicly_pn_space_t *space, uint64_t pn, uint8_t ecn, int is_ack_only,
+                          size_t epoch)
 {
     int ret;
 
+    switch (ecn) {
+    case QUICLY_ECN_ECT0:
+        ++space->ecn_counts.ect0;
+        break;
+    case QUICLY_ECN_ECT1:
+        ++space->ecn_counts.ect1;
+        break;
+    case QUICLY_ECN_CE:
+        ++space->ecn_counts.ce;
+        break;
+    default:
+        break;
+    }
+
     if ((ret = quicly_ranges_add(&space->ack_queue, pn, pn + 1)) != 0)
         goto Exit;
     if (space->ack_queue.num_ranges >= QUICLY_ENCODE_ACK_MAX_BLOCKS) {
@@ -896,11 +1161,11 @@ static int record_receipt(quicly_conn_t *conn, struct st_quicly_pn_space_t *spac
         space->unacked_count++;
         /* Ack after QUICLY_NUM_PACKETS_BEFORE_ACK packets or after the delayed ack timeout */
         if (space->unacked_count >= QUICLY_NUM_PACKETS_BEFORE_ACK || epoch == QUICLY_EPOCH_INITIAL ||
-            epoch == QUICLY_EPOCH_HANDSHAKE) {
+            epoch == QUICLY_EPOCH_HANDSHAKE || ecn == QUICLY_ECN_CE) {
             conn->egress.send_ack_at = now;
         } else if (conn->egress.send_ack_at == INT64_MAX) {
             /* FIXME use 1/4 minRTT */
-            conn->egress.send_ack_at = now + QUICLY_DELAYED_ACK_TIMEOUT;
+            conn->egress.send_ack_at = now + QUICLY_DELAYED_ACK_TIMEOUT * 1000;
         }
     }
 
@@ -986,6 +1251,9 @@ static void free_application_space(struct st_quicly_application_space_t **space)
 #undef DISPOSE_INGRESS
         if ((*space)->cipher.egress.aead != NULL)
             dispose_cipher(&(*space)->cipher.egress);
+        if ((*space)->cipher.key_update.egress.next_aead != NULL)
+            ptls_aead_free((*space)->cipher.key_update.egress.next_aead);
+        ptls_clear_memory(&(*space)->cipher.key_update, sizeof((*space)->cipher.key_update));
         do_free_pn_space(&(*space)->super);
         *space = NULL;
     }
@@ -1049,8 +1317,14 @@ static void apply_peer_transport_params(quicly_conn_t *conn)
 
 void quicly_free(quicly_conn_t *conn)
 {
+    size_t epoch;
+
     LOG_CONNECTION_EVENT(conn, QUICLY_EVENT_TYPE_FREE);
 
+    if (conn->super.ctx->conn_map != NULL)
+        quicly_conn_map_remove(conn->super.ctx->conn_map, conn);
+    if (conn->super.ctx->timer_wheel != NULL)
+        quicly_timerwheel_unset(conn->super.ctx->timer_wheel, &conn->timer);
     destroy_all_streams(conn);
 
     quicly_maxsender_dispose(&conn->ingress.max_data.sender);
@@ -1064,7 +1338,8 @@ void quicly_free(quicly_conn_t *conn)
         free(pending);
     }
     cc_destroy(&conn->egress.cc.ccv);
-    quicly_sentmap_dispose(&conn->egress.sentmap);
+    for (epoch = 0; epoch != QUICLY_NUM_EPOCHS; ++epoch)
+        quicly_sentmap_dispose(&conn->egress.spaces[epoch].sentmap);
 
     kh_destroy(quicly_stream_t, conn->streams);
 
@@ -1316,7 +1591,7 @@ int quicly_decode_transport_parameter_list(quicly_transport_parameters_t *params
                     /* FIXME do we have a maximum? */
                     if (v > 255)
                         v = 255;
-                    params->ack_delay_exponent = (uint8_t)v;
+                    params->max_ack_delay = (uint8_t)v;
                 } break;
                 default:
                     src = end;
@@ -1346,6 +1621,12 @@ static void set_cid(quicly_cid_t *dest, ptls_iovec_t src)
     dest->len = src.len;
 }
 
+static void init_cc(struct cc_var *ccv, uint32_t cwnd)
+{
+    cc_init(ccv, &newreno_cc_algo, cwnd, 1280);
+    ccv->ccvc.ccv.snd_scale = 14; /* FIXME */
+}
+
 static quicly_conn_t *create_connection(quicly_context_t *ctx, const char *server_name, struct sockaddr *sa, socklen_t salen,
                                         ptls_handshake_properties_t *handshake_properties)
 {
@@ -1355,6 +1636,7 @@ static quicly_conn_t *create_connection(quicly_context_t *ctx, const char *serve
         quicly_maxsender_t max_streams_bidi;
         quicly_maxsender_t max_streams_uni;
     } * conn;
+    size_t epoch;
 
     if ((tls = ptls_new(ctx->tls, server_name == NULL)) == NULL)
         return NULL;
@@ -1401,17 +1683,25 @@ static quicly_conn_t *create_connection(quicly_context_t *ctx, const char *serve
         conn->_.ingress.max_streams.bidi = &conn->max_streams_bidi;
         quicly_maxsender_init(conn->_.ingress.max_streams.bidi, conn->_.super.ctx->transport_params.max_streams_bidi);
     }
-    quicly_sentmap_init(&conn->_.egress.sentmap);
+    for (epoch = 0; epoch != QUICLY_NUM_EPOCHS; ++epoch) {
+        quicly_sentmap_init(&conn->_.egress.spaces[epoch].sentmap, sent_callbacks);
+        conn->_.egress.spaces[epoch].loss_time = INT64_MAX;
+    }
     quicly_loss_init(&conn->_.egress.loss, conn->_.super.ctx->loss,
-                     conn->_.super.ctx->loss->default_initial_rtt /* FIXME remember initial_rtt in session ticket */,
+                     conn->_.super.ctx->loss->default_initial_rtt /* updated by quicly_connect when resuming */,
                      &conn->_.super.peer.transport_params.max_ack_delay);
     init_max_streams(&conn->_.egress.max_streams.uni);
     init_max_streams(&conn->_.egress.max_streams.bidi);
     conn->_.egress.path_challenge.tail_ref = &conn->_.egress.path_challenge.head;
     conn->_.egress.send_ack_at = INT64_MAX;
-    cc_init(&conn->_.egress.cc.ccv, &newreno_cc_algo, 1280 * 8, 1280);
-    conn->_.egress.cc.ccv.ccvc.ccv.snd_scale = 14; /* FIXME */
+    init_cc(&conn->_.egress.cc.ccv, INITIAL_CWND);
     conn->_.egress.cc.end_of_recovery = UINT64_MAX;
+    quicly_pacer_init(&conn->_.egress.pacer);
+    conn->_.egress.ecn.is_capable = ctx->enable_ecn;
+    conn->_.egress.max_packet_size = ctx->max_packet_size;
+    if (ctx->max_probed_packet_size > ctx->max_packet_size)
+        conn->_.egress.pmtud.search_high = ctx->max_probed_packet_size;
+    conn->_.egress.pmtud.probe_pn = UINT64_MAX;
     conn->_.crypto.tls = tls;
     if (handshake_properties != NULL) {
         assert(handshake_properties->additional_extensions == NULL);
@@ -1427,6 +1717,7 @@ static quicly_conn_t *create_connection(quicly_context_t *ctx, const char *serve
     quicly_linklist_init(&conn->_.pending_link.control);
     quicly_linklist_init(&conn->_.pending_link.stream_fin_only);
     quicly_linklist_init(&conn->_.pending_link.stream_with_payload);
+    quicly_timerwheel_init_timer(&conn->_.timer);
 
     if (set_peeraddr(&conn->_, sa, salen) != 0) {
         quicly_free(&conn->_);
@@ -1500,7 +1791,8 @@ Exit:
 }
 
 int quicly_connect(quicly_conn_t **_conn, quicly_context_t *ctx, const char *server_name, struct sockaddr *sa, socklen_t salen,
-                   ptls_handshake_properties_t *handshake_properties, const quicly_transport_parameters_t *resumed_transport_params)
+                   ptls_handshake_properties_t *handshake_properties, const quicly_transport_parameters_t *resumed_transport_params,
+                   const quicly_path_state_t *resumed_path_state)
 {
     quicly_conn_t *conn = NULL;
     const quicly_cid_t *server_cid;
@@ -1516,6 +1808,13 @@ int quicly_connect(quicly_conn_t **_conn, quicly_context_t *ctx, const char *ser
         goto Exit;
     }
     server_cid = quicly_get_peer_cid(conn);
+    if (resumed_path_state != NULL && resumed_path_state->smoothed_rtt != 0) {
+        quicly_rtt_init(&conn->egress.loss.rtt, ctx->loss, resumed_path_state->smoothed_rtt);
+        if (resumed_path_state->cwnd / 2 > INITIAL_CWND) {
+            conn->egress.cc.careful_resume.remembered = *resumed_path_state;
+            conn->egress.cc.careful_resume.phase = CAREFUL_RESUME_RECONNAISSANCE;
+        }
+    }
 
     LOG_CONNECTION_EVENT(conn, QUICLY_EVENT_TYPE_CONNECT, VEC_EVENT_ATTR(DCID, ptls_iovec_init(server_cid->cid, server_cid->len)),
                          VEC_EVENT_ATTR(SCID, ptls_iovec_init(conn->super.host.cid.cid, conn->super.host.cid.len)),
@@ -1556,6 +1855,7 @@ int quicly_connect(quicly_conn_t **_conn, quicly_context_t *ctx, const char *ser
     }
 
     *_conn = conn;
+    update_timer(conn);
     ret = 0;
 
 Exit:
@@ -1641,7 +1941,7 @@ static ptls_iovec_t decrypt_packet(ptls_cipher_context_t *header_protection, ptl
     }
 
     /* AEAD */
-    *pn = quicly_determine_packet_number(pnbits, (uint32_t)UINT32_MAX >> (4 - pnlen), *next_expected_pn);
+    *pn = quicly_determine_packet_number(pnbits, (uint32_t)UINT32_MAX >> ((4 - pnlen) * 8), *next_expected_pn);
     size_t aead_off = packet->encrypted_off + pnlen, ptlen;
     if ((ptlen = ptls_aead_decrypt(aead[aead_index], packet->octets.base + aead_off, packet->octets.base + aead_off,
                                    packet->octets.len - aead_off, *pn, packet->octets.base, aead_off)) == SIZE_MAX) {
@@ -1758,18 +2058,23 @@ int quicly_accept(quicly_conn_t **_conn, quicly_context_t *ctx, struct sockaddr
 
     /* TODO log cid */
 
-    if ((ret = record_receipt(conn, &conn->initial->super, pn, 0, QUICLY_EPOCH_INITIAL)) != 0)
+    if ((ret = record_receipt(conn, &conn->initial->super, pn, packet->ecn, 0, QUICLY_EPOCH_INITIAL)) != 0)
         goto Exit;
     conn->initial->super.next_expected_packet_number = next_expected_pn;
 
     if ((ret = apply_handshake_flow(conn, 0, &frame)) != 0)
         goto Exit;
+    if (ctx->conn_map != NULL && (ret = quicly_conn_map_add(ctx->conn_map, conn)) != 0)
+        goto Exit;
 
     conn->super.state = QUICLY_STATE_CONNECTED;
     *_conn = conn;
+    update_timer(conn);
+    if (conn->crypto.handshake_pending)
+        ret = QUICLY_ERROR_HANDSHAKE_PENDING;
 
 Exit:
-    if (!(ret == 0 || ret == PTLS_ERROR_IN_PROGRESS)) {
+    if (!(ret == 0 || ret == PTLS_ERROR_IN_PROGRESS || ret == QUICLY_ERROR_HANDSHAKE_PENDING)) {
         if (conn != NULL)
             quicly_free(conn);
         if (ingress_cipher.aead != NULL)
@@ -1822,17 +2127,16 @@ static int on_ack_stream(quicly_conn_t *conn, const quicly_sent_packet_t *packet
 
     LOG_STREAM_EVENT(conn, sent->data.stream.stream_id,
                      event == QUICLY_SENTMAP_EVENT_ACKED ? QUICLY_EVENT_TYPE_STREAM_ACKED : QUICLY_EVENT_TYPE_STREAM_LOST,
-                     INT_EVENT_ATTR(OFFSET, sent->data.stream.args.start),
-                     INT_EVENT_ATTR(LENGTH, sent->data.stream.args.end - sent->data.stream.args.start));
+                     INT_EVENT_ATTR(OFFSET, sent->data.stream.start), INT_EVENT_ATTR(LENGTH, sent->data.stream.length));
 
     /* TODO cache pointer to stream (using a generation counter?) */
     if ((stream = quicly_get_stream(conn, sent->data.stream.stream_id)) == NULL)
         return 0;
 
+    quicly_sendstate_sent_t args = {sent->data.stream.start, sent->data.stream.start + sent->data.stream.length};
     if (event == QUICLY_SENTMAP_EVENT_ACKED) {
         size_t bytes_to_shift;
-        if ((ret = quicly_sendstate_acked(&stream->sendstate, &sent->data.stream.args, packet->bytes_in_flight != 0,
-                                          &bytes_to_shift)) != 0)
+        if ((ret = quicly_sendstate_acked(&stream->sendstate, &args, packet->bytes_in_flight != 0, &bytes_to_shift)) != 0)
             return ret;
         if (stream_is_destroyable(stream)) {
             destroy_stream(stream);
@@ -1841,7 +2145,7 @@ static int on_ack_stream(quicly_conn_t *conn, const quicly_sent_packet_t *packet
         }
     } else {
         /* FIXME handle rto error */
-        if ((ret = quicly_sendstate_lost(&stream->sendstate, &sent->data.stream.args)) != 0)
+        if ((ret = quicly_sendstate_lost(&stream->sendstate, &args)) != 0)
             return ret;
         if (stream->_send_aux.rst.sender_state == QUICLY_SENDER_STATE_NONE)
             resched_stream_data(stream);
@@ -1859,7 +2163,7 @@ static int on_ack_max_stream_data(quicly_conn_t *conn, const quicly_sent_packet_
         return 0;
 
     /* TODO cache pointer to stream (using a generation counter?) */
-    if ((stream = quicly_get_stream(conn, sent->data.stream.stream_id)) != NULL) {
+    if ((stream = quicly_get_stream(conn, sent->data.max_stream_data.stream_id)) != NULL) {
         if (event == QUICLY_SENTMAP_EVENT_ACKED) {
             quicly_maxsender_acked(&stream->_send_aux.max_stream_data_sender, &sent->data.max_stream_data.args);
         } else {
@@ -1964,6 +2268,90 @@ static int on_ack_streams_blocked(quicly_conn_t *conn, const quicly_sent_packet_
     return 0;
 }
 
+/**
+ * returns the size of the next PMTU probe, or zero if the search has converged. The upper bound is probed first, then the search
+ * continues by bisection.
+ */
+static uint16_t pmtud_next_probe_size(quicly_conn_t *conn)
+{
+    uint16_t low = conn->egress.max_packet_size, high = conn->egress.pmtud.search_high;
+
+    if (high < low + PMTUD_MIN_STEP)
+        return 0;
+    if (high == conn->super.ctx->max_probed_packet_size)
+        return high;
+    return low + (high - low + 1) / 2;
+}
+
+static void pmtud_schedule_next_probe(quicly_conn_t *conn)
+{
+    conn->egress.pmtud.probe_size = 0;
+    conn->egress.pmtud.probe_pn = UINT64_MAX;
+    conn->egress.pmtud.next_probe_at = pmtud_next_probe_size(conn) != 0 ? now : now + PMTUD_RAISE_INTERVAL;
+}
+
+static void pmtud_on_probe_lost(quicly_conn_t *conn)
+{
+    LOG_CONNECTION_EVENT(conn, QUICLY_EVENT_TYPE_PMTU_PROBE_LOST, INT_EVENT_ATTR(PACKET_NUMBER, conn->egress.pmtud.probe_pn),
+                         INT_EVENT_ATTR(LENGTH, conn->egress.pmtud.probe_size));
+    if (++conn->egress.pmtud.num_lost >= PMTUD_MAX_PROBES) {
+        conn->egress.pmtud.search_high = conn->egress.pmtud.probe_size - 1;
+        conn->egress.pmtud.num_lost = 0;
+    }
+    pmtud_schedule_next_probe(conn);
+}
+
+/**
+ * called when repeated RTOs suggest that the path has stopped delivering packets of the size that has been discovered; falls back
+ * to the base size, and restarts the search below the size that has stopped working
+ */
+static void pmtud_on_black_hole(quicly_conn_t *conn)
+{
+    if (conn->egress.max_packet_size <= conn->super.ctx->max_packet_size)
+        return;
+    conn->egress.pmtud.search_high = conn->egress.max_packet_size - 1;
+    conn->egress.pmtud.num_lost = 0;
+    conn->egress.max_packet_size = conn->super.ctx->max_packet_size;
+    LOG_CONNECTION_EVENT(conn, QUICLY_EVENT_TYPE_PMTU_UPDATE, INT_EVENT_ATTR(LENGTH, conn->egress.max_packet_size));
+    pmtud_schedule_next_probe(conn);
+}
+
+static int on_ack_pmtu_probe(quicly_conn_t *conn, const quicly_sent_packet_t *packet, quicly_sent_t *sent,
+                             quicly_sentmap_event_t event)
+{
+    /* ignore the outcome of probes that have been given up */
+    if (packet->packet_number != conn->egress.pmtud.probe_pn)
+        return 0;
+
+    switch (event) {
+    case QUICLY_SENTMAP_EVENT_ACKED:
+        assert(sent->data.pmtu_probe.size == conn->egress.pmtud.probe_size);
+        conn->egress.max_packet_size = sent->data.pmtu_probe.size;
+        conn->egress.pmtud.num_lost = 0;
+        LOG_CONNECTION_EVENT(conn, QUICLY_EVENT_TYPE_PMTU_UPDATE, INT_EVENT_ATTR(LENGTH, conn->egress.max_packet_size));
+        pmtud_schedule_next_probe(conn);
+        break;
+    case QUICLY_SENTMAP_EVENT_LOST:
+        pmtud_on_probe_lost(conn);
+        break;
+    default: /* loss recovery reports the probe as lost before the entry expires */
+        break;
+    }
+
+    return 0;
+}
+
+static const quicly_sent_acked_cb sent_callbacks[QUICLY_SENT__NUM_TYPES] = {
+    [QUICLY_SENT_TYPE_ACK] = on_ack_ack,
+    [QUICLY_SENT_TYPE_STREAM] = on_ack_stream,
+    [QUICLY_SENT_TYPE_MAX_STREAM_DATA] = on_ack_max_stream_data,
+    [QUICLY_SENT_TYPE_MAX_DATA] = on_ack_max_data,
+    [QUICLY_SENT_TYPE_MAX_STREAMS] = on_ack_max_streams,
+    [QUICLY_SENT_TYPE_STREAMS_BLOCKED] = on_ack_streams_blocked,
+    [QUICLY_SENT_TYPE_RST_STREAM] = on_ack_rst_stream,
+    [QUICLY_SENT_TYPE_STOP_SENDING] = on_ack_stop_sending,
+    [QUICLY_SENT_TYPE_PMTU_PROBE] = on_ack_pmtu_probe};
+
 static ssize_t round_send_window(ssize_t window)
 {
     if (window < MIN_SEND_WINDOW * 2) {
@@ -1976,22 +2364,76 @@ static ssize_t round_send_window(ssize_t window)
     return window;
 }
 
-int64_t quicly_get_first_timeout(quicly_conn_t *conn)
+static uint64_t calc_pacing_rate(quicly_conn_t *conn, int64_t *burst)
 {
-    if (round_send_window((ssize_t)cc_get_cwnd(&conn->egress.cc.ccv) - (ssize_t)conn->egress.sentmap.bytes_in_flight) > 0) {
-        if (conn->crypto.pending_flows != 0 || quicly_linklist_is_linked(&conn->pending_link.control) ||
-            quicly_linklist_is_linked(&conn->pending_link.stream_fin_only) ||
-            quicly_linklist_is_linked(&conn->pending_link.stream_with_payload))
-            return 0;
-    }
+    const quicly_rtt_t *rtt = &conn->egress.loss.rtt;
+    uint64_t rate = quicly_pacer_calc_rate(conn->super.ctx->pacer, cc_get_cwnd(&conn->egress.cc.ccv),
+                                           rtt->smoothed != 0 ? rtt->smoothed : rtt->latest);
+    *burst = quicly_pacer_calc_burst(conn->super.ctx->pacer, rate, conn->egress.max_packet_size);
+    return rate;
+}
+
+/**
+ * returns if the stream at the head of the send queue has payload that both the connection-level and the stream-level flow control
+ * permit sending
+ */
+static int can_send_stream_payload(quicly_conn_t *conn)
+{
+    quicly_stream_t *stream;
+
+    if (!quicly_linklist_is_linked(&conn->pending_link.stream_with_payload) ||
+        conn->egress.max_data.sent >= conn->egress.max_data.permitted)
+        return 0;
+    stream = (void *)((char *)conn->pending_link.stream_with_payload.next - offsetof(quicly_stream_t, _send_aux.pending_link.stream));
+    return stream->sendstate.pending.num_ranges != 0 && stream->sendstate.pending.ranges[0].start < stream->_send_aux.max_stream_data;
+}
 
+int64_t quicly_get_first_timeout(quicly_conn_t *conn)
+{
     int64_t at = conn->egress.loss.alarm_at;
     if (conn->egress.send_ack_at < at)
         at = conn->egress.send_ack_at;
 
+    if (round_send_window((ssize_t)cc_get_cwnd(&conn->egress.cc.ccv) - (ssize_t)get_bytes_in_flight(conn)) > 0) {
+        if (conn->crypto.pending_flows != 0 || quicly_linklist_is_linked(&conn->pending_link.control) ||
+            quicly_linklist_is_linked(&conn->pending_link.stream_fin_only) ||
+            quicly_linklist_is_linked(&conn->pending_link.stream_with_payload)) {
+            int64_t send_at = 0;
+            if (conn->super.ctx->pacer != NULL && !conn->super.ctx->pace_by_txtime) {
+                int64_t burst;
+                uint64_t rate = calc_pacing_rate(conn, &burst);
+                send_at = quicly_pacer_get_send_at(&conn->egress.pacer, rate, burst, conn->egress.max_packet_size);
+            }
+            if (send_at < at)
+                at = send_at;
+        }
+    }
+
     return at;
 }
 
+static void update_timer(quicly_conn_t *conn)
+{
+    if (conn->super.ctx->timer_wheel != NULL)
+        quicly_timerwheel_set(conn->super.ctx->timer_wheel, &conn->timer, quicly_get_first_timeout(conn));
+}
+
+quicly_conn_t *quicly_get_conn_by_timer(quicly_timerwheel_timer_t *timer)
+{
+    return (void *)((char *)timer - offsetof(quicly_conn_t, timer));
+}
+
+/* a short header packet that has been built but is yet to be encrypted (see quicly_context_t::defer_sealing)
+ */
+struct st_quicly_pending_seal_t {
+    struct st_quicly_cipher_context_t *cipher;
+    uint8_t *first_byte_at;
+    uint8_t *payload_from;
+    size_t payload_len;
+    uint64_t packet_number;
+    uint8_t pn_len;
+};
+
 /* data structure that is used during one call through quicly_send()
  */
 struct st_quicly_send_context_t {
@@ -2010,9 +2452,19 @@ struct st_quicly_send_context_t {
          * contains multiple QUIC packet.
          */
         uint8_t *first_byte_at;
+        /**
+         * sentmap of the packet number space to which the target packet belongs
+         */
+        quicly_sentmap_t *sentmap;
+        /**
+         * number of bytes used for encoding the packet number of the target packet
+         */
+        uint8_t pn_len;
         uint8_t ack_eliciting : 1;
     } target;
 
+    /* datagram that has been allocated with room for multiple GSO segments */
+    quicly_datagram_t *gso_packet;
     /* output buffer into which list of datagrams is written */
     quicly_datagram_t **packets;
     /* max number of datagrams that can be stored in |packets| */
@@ -2029,18 +2481,99 @@ struct st_quicly_send_context_t {
     uint8_t *dst_end;
     /* address at which payload starts */
     uint8_t *dst_payload_from;
+    /* if non-zero, the next datagram is allocated as a PMTU probe of given size */
+    uint16_t pmtu_probe_size;
+    /* packets waiting to be sealed by seal_pending_packets */
+    struct {
+        struct st_quicly_pending_seal_t entries[SEAL_BATCH_SIZE];
+        size_t count;
+    } pending_seals;
 };
 
+static uint8_t calc_send_pn_len(quicly_conn_t *conn, uint8_t first_byte)
+{
+    /* Packet numbers are shared among the epochs, and therefore the distance from the largest PN that the peer has seen in a
+     * handshake epoch is unknown. Use the maximum for long header packets. */
+    if (QUICLY_PACKET_IS_LONG_HEADER(first_byte))
+        return QUICLY_MAX_PN_SIZE;
+
+    /* The peer decodes the PN relative to the largest PN it has received in the 1-RTT packet number space. Use the maximum until
+     * a 1-RTT packet gets acked (PN zero is always used by an Initial packet, hence zero indicates that none has been acked). */
+    uint64_t largest_acked = conn->egress.spaces[QUICLY_EPOCH_1RTT].largest_acked;
+    if (largest_acked == 0)
+        return QUICLY_MAX_PN_SIZE;
+
+    /* use a length that can represent more than twice the range between the largest acked and the PN being sent */
+    uint64_t num_unacked = conn->egress.packet_number - largest_acked;
+    if (num_unacked < (1 << 7))
+        return 1;
+    if (num_unacked < (1 << 15))
+        return 2;
+    if (num_unacked < (1 << 23))
+        return 3;
+    return 4;
+}
+
+static void encode_packet_number(uint8_t *p, uint64_t pn, size_t pn_len)
+{
+    p += pn_len;
+    do {
+        *--p = (uint8_t)pn;
+        pn >>= 8;
+    } while (--pn_len != 0);
+}
+
+static void apply_header_protection(ptls_cipher_context_t *header_protection, uint8_t *first_byte_at, uint8_t *pn_from,
+                                    size_t pn_len)
+{
+    uint8_t hpmask[1 + QUICLY_MAX_PN_SIZE] = {0};
+    size_t i;
+
+    ptls_cipher_init(header_protection, pn_from + QUICLY_MAX_PN_SIZE);
+    ptls_cipher_encrypt(header_protection, hpmask, hpmask, sizeof(hpmask));
+    *first_byte_at ^= hpmask[0] & (QUICLY_PACKET_IS_LONG_HEADER(*first_byte_at) ? 0xf : 0x1f);
+    for (i = 0; i != pn_len; ++i)
+        pn_from[i] ^= hpmask[i + 1];
+}
+
+static void seal_pending_packets(struct st_quicly_send_context_t *s)
+{
+    size_t i;
+
+    /* header protection samples the ciphertext, and the AEAD authenticates the unprotected header; therefore encrypt all the
+     * payloads first, then apply header protection to all the packets */
+    for (i = 0; i != s->pending_seals.count; ++i) {
+        struct st_quicly_pending_seal_t *p = s->pending_seals.entries + i;
+        ptls_aead_encrypt(p->cipher->aead, p->payload_from, p->payload_from, p->payload_len, p->packet_number, p->first_byte_at,
+                          p->payload_from - p->first_byte_at);
+    }
+    for (i = 0; i != s->pending_seals.count; ++i) {
+        struct st_quicly_pending_seal_t *p = s->pending_seals.entries + i;
+        apply_header_protection(p->cipher->header_protection, p->first_byte_at, p->payload_from - p->pn_len, p->pn_len);
+    }
+
+    s->pending_seals.count = 0;
+}
+
+/**
+ * returns the number of full-sized packets that can be packed into one GSO datagram, which is bound by the maximum UDP payload size
+ */
+static size_t get_max_gso_segments(quicly_conn_t *conn)
+{
+    size_t max_segments = QUICLY_MAX_UDP_PAYLOAD_SIZE / conn->egress.max_packet_size;
+    return conn->super.ctx->max_gso_segments < max_segments ? conn->super.ctx->max_gso_segments : max_segments;
+}
+
 static int commit_send_packet(quicly_conn_t *conn, struct st_quicly_send_context_t *s, int coalesced)
 {
-    size_t packet_bytes_in_flight;
+    size_t packet_bytes_in_flight, pn_len = s->target.pn_len;
 
     assert(s->target.cipher->aead != NULL);
 
     assert(s->dst != s->dst_payload_from);
 
     /* pad so that the pn + payload would be at least 4 bytes */
-    while (s->dst - s->dst_payload_from < QUICLY_MAX_PN_SIZE - QUICLY_SEND_PN_SIZE)
+    while (s->dst - s->dst_payload_from < QUICLY_MAX_PN_SIZE - pn_len)
         *s->dst++ = QUICLY_FRAME_TYPE_PADDING;
 
     /* the last packet of first-flight datagrams is padded to become 1280 bytes */
@@ -2054,45 +2587,58 @@ static int commit_send_packet(quicly_conn_t *conn, struct st_quicly_send_context
     }
 
     if (QUICLY_PACKET_IS_LONG_HEADER(*s->target.first_byte_at)) {
-        uint16_t length = s->dst - s->dst_payload_from + s->target.cipher->aead->algo->tag_size + QUICLY_SEND_PN_SIZE;
+        uint16_t length = s->dst - s->dst_payload_from + s->target.cipher->aead->algo->tag_size + pn_len;
         /* length is always 2 bytes, see _do_prepare_packet */
         length |= 0x4000;
-        quicly_encode16(s->dst_payload_from - QUICLY_SEND_PN_SIZE - 2, length);
-    }
-    quicly_encode16(s->dst_payload_from - QUICLY_SEND_PN_SIZE, (uint16_t)conn->egress.packet_number);
-
-    s->dst = s->dst_payload_from + ptls_aead_encrypt(s->target.cipher->aead, s->dst_payload_from, s->dst_payload_from,
-                                                     s->dst - s->dst_payload_from, conn->egress.packet_number,
-                                                     s->target.first_byte_at, s->dst_payload_from - s->target.first_byte_at);
-
-    { /* apply header protection */
-        uint8_t hpmask[1 + QUICLY_SEND_PN_SIZE] = {0};
-        ptls_cipher_init(s->target.cipher->header_protection, s->dst_payload_from - QUICLY_SEND_PN_SIZE + QUICLY_MAX_PN_SIZE);
-        ptls_cipher_encrypt(s->target.cipher->header_protection, hpmask, hpmask, sizeof(hpmask));
-        *s->target.first_byte_at ^= hpmask[0] & (QUICLY_PACKET_IS_LONG_HEADER(*s->target.first_byte_at) ? 0xf : 0x1f);
-        size_t i;
-        for (i = 0; i != QUICLY_SEND_PN_SIZE; ++i)
-            s->dst_payload_from[i - QUICLY_SEND_PN_SIZE] ^= hpmask[i + 1];
+        quicly_encode16(s->dst_payload_from - pn_len - 2, length);
+    }
+    encode_packet_number(s->dst_payload_from - pn_len, conn->egress.packet_number, pn_len);
+
+    if (conn->super.ctx->defer_sealing && !QUICLY_PACKET_IS_LONG_HEADER(*s->target.first_byte_at)) {
+        /* seal later; only the short header packets are deferred, as the handshake keys might be discarded within quicly_send */
+        if (s->pending_seals.count == SEAL_BATCH_SIZE)
+            seal_pending_packets(s);
+        s->pending_seals.entries[s->pending_seals.count++] = (struct st_quicly_pending_seal_t){
+            s->target.cipher, s->target.first_byte_at, s->dst_payload_from, s->dst - s->dst_payload_from,
+            conn->egress.packet_number, pn_len};
+        s->dst += s->target.cipher->aead->algo->tag_size;
+    } else {
+        s->dst = s->dst_payload_from + ptls_aead_encrypt(s->target.cipher->aead, s->dst_payload_from, s->dst_payload_from,
+                                                         s->dst - s->dst_payload_from, conn->egress.packet_number,
+                                                         s->target.first_byte_at, s->dst_payload_from - s->target.first_byte_at);
+        apply_header_protection(s->target.cipher->header_protection, s->target.first_byte_at, s->dst_payload_from - pn_len,
+                                pn_len);
     }
 
     /* update CC, commit sentmap */
     if (s->target.ack_eliciting) {
         packet_bytes_in_flight = s->dst - s->target.first_byte_at;
         s->send_window -= packet_bytes_in_flight;
+        if (conn->super.ctx->pacer != NULL) {
+            if (conn->super.ctx->pace_by_txtime && s->target.packet->txtime == 0) {
+                int64_t burst, send_at;
+                uint64_t rate = calc_pacing_rate(conn, &burst);
+                if ((send_at = quicly_pacer_get_send_at(&conn->egress.pacer, rate, burst, packet_bytes_in_flight)) > now)
+                    s->target.packet->txtime = send_at;
+            }
+            quicly_pacer_consume(&conn->egress.pacer, packet_bytes_in_flight);
+        }
     } else {
         packet_bytes_in_flight = 0;
     }
-    quicly_sentmap_commit(&conn->egress.sentmap, (uint16_t)packet_bytes_in_flight);
+    quicly_sentmap_commit(s->target.sentmap, (uint16_t)packet_bytes_in_flight);
 
+    conn->super.num_bytes_sent += s->dst - s->target.packet->data.base - s->target.packet->data.len;
     s->target.packet->data.len = s->dst - s->target.packet->data.base;
-    assert(s->target.packet->data.len <= conn->super.ctx->max_packet_size);
+    assert(s->target.packet->data.len <=
+           (s->pmtu_probe_size != 0 ? s->pmtu_probe_size : conn->egress.max_packet_size) *
+               (s->target.packet == s->gso_packet ? get_max_gso_segments(conn) : 1));
 
     LOG_CONNECTION_EVENT(conn, QUICLY_EVENT_TYPE_PACKET_COMMIT, INT_EVENT_ATTR(PACKET_NUMBER, conn->egress.packet_number),
                          INT_EVENT_ATTR(LENGTH, s->target.packet->data.len), INT_EVENT_ATTR(ACK_ONLY, !s->target.ack_eliciting));
 
     ++conn->egress.packet_number;
     ++conn->super.num_packets.sent;
-    conn->super.num_bytes_sent += s->target.packet->data.len;
 
     if (!coalesced) {
         s->packets[s->num_packets++] = s->target.packet;
@@ -2113,6 +2659,23 @@ static inline uint8_t *emit_cid(uint8_t *dst, const quicly_cid_t *cid)
     return dst;
 }
 
+/**
+ * returns if a short header packet can be appended to the last datagram as a GSO segment; that is possible when the datagram has
+ * been allocated for GSO and every packet in it is full-sized
+ */
+static int can_append_gso_segment(quicly_conn_t *conn, struct st_quicly_send_context_t *s)
+{
+    quicly_datagram_t *last;
+
+    if (s->gso_packet == NULL || QUICLY_PACKET_IS_LONG_HEADER(s->current.first_byte) || s->min_packets_to_send != 0 ||
+        s->pmtu_probe_size != 0)
+        return 0;
+    if (s->num_packets == 0 || (last = s->packets[s->num_packets - 1]) != s->gso_packet)
+        return 0;
+    return last->data.len % conn->egress.max_packet_size == 0 &&
+           last->data.len + conn->egress.max_packet_size <= conn->egress.max_packet_size * get_max_gso_segments(conn);
+}
+
 static int _do_allocate_frame(quicly_conn_t *conn, struct st_quicly_send_context_t *s, size_t min_space, int ack_eliciting)
 {
     int coalescible, ret;
@@ -2135,15 +2698,19 @@ static int _do_allocate_frame(quicly_conn_t *conn, struct st_quicly_send_context
     if (s->target.packet != NULL) {
         if (coalescible) {
             size_t overhead =
-                1 /* type */ + conn->super.peer.cid.len + QUICLY_SEND_PN_SIZE + s->current.cipher->aead->algo->tag_size;
+                1 /* type */ + conn->super.peer.cid.len + QUICLY_MAX_PN_SIZE + s->current.cipher->aead->algo->tag_size;
             if (QUICLY_PACKET_IS_LONG_HEADER(s->current.first_byte))
                 overhead += 4 /* version */ + 1 /* cidl */ + conn->super.peer.cid.len + conn->super.host.cid.len +
                             (s->current.first_byte == QUICLY_PACKET_TYPE_INITIAL) /* token_length == 0 */ + 2 /* length */;
-            size_t packet_min_space = QUICLY_MAX_PN_SIZE - QUICLY_SEND_PN_SIZE;
-            if (packet_min_space < min_space)
-                packet_min_space = min_space;
-            if (overhead + packet_min_space > s->dst_end - s->dst)
+            if (overhead + min_space > s->dst_end - s->dst)
                 coalescible = 0;
+        } else if (s->target.packet == s->gso_packet && !QUICLY_PACKET_IS_LONG_HEADER(s->current.first_byte) &&
+                   s->min_packets_to_send == 0 &&
+                   s->target.packet->data.len + 2 * conn->egress.max_packet_size <=
+                       conn->egress.max_packet_size * get_max_gso_segments(conn)) {
+            /* pad the packet to full size, so that the next packet can be appended as a GSO segment */
+            memset(s->dst, QUICLY_FRAME_TYPE_PADDING, s->dst_end - s->dst);
+            s->dst = s->dst_end;
         }
         /* close out packet under construction */
         if ((ret = commit_send_packet(conn, s, coalescible)) != 0)
@@ -2155,20 +2722,40 @@ static int _do_allocate_frame(quicly_conn_t *conn, struct st_quicly_send_context
     /* allocate packet */
     if (coalescible) {
         s->target.cipher = s->current.cipher;
+    } else if (can_append_gso_segment(conn, s)) {
+        s->send_window = round_send_window(s->send_window);
+        if (ack_eliciting && s->send_window < (ssize_t)min_space)
+            return QUICLY_ERROR_SENDBUF_FULL;
+        /* reopen the last datagram, and append a packet */
+        s->target.packet = s->packets[--s->num_packets];
+        s->target.packet->segment_size = conn->egress.max_packet_size;
+        s->target.cipher = s->current.cipher;
+        s->dst = s->target.packet->data.base + s->target.packet->data.len;
+        s->dst_end = s->dst + conn->egress.max_packet_size;
     } else {
+        size_t capacity = conn->egress.max_packet_size;
         if (s->num_packets >= s->max_packets)
             return QUICLY_ERROR_SENDBUF_FULL;
         s->send_window = round_send_window(s->send_window);
         if (ack_eliciting && s->send_window < (ssize_t)min_space)
             return QUICLY_ERROR_SENDBUF_FULL;
-        if ((s->target.packet =
-                 conn->super.ctx->alloc_packet(conn->super.ctx, conn->super.peer.salen, conn->super.ctx->max_packet_size)) == NULL)
+        if (s->pmtu_probe_size != 0) {
+            capacity = s->pmtu_probe_size;
+        } else if (get_max_gso_segments(conn) > 1 && !QUICLY_PACKET_IS_LONG_HEADER(s->current.first_byte)) {
+            capacity *= get_max_gso_segments(conn);
+        }
+        if ((s->target.packet = conn->super.ctx->alloc_packet(conn->super.ctx, conn->super.peer.salen, capacity)) == NULL)
             return PTLS_ERROR_NO_MEMORY;
+        s->target.packet->data.len = 0;
+        s->target.packet->segment_size = 0;
+        s->target.packet->txtime = 0;
+        s->target.packet->ecn = conn->egress.ecn.is_capable ? QUICLY_ECN_ECT0 : QUICLY_ECN_NOT_ECT;
         s->target.packet->salen = conn->super.peer.salen;
         memcpy(&s->target.packet->sa, conn->super.peer.sa, conn->super.peer.salen);
+        s->gso_packet = s->pmtu_probe_size == 0 && capacity != conn->egress.max_packet_size ? s->target.packet : NULL;
         s->target.cipher = s->current.cipher;
         s->dst = s->target.packet->data.base;
-        s->dst_end = s->target.packet->data.base + conn->super.ctx->max_packet_size;
+        s->dst_end = s->target.packet->data.base + (s->pmtu_probe_size != 0 ? s->pmtu_probe_size : conn->egress.max_packet_size);
     }
     s->target.ack_eliciting = 0;
 
@@ -2177,7 +2764,11 @@ static int _do_allocate_frame(quicly_conn_t *conn, struct st_quicly_send_context
 
     /* emit header */
     s->target.first_byte_at = s->dst;
-    *s->dst++ = s->current.first_byte | 0x1 /* pnlen == 2 */;
+    s->target.pn_len = calc_send_pn_len(conn, s->current.first_byte);
+    *s->dst = s->current.first_byte | (s->target.pn_len - 1);
+    if (!QUICLY_PACKET_IS_LONG_HEADER(s->current.first_byte) && (conn->application->cipher.key_update.egress.generation & 1) != 0)
+        *s->dst |= QUICLY_KEY_PHASE_BIT;
+    ++s->dst;
     if (QUICLY_PACKET_IS_LONG_HEADER(s->current.first_byte)) {
         s->dst = quicly_encode32(s->dst, conn->super.version);
         *s->dst++ = (encode_cid_length(conn->super.peer.cid.len) << 4) | encode_cid_length(conn->super.host.cid.len);
@@ -2196,11 +2787,11 @@ static int _do_allocate_frame(quicly_conn_t *conn, struct st_quicly_send_context
     } else {
         s->dst = emit_cid(s->dst, &conn->super.peer.cid);
     }
-    s->dst += QUICLY_SEND_PN_SIZE; /* space for PN bits, filled in at commit time */
+    s->dst += s->target.pn_len; /* space for PN bits, filled in at commit time */
     s->dst_payload_from = s->dst;
     assert(s->target.cipher->aead != NULL);
     s->dst_end -= s->target.cipher->aead->algo->tag_size;
-    assert(s->dst_end - s->dst >= QUICLY_MAX_PN_SIZE - QUICLY_SEND_PN_SIZE);
+    assert(s->dst_end - s->dst >= QUICLY_MAX_PN_SIZE - s->target.pn_len);
 
     { /* register to sentmap */
         uint8_t ack_epoch = QUICLY_EPOCH_1RTT;
@@ -2220,7 +2811,8 @@ static int _do_allocate_frame(quicly_conn_t *conn, struct st_quicly_send_context
                 break;
             }
         }
-        if ((ret = quicly_sentmap_prepare(&conn->egress.sentmap, conn->egress.packet_number, now, ack_epoch)) != 0)
+        s->target.sentmap = &conn->egress.spaces[ack_epoch].sentmap;
+        if ((ret = quicly_sentmap_prepare(s->target.sentmap, conn->egress.packet_number, now, ack_epoch)) != 0)
             return ret;
     }
 
@@ -2249,13 +2841,13 @@ static int allocate_frame(quicly_conn_t *conn, struct st_quicly_send_context_t *
 }
 
 static int allocate_ack_eliciting_frame(quicly_conn_t *conn, struct st_quicly_send_context_t *s, size_t min_space,
-                                        quicly_sent_t **sent, quicly_sent_acked_cb acked)
+                                        quicly_sent_t **sent, quicly_sent_type_t type)
 {
     int ret;
 
     if ((ret = _do_allocate_frame(conn, s, min_space, 1)) != 0)
         return ret;
-    if ((*sent = quicly_sentmap_allocate(&conn->egress.sentmap, acked)) == NULL)
+    if ((*sent = quicly_sentmap_allocate(s->target.sentmap, type)) == NULL)
         return PTLS_ERROR_NO_MEMORY;
 
     /* TODO return the remaining window that the sender can use */
@@ -2264,6 +2856,7 @@ static int allocate_ack_eliciting_frame(quicly_conn_t *conn, struct st_quicly_se
 
 static int send_ack(quicly_conn_t *conn, struct st_quicly_pn_space_t *space, struct st_quicly_send_context_t *s)
 {
+    const quicly_ecn_counts_t *ecn_counts = NULL;
     uint64_t ack_delay;
     int ret;
 
@@ -2272,18 +2865,21 @@ static int send_ack(quicly_conn_t *conn, struct st_quicly_pn_space_t *space, str
 
     /* calc ack_delay */
     if (space->largest_pn_received_at < now) {
-        /* We underreport ack_delay up to 1 milliseconds assuming that QUICLY_ACK_DELAY_EXPONENT is 10. It's considered a non-issue
-         * because our time measurement is at millisecond granurality anyways. */
-        ack_delay = ((now - space->largest_pn_received_at) * 1000) >> QUICLY_ACK_DELAY_EXPONENT;
+        /* underreported by up to (1 << QUICLY_ACK_DELAY_EXPONENT) microseconds */
+        ack_delay = (now - space->largest_pn_received_at) >> QUICLY_ACK_DELAY_EXPONENT;
     } else {
         ack_delay = 0;
     }
 
+    /* ECN counters are reported once any ECT or CE packet has been received */
+    if (space->ecn_counts.ect0 != 0 || space->ecn_counts.ect1 != 0 || space->ecn_counts.ce != 0)
+        ecn_counts = &space->ecn_counts;
+
     /* emit ack frame */
 Emit:
     if ((ret = allocate_frame(conn, s, QUICLY_ACK_FRAME_CAPACITY)) != 0)
         return ret;
-    uint8_t *new_dst = quicly_encode_ack_frame(s->dst, s->dst_end, &space->ack_queue, ack_delay);
+    uint8_t *new_dst = quicly_encode_ack_frame(s->dst, s->dst_end, &space->ack_queue, ecn_counts, ack_delay);
     if (new_dst == NULL) {
         /* no space, retry with new MTU-sized packet */
         if ((ret = commit_send_packet(conn, s, 0)) != 0)
@@ -2296,7 +2892,7 @@ Emit:
         size_t i;
         for (i = 0; i != space->ack_queue.num_ranges; ++i) {
             quicly_sent_t *sent;
-            if ((sent = quicly_sentmap_allocate(&conn->egress.sentmap, on_ack_ack)) == NULL)
+            if ((sent = quicly_sentmap_allocate(s->target.sentmap, QUICLY_SENT_TYPE_ACK)) == NULL)
                 return PTLS_ERROR_NO_MEMORY;
             sent->data.ack.range = space->ack_queue.ranges[i];
         }
@@ -2308,12 +2904,12 @@ Emit:
 }
 
 static int prepare_stream_state_sender(quicly_stream_t *stream, quicly_sender_state_t *sender, struct st_quicly_send_context_t *s,
-                                       size_t min_space, quicly_sent_acked_cb ack_cb)
+                                       size_t min_space, quicly_sent_type_t sent_type)
 {
     quicly_sent_t *sent;
     int ret;
 
-    if ((ret = allocate_ack_eliciting_frame(stream->conn, s, min_space, &sent, ack_cb)) != 0)
+    if ((ret = allocate_ack_eliciting_frame(stream->conn, s, min_space, &sent, sent_type)) != 0)
         return ret;
     sent->data.stream_state_sender.stream_id = stream->stream_id;
     *sender = QUICLY_SENDER_STATE_UNACKED;
@@ -2329,7 +2925,7 @@ static int send_stream_control_frames(quicly_stream_t *stream, struct st_quicly_
     if (stream->_send_aux.stop_sending.sender_state == QUICLY_SENDER_STATE_SEND) {
         /* FIXME also send an empty STREAM frame */
         if ((ret = prepare_stream_state_sender(stream, &stream->_send_aux.stop_sending.sender_state, s,
-                                               QUICLY_STOP_SENDING_FRAME_CAPACITY, on_ack_stop_sending)) != 0)
+                                               QUICLY_STOP_SENDING_FRAME_CAPACITY, QUICLY_SENT_TYPE_STOP_SENDING)) != 0)
             return ret;
         s->dst = quicly_encode_stop_sending_frame(s->dst, stream->stream_id, stream->_send_aux.stop_sending.error_code);
     }
@@ -2340,7 +2936,7 @@ static int send_stream_control_frames(quicly_stream_t *stream, struct st_quicly_
         quicly_sent_t *sent;
         /* prepare */
         if ((ret = allocate_ack_eliciting_frame(stream->conn, s, QUICLY_MAX_STREAM_DATA_FRAME_CAPACITY, &sent,
-                                                on_ack_max_stream_data)) != 0)
+                                                QUICLY_SENT_TYPE_MAX_STREAM_DATA)) != 0)
             return ret;
         /* send */
         s->dst = quicly_encode_max_stream_data_frame(s->dst, stream->stream_id, new_value);
@@ -2352,7 +2948,7 @@ static int send_stream_control_frames(quicly_stream_t *stream, struct st_quicly_
     /* send RST_STREAM if necessary */
     if (stream->_send_aux.rst.sender_state == QUICLY_SENDER_STATE_SEND) {
         if ((ret = prepare_stream_state_sender(stream, &stream->_send_aux.rst.sender_state, s, QUICLY_RST_FRAME_CAPACITY,
-                                               on_ack_rst_stream)) != 0)
+                                               QUICLY_SENT_TYPE_RST_STREAM)) != 0)
             return ret;
         s->dst =
             quicly_encode_rst_stream_frame(s->dst, stream->stream_id, stream->_send_aux.rst.error_code, stream->_send_aux.max_sent);
@@ -2373,7 +2969,7 @@ static int send_stream_data(quicly_stream_t *stream, struct st_quicly_send_conte
     if (stream->stream_id < 0) {
         if ((ret = allocate_ack_eliciting_frame(stream->conn, s,
                                                 1 + quicly_encodev_capacity(off) + 2 /* type + len + offset + 1-byte payload */,
-                                                &sent, on_ack_stream)) != 0)
+                                                &sent, QUICLY_SENT_TYPE_STREAM)) != 0)
             return ret;
         frame_type_at = NULL;
         *s->dst++ = QUICLY_FRAME_TYPE_CRYPTO;
@@ -2392,7 +2988,7 @@ static int send_stream_data(quicly_stream_t *stream, struct st_quicly_send_conte
             off + 1 == stream->sendstate.pending.ranges[stream->sendstate.pending.num_ranges - 1].end) {
             /* special case for emitting FIN only */
             header[0] |= QUICLY_FRAME_TYPE_STREAM_BIT_FIN;
-            if ((ret = allocate_ack_eliciting_frame(stream->conn, s, hp - header, &sent, on_ack_stream)) != 0)
+            if ((ret = allocate_ack_eliciting_frame(stream->conn, s, hp - header, &sent, QUICLY_SENT_TYPE_STREAM)) != 0)
                 return ret;
             if (hp - header != s->dst_end - s->dst) {
                 header[0] |= QUICLY_FRAME_TYPE_STREAM_BIT_LEN;
@@ -2404,7 +3000,7 @@ static int send_stream_data(quicly_stream_t *stream, struct st_quicly_send_conte
             wrote_all = 1;
             goto UpdateState;
         }
-        if ((ret = allocate_ack_eliciting_frame(stream->conn, s, hp - header + 1, &sent, on_ack_stream)) != 0)
+        if ((ret = allocate_ack_eliciting_frame(stream->conn, s, hp - header + 1, &sent, QUICLY_SENT_TYPE_STREAM)) != 0)
             return ret;
         frame_type_at = s->dst;
         memcpy(s->dst, header, hp - header);
@@ -2491,8 +3087,8 @@ UpdateState:
 
     /* setup sentmap */
     sent->data.stream.stream_id = stream->stream_id;
-    sent->data.stream.args.start = off;
-    sent->data.stream.args.end = end_off;
+    sent->data.stream.start = off;
+    sent->data.stream.length = (uint32_t)(end_off - off);
 
     return 0;
 }
@@ -2500,115 +3096,218 @@ UpdateState:
 static int64_t get_sentmap_expiration_time(quicly_conn_t *conn)
 {
     /* TODO reconsider this (maybe 3 PTO? also not sure why we need to add ack-delay twice) */
-    return (conn->egress.loss.rtt.smoothed + conn->egress.loss.rtt.variance) * 4 + conn->super.peer.transport_params.max_ack_delay +
-           QUICLY_DELAYED_ACK_TIMEOUT;
+    return (conn->egress.loss.rtt.smoothed + conn->egress.loss.rtt.variance) * 4 +
+           (conn->super.peer.transport_params.max_ack_delay + QUICLY_DELAYED_ACK_TIMEOUT) * 1000;
 }
 
-static void init_acks_iter(quicly_conn_t *conn, quicly_sentmap_iter_t *iter)
+/**
+ * Retires the packets that are no longer in flight and that have been retained longer than the expiration time, from the sentmaps
+ * of all the packet number spaces. Only the heads of the sentmaps are inspected. Returns the time at which the oldest packet being
+ * retained was sent, or INT64_MAX if none is being retained.
+ */
+static int64_t expire_sent_packets(quicly_conn_t *conn)
 {
     /* TODO find a better threshold */
-    int64_t retire_before = now - get_sentmap_expiration_time(conn);
+    int64_t retire_before = now - get_sentmap_expiration_time(conn), oldest_sent_at = INT64_MAX;
+    quicly_sentmap_iter_t iter;
     const quicly_sent_packet_t *sent;
+    size_t epoch;
 
-    quicly_sentmap_init_iter(&conn->egress.sentmap, iter);
+    for (epoch = 0; epoch != QUICLY_NUM_EPOCHS; ++epoch) {
+        quicly_sentmap_t *sentmap = &conn->egress.spaces[epoch].sentmap;
+        quicly_sentmap_init_iter(sentmap, &iter);
+        while ((sent = quicly_sentmap_get(&iter))->sent_at <= retire_before && sent->bytes_in_flight == 0)
+            quicly_sentmap_update(sentmap, &iter, QUICLY_SENTMAP_EVENT_EXPIRED, conn);
+        if (sent->sent_at < oldest_sent_at)
+            oldest_sent_at = sent->sent_at;
+    }
 
-    while ((sent = quicly_sentmap_get(iter))->sent_at <= retire_before && sent->bytes_in_flight == 0)
-        quicly_sentmap_update(&conn->egress.sentmap, iter, QUICLY_SENTMAP_EVENT_EXPIRED, conn);
+    return oldest_sent_at;
 }
 
 int discard_sentmap_by_epoch(quicly_conn_t *conn, unsigned ack_epochs)
 {
     quicly_sentmap_iter_t iter;
-    const quicly_sent_packet_t *sent;
-    int ret = 0;
-
-    init_acks_iter(conn, &iter);
+    size_t epoch;
+    int ret;
 
-    while ((sent = quicly_sentmap_get(&iter))->packet_number != UINT64_MAX) {
-        if ((ack_epochs & (1u << sent->ack_epoch)) != 0) {
-            if ((ret = quicly_sentmap_update(&conn->egress.sentmap, &iter, QUICLY_SENTMAP_EVENT_EXPIRED, conn)) != 0)
+    for (epoch = 0; epoch != QUICLY_NUM_EPOCHS; ++epoch) {
+        struct st_quicly_sent_space_t *space = conn->egress.spaces + epoch;
+        if ((ack_epochs & (1u << epoch)) == 0)
+            continue;
+        quicly_sentmap_init_iter(&space->sentmap, &iter);
+        while (quicly_sentmap_get(&iter)->packet_number != UINT64_MAX) {
+            if ((ret = quicly_sentmap_update(&space->sentmap, &iter, QUICLY_SENTMAP_EVENT_EXPIRED, conn)) != 0)
                 return ret;
-        } else {
-            quicly_sentmap_skip(&iter);
         }
+        space->loss_time = INT64_MAX;
     }
 
-    return ret;
+    return 0;
 }
 
 /**
- * Determine frames to be retransmitted on TLP and RTO.
+ * Determine frames to be retransmitted on TLP and RTO. Packets are marked as lost in the order of their packet numbers across the
+ * packet number spaces, starting from the oldest. Packets that are not in flight (i.e. ACK-only packets) do not count, as they carry
+ * nothing to be retransmitted.
  */
 static int mark_packets_as_lost(quicly_conn_t *conn, size_t count)
 {
-    quicly_sentmap_iter_t iter;
+    quicly_sentmap_iter_t iters[QUICLY_NUM_EPOCHS];
+    const quicly_sent_packet_t *sent;
+    size_t epoch, oldest_epoch;
+    uint64_t pn;
     int ret;
 
     assert(count != 0);
 
-    init_acks_iter(conn, &iter);
+    expire_sent_packets(conn);
 
-    while (quicly_sentmap_get(&iter)->packet_number < conn->egress.max_lost_pn)
-        quicly_sentmap_skip(&iter);
+    for (epoch = 0; epoch != QUICLY_NUM_EPOCHS; ++epoch)
+        quicly_sentmap_find(&conn->egress.spaces[epoch].sentmap, iters + epoch, conn->egress.spaces[epoch].max_lost_pn);
 
     do {
-        const quicly_sent_packet_t *sent = quicly_sentmap_get(&iter);
-        uint64_t pn;
-        if ((pn = sent->packet_number) == UINT64_MAX) {
-            assert(conn->egress.sentmap.bytes_in_flight == 0);
-            break;
+        /* find the oldest packet in flight */
+        pn = UINT64_MAX;
+        for (epoch = 0; epoch != QUICLY_NUM_EPOCHS; ++epoch) {
+            while ((sent = quicly_sentmap_get(iters + epoch))->packet_number != UINT64_MAX && sent->bytes_in_flight == 0)
+                quicly_sentmap_skip(iters + epoch);
+            if (sent->packet_number < pn) {
+                pn = sent->packet_number;
+                oldest_epoch = epoch;
+            }
         }
-        if ((ret = quicly_sentmap_update(&conn->egress.sentmap, &iter, QUICLY_SENTMAP_EVENT_LOST, conn)) != 0)
+        if (pn == UINT64_MAX)
+            break;
+        if ((ret = quicly_sentmap_update(&conn->egress.spaces[oldest_epoch].sentmap, iters + oldest_epoch,
+                                         QUICLY_SENTMAP_EVENT_LOST, conn)) != 0)
             return ret;
-        conn->egress.max_lost_pn = pn + 1;
+        conn->egress.spaces[oldest_epoch].max_lost_pn = pn + 1;
     } while (--count != 0);
 
     return 0;
 }
 
-/* this function ensures that the value returned in loss_time is when the next
+static void reset_cc(quicly_conn_t *conn, uint32_t cwnd)
+{
+    cc_destroy(&conn->egress.cc.ccv);
+    init_cc(&conn->egress.cc.ccv, cwnd);
+}
+
+static void set_careful_resume_phase(quicly_conn_t *conn, uint8_t phase)
+{
+    conn->egress.cc.careful_resume.phase = phase;
+    LOG_CONNECTION_EVENT(conn, QUICLY_EVENT_TYPE_CC_CAREFUL_RESUME, INT_EVENT_ATTR(STATE, phase),
+                         INT_EVENT_ATTR(CWND, cc_get_cwnd(&conn->egress.cc.ccv)));
+}
+
+static void careful_resume_on_ack(quicly_conn_t *conn, uint64_t largest_acked)
+{
+    switch (conn->egress.cc.careful_resume.phase) {
+    case CAREFUL_RESUME_RECONNAISSANCE: {
+        const quicly_path_state_t *remembered = &conn->egress.cc.careful_resume.remembered;
+        uint32_t jump_cwnd = remembered->cwnd / 2;
+        if (!ptls_handshake_is_complete(conn->crypto.tls) || conn->egress.loss.rtt.smoothed == 0)
+            break;
+        /* use the remembered window only if the session has been resumed and the RTT of the path is similar */
+        if (ptls_is_psk_handshake(conn->crypto.tls) && conn->egress.loss.rtt.minimum >= remembered->min_rtt / 2 &&
+            conn->egress.loss.rtt.minimum <= (uint64_t)remembered->min_rtt * 10 && jump_cwnd > cc_get_cwnd(&conn->egress.cc.ccv)) {
+            reset_cc(conn, jump_cwnd);
+            conn->egress.cc.careful_resume.jump_pn = conn->egress.packet_number;
+            conn->egress.cc.careful_resume.validate_pn = UINT64_MAX;
+            set_careful_resume_phase(conn, CAREFUL_RESUME_UNVALIDATED);
+        } else {
+            set_careful_resume_phase(conn, CAREFUL_RESUME_NONE);
+        }
+    } break;
+    case CAREFUL_RESUME_UNVALIDATED:
+        /* the packets sent until now constitute the first flight sent using the raised window */
+        if (largest_acked >= conn->egress.cc.careful_resume.jump_pn) {
+            conn->egress.cc.careful_resume.validate_pn = conn->egress.packet_number;
+            set_careful_resume_phase(conn, CAREFUL_RESUME_VALIDATING);
+        }
+        break;
+    case CAREFUL_RESUME_VALIDATING:
+        if (largest_acked + 1 >= conn->egress.cc.careful_resume.validate_pn)
+            set_careful_resume_phase(conn, CAREFUL_RESUME_NONE);
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * returns if the loss has been handled by retreating from the raised window
+ */
+static int careful_resume_on_loss(quicly_conn_t *conn, uint64_t lost_pn)
+{
+    switch (conn->egress.cc.careful_resume.phase) {
+    case CAREFUL_RESUME_UNVALIDATED:
+    case CAREFUL_RESUME_VALIDATING:
+        break;
+    default:
+        return 0;
+    }
+    if (!(conn->egress.cc.careful_resume.jump_pn <= lost_pn && lost_pn < conn->egress.cc.careful_resume.validate_pn))
+        return 0;
+
+    /* the remembered window does not fit the path; restart from the initial window */
+    reset_cc(conn, INITIAL_CWND);
+    set_careful_resume_phase(conn, CAREFUL_RESUME_NONE);
+    return 1;
+}
+
+/* this function ensures that the value saved in the loss_time of the packet number space is when the next
  * application timer should be set for loss detection. if no timer is required,
  * loss_time is set to INT64_MAX.
  */
-static int do_detect_loss(quicly_loss_t *ld, uint64_t largest_pn, uint32_t delay_until_lost, int64_t *loss_time)
+static int detect_loss_in_space(quicly_conn_t *conn, struct st_quicly_sent_space_t *space, uint32_t delay_until_lost)
 {
-    quicly_conn_t *conn = (void *)((char *)ld - offsetof(quicly_conn_t, egress.loss));
     quicly_sentmap_iter_t iter;
     const quicly_sent_packet_t *sent;
     int64_t sent_before = now - delay_until_lost;
-    uint64_t largest_newly_lost_pn = UINT64_MAX;
+    uint64_t largest_pn = space->largest_acked, largest_newly_lost_pn = UINT64_MAX;
     int is_loss = 0, ret;
 
-    *loss_time = INT64_MAX;
+    space->loss_time = INT64_MAX;
 
-    init_acks_iter(conn, &iter);
+    /* packets below max_lost_pn have already been deemed lost */
+    quicly_sentmap_find(&space->sentmap, &iter, space->max_lost_pn);
 
-    /* mark packets as lost if they are smaller than the largest_pn and outside
-     * the early retransmit window. in other words, packets that are not ready
-     * to be marked as lost according to the early retransmit timer.
+    /* mark packets as lost if they are smaller than the largest_pn and either outside the early retransmit window or at least
+     * packet_threshold packets behind the largest_pn. As packet numbers are shared by all the epochs, the distance is counted using
+     * seq, which is the order of the packets within the packet number space (a distance that wraps around is left to the time
+     * threshold).
      */
-    while ((sent = quicly_sentmap_get(&iter))->packet_number < largest_pn && sent->sent_at <= sent_before) {
-        if (sent->bytes_in_flight != 0 && conn->egress.max_lost_pn <= sent->packet_number) {
+    while ((sent = quicly_sentmap_get(&iter))->packet_number < largest_pn &&
+           (sent->sent_at <= sent_before ||
+            (uint16_t)(space->largest_acked_seq - sent->seq) >= conn->egress.loss.conf->packet_threshold)) {
+        if (sent->bytes_in_flight != 0 && space->max_lost_pn <= sent->packet_number) {
+            /* the loss of a PMTU probe is due to its size, rather than congestion */
+            if (sent->packet_number != conn->egress.pmtud.probe_pn)
+                is_loss = 1;
             if (sent->packet_number != largest_newly_lost_pn) {
                 ++conn->super.num_packets.lost;
                 largest_newly_lost_pn = sent->packet_number;
                 LOG_CONNECTION_EVENT(conn, QUICLY_EVENT_TYPE_PACKET_LOST, INT_EVENT_ATTR(PACKET_NUMBER, largest_newly_lost_pn));
             }
-            if ((ret = quicly_sentmap_update(&conn->egress.sentmap, &iter, QUICLY_SENTMAP_EVENT_LOST, conn)) != 0)
+            if ((ret = quicly_sentmap_update(&space->sentmap, &iter, QUICLY_SENTMAP_EVENT_LOST, conn)) != 0)
                 return ret;
-            is_loss = 1;
         } else {
             quicly_sentmap_skip(&iter);
         }
     }
-    if (largest_newly_lost_pn != UINT64_MAX) {
-        conn->egress.max_lost_pn = largest_newly_lost_pn + 1;
+    if (largest_newly_lost_pn != UINT64_MAX)
+        space->max_lost_pn = largest_newly_lost_pn + 1;
+    if (is_loss) {
         conn->egress.cc.end_of_recovery = conn->egress.packet_number - 1;
-        if (is_loss && conn->egress.loss.rto_count == 0) {
-            cc_cong_signal(&conn->egress.cc.ccv, CC_ECN, (uint32_t)conn->egress.sentmap.bytes_in_flight);
-            LOG_CONNECTION_EVENT(conn, QUICLY_EVENT_TYPE_CC_CONGESTION, INT_EVENT_ATTR(MAX_LOST_PN, conn->egress.max_lost_pn),
+        if (conn->egress.loss.rto_count == 0) {
+            size_t bytes_in_flight = get_bytes_in_flight(conn);
+            if (!careful_resume_on_loss(conn, largest_newly_lost_pn))
+                cc_cong_signal(&conn->egress.cc.ccv, CC_ECN, (uint32_t)bytes_in_flight);
+            LOG_CONNECTION_EVENT(conn, QUICLY_EVENT_TYPE_CC_CONGESTION, INT_EVENT_ATTR(MAX_LOST_PN, space->max_lost_pn),
                                  INT_EVENT_ATTR(END_OF_RECOVERY, conn->egress.cc.end_of_recovery),
-                                 INT_EVENT_ATTR(BYTES_IN_FLIGHT, conn->egress.sentmap.bytes_in_flight),
+                                 INT_EVENT_ATTR(BYTES_IN_FLIGHT, bytes_in_flight),
                                  INT_EVENT_ATTR(CWND, cc_get_cwnd(&conn->egress.cc.ccv)));
         }
     }
@@ -2616,7 +3315,7 @@ static int do_detect_loss(quicly_loss_t *ld, uint64_t largest_pn, uint32_t delay
     /* schedule early retransmit alarm if there is a packet outstanding that is smaller than largest_pn */
     while (sent->packet_number < largest_pn && sent->sent_at != INT64_MAX) {
         if (sent->bytes_in_flight != 0) {
-            *loss_time = sent->sent_at + delay_until_lost;
+            space->loss_time = sent->sent_at + delay_until_lost;
             break;
         }
         quicly_sentmap_skip(&iter);
@@ -2626,6 +3325,58 @@ static int do_detect_loss(quicly_loss_t *ld, uint64_t largest_pn, uint32_t delay
     return 0;
 }
 
+static int64_t get_earliest_loss_time(quicly_conn_t *conn)
+{
+    int64_t loss_time = INT64_MAX;
+    size_t epoch;
+
+    for (epoch = 0; epoch != QUICLY_NUM_EPOCHS; ++epoch)
+        if (conn->egress.spaces[epoch].loss_time < loss_time)
+            loss_time = conn->egress.spaces[epoch].loss_time;
+
+    return loss_time;
+}
+
+/**
+ * runs loss detection for the packet number spaces specified by the bit vector of epochs, updating the loss time of the connection
+ */
+static int detect_loss(quicly_conn_t *conn, unsigned epochs)
+{
+    uint32_t delay_until_lost = quicly_loss_get_delay_until_lost(&conn->egress.loss);
+    size_t epoch;
+    int ret;
+
+    for (epoch = 0; epoch != QUICLY_NUM_EPOCHS; ++epoch) {
+        if ((epochs & (1u << epoch)) != 0 && (ret = detect_loss_in_space(conn, conn->egress.spaces + epoch, delay_until_lost)) != 0)
+            return ret;
+    }
+    conn->egress.loss.loss_time = get_earliest_loss_time(conn);
+
+    return 0;
+}
+
+/**
+ * Callback of quicly_loss_on_alarm, called when the loss time has been reached. Loss detection is run for the packet number spaces
+ * that have reached their loss time, using the largest packet number acknowledged in each space; `largest_pn` is not used.
+ */
+static int do_detect_loss(quicly_loss_t *ld, uint64_t largest_pn, uint32_t delay_until_lost, int64_t *loss_time)
+{
+    quicly_conn_t *conn = (void *)((char *)ld - offsetof(quicly_conn_t, egress.loss));
+    size_t epoch;
+    int ret;
+
+    expire_sent_packets(conn);
+
+    for (epoch = 0; epoch != QUICLY_NUM_EPOCHS; ++epoch) {
+        struct st_quicly_sent_space_t *space = conn->egress.spaces + epoch;
+        if (space->loss_time <= now && (ret = detect_loss_in_space(conn, space, delay_until_lost)) != 0)
+            return ret;
+    }
+    *loss_time = get_earliest_loss_time(conn);
+
+    return 0;
+}
+
 static void open_id_blocked_streams(quicly_conn_t *conn, int uni)
 {
     uint64_t count;
@@ -2689,6 +3440,9 @@ quicly_datagram_t *quicly_send_version_negotiation(quicly_context_t *ctx, struct
 
     if ((packet = ctx->alloc_packet(ctx, salen, ctx->max_packet_size)) == NULL)
         return NULL;
+    packet->segment_size = 0;
+    packet->txtime = 0;
+    packet->ecn = QUICLY_ECN_NOT_ECT;
     packet->salen = salen;
     memcpy(&packet->sa, sa, salen);
     dst = packet->data.base;
@@ -2725,6 +3479,9 @@ quicly_datagram_t *quicly_send_retry(quicly_context_t *ctx, struct sockaddr *sa,
 
     if ((packet = ctx->alloc_packet(ctx, salen, ctx->max_packet_size)) == NULL)
         return NULL;
+    packet->segment_size = 0;
+    packet->txtime = 0;
+    packet->ecn = QUICLY_ECN_NOT_ECT;
     packet->salen = salen;
     memcpy(&packet->sa, sa, salen);
     dst = packet->data.base;
@@ -2833,6 +3590,129 @@ static int send_connection_close(quicly_conn_t *conn, struct st_quicly_send_cont
     return 0;
 }
 
+static size_t ingress_aead_index(uint64_t generation)
+{
+    /* the first 1-RTT key (key phase 0) uses aead[1], as aead[0] is used by 0-RTT */
+    return (generation & 1) == 0;
+}
+
+static int derive_next_secret(ptls_cipher_suite_t *cipher, uint8_t *next_secret, const uint8_t *secret)
+{
+    return ptls_hkdf_expand_label(cipher->hash, next_secret, cipher->hash->digest_size,
+                                  ptls_iovec_init(secret, cipher->hash->digest_size), "traffic upd", ptls_iovec_init(NULL, 0), NULL);
+}
+
+/**
+ * derives the keys of the next generation if they are not yet available; called at the end of quicly_send
+ */
+static int prepare_next_keys(quicly_conn_t *conn)
+{
+    struct st_quicly_application_space_t *space = conn->application;
+    ptls_cipher_suite_t *cipher;
+    int ret;
+
+    if (space == NULL)
+        return 0;
+    cipher = ptls_get_cipher(conn->crypto.tls);
+
+    /* egress */
+    if (space->one_rtt_writable && space->cipher.key_update.egress.next_aead == NULL) {
+        if ((ret = derive_next_secret(cipher, space->cipher.key_update.egress.next_secret, space->cipher.key_update.egress.secret)) !=
+            0)
+            return ret;
+        if ((space->cipher.key_update.egress.next_aead = ptls_aead_new(
+                 cipher->aead, cipher->hash, 1, space->cipher.key_update.egress.next_secret, AEAD_BASE_LABEL)) == NULL)
+            return PTLS_ERROR_NO_MEMORY;
+    }
+
+    /* ingress; the key of the previous generation is replaced once its retention period is over, while the slot is kept intact
+     * until the 0-RTT key is discarded */
+    if (space->cipher.ingress.header_protection.one_rtt != NULL && space->cipher.ingress.header_protection.zero_rtt == NULL &&
+        !space->cipher.key_update.ingress.next_ready && now >= space->cipher.key_update.ingress.retain_prev_until) {
+        ptls_aead_context_t **slot = &space->cipher.ingress.aead[ingress_aead_index(space->cipher.key_update.ingress.generation + 1)];
+        if (*slot != NULL) {
+            ptls_aead_free(*slot);
+            *slot = NULL;
+        }
+        if ((ret = derive_next_secret(cipher, space->cipher.key_update.ingress.next_secret,
+                                      space->cipher.key_update.ingress.secret)) != 0)
+            return ret;
+        if ((*slot = ptls_aead_new(cipher->aead, cipher->hash, 0, space->cipher.key_update.ingress.next_secret, AEAD_BASE_LABEL)) ==
+            NULL)
+            return PTLS_ERROR_NO_MEMORY;
+        space->cipher.key_update.ingress.next_ready = 1;
+    }
+
+    return 0;
+}
+
+static int update_egress_key(quicly_conn_t *conn)
+{
+    struct st_quicly_application_space_t *space = conn->application;
+    int ret;
+
+    if (space->cipher.key_update.egress.next_aead == NULL && (ret = prepare_next_keys(conn)) != 0)
+        return ret;
+
+    ptls_aead_free(space->cipher.egress.aead);
+    space->cipher.egress.aead = space->cipher.key_update.egress.next_aead;
+    space->cipher.key_update.egress.next_aead = NULL;
+    memcpy(space->cipher.key_update.egress.secret, space->cipher.key_update.egress.next_secret,
+           sizeof(space->cipher.key_update.egress.secret));
+    ++space->cipher.key_update.egress.generation;
+    space->cipher.key_update.egress.first_pn = conn->egress.packet_number;
+    space->cipher.key_update.egress.confirmed_at = INT64_MAX;
+
+    LOG_CONNECTION_EVENT(conn, QUICLY_EVENT_TYPE_CRYPTO_KEY_UPDATE, INT_EVENT_ATTR(IS_ENC, 1),
+                         INT_EVENT_ATTR(KEY_GENERATION, space->cipher.key_update.egress.generation));
+    return 0;
+}
+
+static int initiate_key_update_if_necessary(quicly_conn_t *conn)
+{
+    struct st_quicly_application_space_t *space = conn->application;
+
+    if (!(space->cipher.key_update.egress.requested ||
+          (conn->super.ctx->max_packets_per_key != 0 &&
+           conn->egress.packet_number - space->cipher.key_update.egress.first_pn >= conn->super.ctx->max_packets_per_key)))
+        return 0;
+
+    /* an update can be initiated after a packet protected by the current key is acked, and the peer has followed the previous
+     * update; then, the peer is given time to discard the key of the previous generation and to derive the next one */
+    if (!ptls_handshake_is_complete(conn->crypto.tls) || space->cipher.key_update.egress.confirmed_at == INT64_MAX ||
+        space->cipher.key_update.egress.generation != space->cipher.key_update.ingress.generation ||
+        now < space->cipher.key_update.egress.confirmed_at + get_sentmap_expiration_time(conn))
+        return 0;
+
+    space->cipher.key_update.egress.requested = 0;
+    return update_egress_key(conn);
+}
+
+static int on_key_phase_received(quicly_conn_t *conn, int key_phase)
+{
+    struct st_quicly_application_space_t *space = conn->application;
+
+    /* nothing to do if the packet is protected by the current key or by the previous key */
+    if (key_phase == (space->cipher.key_update.ingress.generation & 1) || !space->cipher.key_update.ingress.next_ready)
+        return 0;
+
+    /* the peer has updated the key; the previous key is retained for about 3 PTO (see prepare_next_keys), so that reordered
+     * packets received in the meantime can be decrypted */
+    memcpy(space->cipher.key_update.ingress.secret, space->cipher.key_update.ingress.next_secret,
+           sizeof(space->cipher.key_update.ingress.secret));
+    ++space->cipher.key_update.ingress.generation;
+    space->cipher.key_update.ingress.next_ready = 0;
+    space->cipher.key_update.ingress.retain_prev_until = now + get_sentmap_expiration_time(conn);
+
+    LOG_CONNECTION_EVENT(conn, QUICLY_EVENT_TYPE_CRYPTO_KEY_UPDATE, INT_EVENT_ATTR(IS_ENC, 0),
+                         INT_EVENT_ATTR(KEY_GENERATION, space->cipher.key_update.ingress.generation));
+
+    /* follow the update, unless it has been initiated by us */
+    if (space->cipher.key_update.egress.generation < space->cipher.key_update.ingress.generation)
+        return update_egress_key(conn);
+    return 0;
+}
+
 static int update_traffic_key_cb(ptls_update_traffic_key_t *self, ptls_t *_tls, int is_enc, size_t epoch, const void *secret)
 {
     quicly_conn_t *conn = *ptls_get_data_ptr(_tls);
@@ -2900,6 +3780,16 @@ static int update_traffic_key_cb(ptls_update_traffic_key_t *self, ptls_t *_tls,
     if ((ret = setup_cipher(hp_slot, aead_slot, cipher->aead, cipher->hash, is_enc, secret)) != 0)
         return ret;
 
+    if (epoch == QUICLY_EPOCH_1RTT) {
+        if (is_enc) {
+            memcpy(conn->application->cipher.key_update.egress.secret, secret, cipher->hash->digest_size);
+            conn->application->cipher.key_update.egress.first_pn = conn->egress.packet_number;
+            conn->application->cipher.key_update.egress.confirmed_at = INT64_MAX;
+        } else {
+            memcpy(conn->application->cipher.key_update.ingress.secret, secret, cipher->hash->digest_size);
+        }
+    }
+
     if (epoch == QUICLY_EPOCH_1RTT && is_enc) {
         /* update states now that we have 1-RTT write key */
         conn->application->one_rtt_writable = 1;
@@ -2910,9 +3800,61 @@ static int update_traffic_key_cb(ptls_update_traffic_key_t *self, ptls_t *_tls,
     return 0;
 }
 
-int quicly_send(quicly_conn_t *conn, quicly_datagram_t **packets, size_t *num_packets)
+/**
+ * sends a PMTU probe if necessary. The probe is a PING frame padded to the probed size, sent in a datagram of its own. Like other
+ * ack-eliciting packets, the probe is subject to congestion control and pacing, and is covered by loss recovery. The loss of the
+ * probe does not trigger the congestion response (see detect_loss_in_space).
+ */
+static int send_pmtu_probe(quicly_conn_t *conn, struct st_quicly_send_context_t *s)
+{
+    uint16_t probe_size;
+    quicly_sent_t *sent;
+    int ret;
+
+    if (conn->super.ctx->max_probed_packet_size <= conn->super.ctx->max_packet_size || s->min_packets_to_send != 0 ||
+        !ptls_handshake_is_complete(conn->crypto.tls))
+        return 0;
+
+    /* the outcome of the probe in flight is reported by loss recovery */
+    if (conn->egress.pmtud.probe_size != 0 || now < conn->egress.pmtud.next_probe_at)
+        return 0;
+    if ((probe_size = pmtud_next_probe_size(conn)) == 0) {
+        /* the search has converged some time ago; see if the PMTU has been raised since then */
+        conn->egress.pmtud.search_high = conn->super.ctx->max_probed_packet_size;
+        if ((probe_size = pmtud_next_probe_size(conn)) == 0) {
+            conn->egress.pmtud.next_probe_at = now + PMTUD_RAISE_INTERVAL;
+            return 0;
+        }
+    }
+
+    /* wait until the congestion controller and the pacer permit sending the entire probe */
+    if (round_send_window(s->send_window) < (ssize_t)probe_size)
+        return 0;
+
+    /* close the packet under construction, and send the probe in a datagram of its own */
+    if (s->target.packet != NULL && (ret = commit_send_packet(conn, s, 0)) != 0)
+        return ret;
+    s->pmtu_probe_size = probe_size;
+    if ((ret = allocate_ack_eliciting_frame(conn, s, 1, &sent, QUICLY_SENT_TYPE_PMTU_PROBE)) != 0)
+        goto Exit;
+    sent->data.pmtu_probe.size = probe_size;
+    *s->dst++ = QUICLY_FRAME_TYPE_PING;
+    memset(s->dst, QUICLY_FRAME_TYPE_PADDING, s->dst_end - s->dst);
+    s->dst = s->dst_end;
+    conn->egress.pmtud.probe_size = probe_size;
+    conn->egress.pmtud.probe_pn = conn->egress.packet_number;
+    LOG_CONNECTION_EVENT(conn, QUICLY_EVENT_TYPE_PMTU_PROBE, INT_EVENT_ATTR(PACKET_NUMBER, conn->egress.packet_number),
+                         INT_EVENT_ATTR(LENGTH, probe_size));
+    ret = commit_send_packet(conn, s, 0);
+
+Exit:
+    s->pmtu_probe_size = 0;
+    return ret;
+}
+
+static int do_send(quicly_conn_t *conn, quicly_datagram_t **packets, size_t *num_packets)
 {
-    struct st_quicly_send_context_t s = {{NULL, -1}, {NULL, NULL, NULL}, packets, *num_packets};
+    struct st_quicly_send_context_t s = {{NULL, -1}, {NULL, NULL, NULL}, NULL, packets, *num_packets};
     int ret;
 
     update_now(conn->super.ctx);
@@ -2921,9 +3863,8 @@ int quicly_send(quicly_conn_t *conn, quicly_datagram_t **packets, size_t *num_pa
 
     if (conn->super.state >= QUICLY_STATE_CLOSING) {
         /* check if the connection can be closed now (after 3 pto) */
-        quicly_sentmap_iter_t iter;
-        init_acks_iter(conn, &iter);
-        if (quicly_sentmap_get(&iter)->packet_number == UINT64_MAX)
+        int64_t oldest_sent_at = expire_sent_packets(conn);
+        if (oldest_sent_at == INT64_MAX)
             return QUICLY_ERROR_FREE_CONNECTION;
         if (conn->super.state == QUICLY_STATE_CLOSING && conn->egress.send_ack_at <= now) {
             destroy_all_streams(conn); /* delayed until the emission of CONNECTION_CLOSE frame to allow quicly_close to be called
@@ -2942,8 +3883,9 @@ int quicly_send(quicly_conn_t *conn, quicly_datagram_t **packets, size_t *num_pa
                 return ret;
             if ((ret = commit_send_packet(conn, &s, 0)) != 0)
                 return ret;
+            seal_pending_packets(&s);
         }
-        conn->egress.send_ack_at = quicly_sentmap_get(&iter)->sent_at + get_sentmap_expiration_time(conn);
+        conn->egress.send_ack_at = oldest_sent_at + get_sentmap_expiration_time(conn);
         assert(conn->egress.send_ack_at > now);
         *num_packets = s.num_packets;
         return 0;
@@ -2955,11 +3897,10 @@ int quicly_send(quicly_conn_t *conn, quicly_datagram_t **packets, size_t *num_pa
                                         do_detect_loss, &s.min_packets_to_send)) != 0)
             goto Exit;
         switch (s.min_packets_to_send) {
-        case 1: /* TLP (try to send new data when handshake is done, otherwise retire oldest handshake packets and retransmit) */
-            LOG_CONNECTION_EVENT(conn, QUICLY_EVENT_TYPE_CC_TLP,
-                                 INT_EVENT_ATTR(BYTES_IN_FLIGHT, conn->egress.sentmap.bytes_in_flight),
+        case 1: /* TLP (send new data if there is any, otherwise retransmit the oldest packet in flight as part of the probe) */
+            LOG_CONNECTION_EVENT(conn, QUICLY_EVENT_TYPE_CC_TLP, INT_EVENT_ATTR(BYTES_IN_FLIGHT, get_bytes_in_flight(conn)),
                                  INT_EVENT_ATTR(CWND, cc_get_cwnd(&conn->egress.cc.ccv)));
-            if (!ptls_handshake_is_complete(conn->crypto.tls)) {
+            if (!ptls_handshake_is_complete(conn->crypto.tls) || !can_send_stream_payload(conn)) {
                 if ((ret = mark_packets_as_lost(conn, s.min_packets_to_send)) != 0)
                     goto Exit;
             }
@@ -2968,14 +3909,16 @@ int quicly_send(quicly_conn_t *conn, quicly_datagram_t **packets, size_t *num_pa
             uint32_t cc_type = 0;
             if (!conn->egress.cc.in_first_rto) {
                 cc_type = CC_FIRST_RTO;
-                cc_cong_signal(&conn->egress.cc.ccv, cc_type, (uint32_t)conn->egress.sentmap.bytes_in_flight);
+                cc_cong_signal(&conn->egress.cc.ccv, cc_type, (uint32_t)get_bytes_in_flight(conn));
                 conn->egress.cc.in_first_rto = 1;
             }
             LOG_CONNECTION_EVENT(conn, QUICLY_EVENT_TYPE_CC_RTO, INT_EVENT_ATTR(CC_TYPE, cc_type),
-                                 INT_EVENT_ATTR(BYTES_IN_FLIGHT, conn->egress.sentmap.bytes_in_flight),
+                                 INT_EVENT_ATTR(BYTES_IN_FLIGHT, get_bytes_in_flight(conn)),
                                  INT_EVENT_ATTR(CWND, cc_get_cwnd(&conn->egress.cc.ccv)));
             if ((ret = mark_packets_as_lost(conn, s.min_packets_to_send)) != 0)
                 goto Exit;
+            if (conn->egress.loss.rto_count >= 2)
+                pmtud_on_black_hole(conn);
         } break;
         default:
             break;
@@ -2984,15 +3927,32 @@ int quicly_send(quicly_conn_t *conn, quicly_datagram_t **packets, size_t *num_pa
 
     { /* calculate send window */
         uint32_t cwnd = cc_get_cwnd(&conn->egress.cc.ccv);
-        if (conn->egress.sentmap.bytes_in_flight < cwnd)
-            s.send_window = cwnd - conn->egress.sentmap.bytes_in_flight;
+        size_t bytes_in_flight = get_bytes_in_flight(conn);
+        if (bytes_in_flight < cwnd)
+            s.send_window = cwnd - bytes_in_flight;
+    }
+
+    /* limit the send window by the credit of the pacer; packets are sent only when there is enough credit for a full-sized packet,
+     * unless pacing is offloaded using txtime */
+    if (conn->super.ctx->pacer != NULL) {
+        int64_t burst, min_credit;
+        uint64_t rate = calc_pacing_rate(conn, &burst);
+        quicly_pacer_update(&conn->egress.pacer, now, rate, burst);
+        if (!conn->super.ctx->pace_by_txtime) {
+            min_credit = burst < conn->egress.max_packet_size ? burst : conn->egress.max_packet_size;
+            if (conn->egress.pacer.credit < min_credit) {
+                s.send_window = 0;
+            } else if (s.send_window > conn->egress.pacer.credit) {
+                s.send_window = (ssize_t)conn->egress.pacer.credit;
+            }
+        }
     }
 
     /* If TLP or RTO, ensure there's enough send_window to send */
     if (s.min_packets_to_send != 0) {
         assert(s.min_packets_to_send <= s.max_packets);
-        if (s.send_window < s.min_packets_to_send * conn->super.ctx->max_packet_size)
-            s.send_window = s.min_packets_to_send * conn->super.ctx->max_packet_size;
+        if (s.send_window < s.min_packets_to_send * conn->egress.max_packet_size)
+            s.send_window = s.min_packets_to_send * conn->egress.max_packet_size;
     }
 
     { /* send handshake flows */
@@ -3006,6 +3966,8 @@ int quicly_send(quicly_conn_t *conn, quicly_datagram_t **packets, size_t *num_pa
     if (conn->application != NULL && (s.current.cipher = &conn->application->cipher.egress)->header_protection != NULL) {
         if (conn->application->one_rtt_writable) {
             s.current.first_byte = QUICLY_QUIC_BIT; /* short header */
+            if ((ret = initiate_key_update_if_necessary(conn)) != 0)
+                goto Exit;
             /* acks */
             if (conn->application->super.unacked_count != 0) {
                 if ((ret = send_ack(conn, &conn->application->super, &s)) != 0)
@@ -3031,7 +3993,8 @@ int quicly_send(quicly_conn_t *conn, quicly_datagram_t **packets, size_t *num_pa
             uint64_t new_count = conn->super.peer.label.next_stream_id / 4 +                                                       \
                                  conn->super.ctx->transport_params.max_streams_##label - conn->super.peer.label.num_streams;       \
             quicly_sent_t *sent;                                                                                                   \
-            if ((ret = allocate_ack_eliciting_frame(conn, &s, QUICLY_MAX_STREAMS_FRAME_CAPACITY, &sent, on_ack_max_streams)) != 0) \
+            if ((ret = allocate_ack_eliciting_frame(conn, &s, QUICLY_MAX_STREAMS_FRAME_CAPACITY, &sent,                            \
+                                                    QUICLY_SENT_TYPE_MAX_STREAMS)) != 0)                                           \
                 goto Exit;                                                                                                         \
             s.dst = quicly_encode_max_streams_frame(s.dst, is_uni, new_count);                                                     \
             sent->data.max_streams.uni = is_uni;                                                                                   \
@@ -3045,7 +4008,8 @@ int quicly_send(quicly_conn_t *conn, quicly_datagram_t **packets, size_t *num_pa
             if (quicly_maxsender_should_update(&conn->ingress.max_data.sender, conn->ingress.max_data.bytes_consumed,
                                                (uint32_t)conn->super.ctx->transport_params.max_data, 512)) {
                 quicly_sent_t *sent;
-                if ((ret = allocate_ack_eliciting_frame(conn, &s, QUICLY_MAX_DATA_FRAME_CAPACITY, &sent, on_ack_max_data)) != 0)
+                if ((ret = allocate_ack_eliciting_frame(conn, &s, QUICLY_MAX_DATA_FRAME_CAPACITY, &sent,
+                                                        QUICLY_SENT_TYPE_MAX_DATA)) != 0)
                     goto Exit;
                 uint64_t new_value = conn->ingress.max_data.bytes_consumed + conn->super.ctx->transport_params.max_data;
                 s.dst = quicly_encode_max_data_frame(s.dst, new_value);
@@ -3061,7 +4025,7 @@ int quicly_send(quicly_conn_t *conn, quicly_datagram_t **packets, size_t *num_pa
         if (quicly_maxsender_should_send_blocked(&max_streams->blocked_sender, max_stream->stream_id / 4)) {                       \
             quicly_sent_t *sent;                                                                                                   \
             if ((ret = allocate_ack_eliciting_frame(conn, &s, QUICLY_STREAMS_BLOCKED_FRAME_CAPACITY, &sent,                        \
-                                                    on_ack_streams_blocked)) != 0)                                                 \
+                                                    QUICLY_SENT_TYPE_STREAMS_BLOCKED)) != 0)                                       \
                 goto Exit;                                                                                                         \
             s.dst = quicly_encode_streams_blocked_frame(s.dst, is_uni, max_stream->stream_id / 4);                                 \
             sent->data.streams_blocked.uni = is_uni;                                                                               \
@@ -3071,6 +4035,9 @@ int quicly_send(quicly_conn_t *conn, quicly_datagram_t **packets, size_t *num_pa
             SEND_STREAMS_BLOCKED(uni, 1);
             SEND_STREAMS_BLOCKED(bidi, 0);
 #undef SEND_STREAMS_BLOCKED
+            /* PMTU probe */
+            if ((ret = send_pmtu_probe(conn, &s)) != 0)
+                goto Exit;
         } else {
             s.current.first_byte = QUICLY_PACKET_TYPE_0RTT;
         }
@@ -3090,7 +4057,7 @@ int quicly_send(quicly_conn_t *conn, quicly_datagram_t **packets, size_t *num_pa
     if (s.target.packet != NULL)
         commit_send_packet(conn, &s, 0);
 
-    /* TLP (TODO use these packets to retransmit data) */
+    /* TLP, RTO; pad with PINGs when there has not been enough data to fill the probes */
     if (s.min_packets_to_send != 0) {
         if (QUICLY_PACKET_IS_LONG_HEADER(s.current.first_byte)) {
             if (conn->handshake != NULL && (s.current.cipher = &conn->handshake->cipher.egress)->aead != NULL) {
@@ -3111,8 +4078,11 @@ int quicly_send(quicly_conn_t *conn, quicly_datagram_t **packets, size_t *num_pa
 
     ret = 0;
 Exit:
+    seal_pending_packets(&s);
     if (ret == QUICLY_ERROR_SENDBUF_FULL)
         ret = 0;
+    if (ret == 0)
+        ret = prepare_next_keys(conn);
     if (ret == 0) {
         conn->egress.send_ack_at = INT64_MAX; /* we have send ACKs for every epoch */
         update_loss_alarm(conn);
@@ -3123,6 +4093,13 @@ Exit:
     return ret;
 }
 
+int quicly_send(quicly_conn_t *conn, quicly_datagram_t **packets, size_t *num_packets)
+{
+    int ret = do_send(conn, packets, num_packets);
+    update_timer(conn);
+    return ret;
+}
+
 static int on_end_closing(quicly_conn_t *conn, const quicly_sent_packet_t *packet, quicly_sent_t *sent,
                           quicly_sentmap_event_t event)
 {
@@ -3133,6 +4110,7 @@ static int on_end_closing(quicly_conn_t *conn, const quicly_sent_packet_t *packe
 
 static int enter_close(quicly_conn_t *conn, int host_is_initiating)
 {
+    quicly_sent_t *sent;
     int ret;
 
     assert(conn->super.state < QUICLY_STATE_CLOSING);
@@ -3140,11 +4118,13 @@ static int enter_close(quicly_conn_t *conn, int host_is_initiating)
     /* release all inflight info, register a close timeout */
     if ((ret = discard_sentmap_by_epoch(conn, ~0u)) != 0)
         return ret;
-    if ((ret = quicly_sentmap_prepare(&conn->egress.sentmap, conn->egress.packet_number, now, QUICLY_EPOCH_INITIAL)) != 0)
+    quicly_sentmap_t *sentmap = &conn->egress.spaces[QUICLY_EPOCH_INITIAL].sentmap;
+    if ((ret = quicly_sentmap_prepare(sentmap, conn->egress.packet_number, now, QUICLY_EPOCH_INITIAL)) != 0)
         return ret;
-    if (quicly_sentmap_allocate(&conn->egress.sentmap, on_end_closing) == NULL)
+    if ((sent = quicly_sentmap_allocate(sentmap, QUICLY_SENT_TYPE_CALLBACK)) == NULL)
         return PTLS_ERROR_NO_MEMORY;
-    quicly_sentmap_commit(&conn->egress.sentmap, 0);
+    sent->data.callback.acked = on_end_closing;
+    quicly_sentmap_commit(sentmap, 0);
     ++conn->egress.packet_number;
 
     if (host_is_initiating) {
@@ -3162,6 +4142,8 @@ static int enter_close(quicly_conn_t *conn, int host_is_initiating)
 
 int quicly_close(quicly_conn_t *conn, const uint16_t *app_error_code, const char *reason_phrase)
 {
+    int ret;
+
     if (reason_phrase == NULL)
         reason_phrase = "";
     if (app_error_code != NULL) {
@@ -3174,7 +4156,10 @@ int quicly_close(quicly_conn_t *conn, const uint16_t *app_error_code, const char
         conn->egress.connection_close.reason_phrase = "idle timeout";
     }
     conn->egress.send_ack_at = 0;
-    return enter_close(conn, 1);
+    if ((ret = enter_close(conn, 1)) != 0)
+        return ret;
+    update_timer(conn);
+    return 0;
 }
 
 static int get_stream_or_open_if_new(quicly_conn_t *conn, uint64_t stream_id, quicly_stream_t **stream)
@@ -3248,71 +4233,120 @@ static int handle_reset_stream_frame(quicly_conn_t *conn, quicly_reset_stream_fr
     return 0;
 }
 
+/**
+ * validates the ECN counters reported by the peer, and reacts to the increase of CE marks in the same way as to packet loss
+ */
+static void on_ecn_counts_received(quicly_conn_t *conn, struct st_quicly_pn_space_t *space, const quicly_ecn_counts_t *counts,
+                                   size_t num_newly_acked)
+{
+    quicly_ecn_counts_t *prev = &space->peer_ecn_counts;
+
+    /* counters carried by a reordered ACK might go backwards; such counters are ignored */
+    if (counts->ect0 < prev->ect0 || counts->ect1 < prev->ect1 || counts->ce < prev->ce)
+        return;
+
+    /* every packet being newly acked has been marked ECT(0). The validation fails if the marks are not reported (e.g., being
+     * bleached on the path, or the peer not supporting ECN), or if ECT(1) is reported */
+    if (counts->ect0 - prev->ect0 + counts->ce - prev->ce < num_newly_acked || counts->ect1 != prev->ect1) {
+        conn->egress.ecn.is_capable = 0;
+        LOG_CONNECTION_EVENT(conn, QUICLY_EVENT_TYPE_ECN_DISABLE, INT_EVENT_ATTR(ECN_CE, counts->ce));
+        return;
+    }
+
+    if (counts->ce > prev->ce && conn->egress.cc.end_of_recovery == UINT64_MAX) {
+        conn->egress.cc.end_of_recovery = conn->egress.packet_number - 1;
+        cc_cong_signal(&conn->egress.cc.ccv, CC_ECN, (uint32_t)get_bytes_in_flight(conn));
+        LOG_CONNECTION_EVENT(conn, QUICLY_EVENT_TYPE_CC_ECN_CONGESTION, INT_EVENT_ATTR(ECN_CE, counts->ce),
+                             INT_EVENT_ATTR(END_OF_RECOVERY, conn->egress.cc.end_of_recovery),
+                             INT_EVENT_ATTR(BYTES_IN_FLIGHT, get_bytes_in_flight(conn)),
+                             INT_EVENT_ATTR(CWND, cc_get_cwnd(&conn->egress.cc.ccv)));
+    }
+
+    *prev = *counts;
+}
+
 static int handle_ack_frame(quicly_conn_t *conn, size_t epoch, quicly_ack_frame_t *frame)
 {
+    struct st_quicly_sent_space_t *sent_space;
     quicly_sentmap_iter_t iter;
     uint64_t packet_number = frame->smallest_acknowledged;
     struct {
         uint64_t packet_number;
         int64_t sent_at;
+        uint16_t seq;
     } largest_newly_acked = {UINT64_MAX, INT64_MAX};
     uint64_t smallest_newly_acked = UINT64_MAX;
-    size_t segs_acked = 0, bytes_acked = 0;
+    size_t num_newly_acked = 0, segs_acked = 0, bytes_acked = 0;
     int ret;
 
     if (epoch == 1)
         return QUICLY_ERROR_PROTOCOL_VIOLATION;
+    sent_space = conn->egress.spaces + epoch;
 
-    init_acks_iter(conn, &iter);
+    expire_sent_packets(conn);
 
     size_t gap_index = frame->num_gaps;
     while (1) {
-        uint64_t block_length = frame->ack_block_lengths[gap_index];
-        if (block_length != 0) {
-            while (quicly_sentmap_get(&iter)->packet_number < packet_number)
-                quicly_sentmap_skip(&iter);
-            do {
-                const quicly_sent_packet_t *sent;
-                if ((sent = quicly_sentmap_get(&iter))->packet_number == packet_number) {
-                    ++conn->super.num_packets.ack_received;
-                    if (epoch == sent->ack_epoch) {
-                        largest_newly_acked.packet_number = packet_number;
-                        largest_newly_acked.sent_at = sent->sent_at;
-                        if (smallest_newly_acked == UINT64_MAX)
-                            smallest_newly_acked = packet_number;
-                        LOG_CONNECTION_EVENT(conn, QUICLY_EVENT_TYPE_PACKET_ACKED, INT_EVENT_ATTR(PACKET_NUMBER, packet_number),
-                                             INT_EVENT_ATTR(NEWLY_ACKED, 1));
-                        if (sent->bytes_in_flight != 0) {
-                            ++segs_acked;
-                            bytes_acked += sent->bytes_in_flight;
-                        }
-                        if ((ret = quicly_sentmap_update(&conn->egress.sentmap, &iter, QUICLY_SENTMAP_EVENT_ACKED, conn)) != 0)
-                            return ret;
-                    } else {
-                        quicly_sentmap_skip(&iter);
-                    }
+        uint64_t block_end = packet_number + frame->ack_block_lengths[gap_index];
+        if (packet_number != block_end) {
+            /* look up the first packet of the block, then visit the packets being tracked within the block */
+            const quicly_sent_packet_t *sent;
+            quicly_sentmap_find(&sent_space->sentmap, &iter, packet_number);
+            while ((sent = quicly_sentmap_get(&iter))->packet_number < block_end) {
+                ++conn->super.num_packets.ack_received;
+                largest_newly_acked.packet_number = sent->packet_number;
+                largest_newly_acked.sent_at = sent->sent_at;
+                largest_newly_acked.seq = sent->seq;
+                if (smallest_newly_acked == UINT64_MAX)
+                    smallest_newly_acked = sent->packet_number;
+                ++num_newly_acked;
+                LOG_CONNECTION_EVENT(conn, QUICLY_EVENT_TYPE_PACKET_ACKED, INT_EVENT_ATTR(PACKET_NUMBER, sent->packet_number),
+                                     INT_EVENT_ATTR(NEWLY_ACKED, 1));
+                if (sent->bytes_in_flight != 0) {
+                    ++segs_acked;
+                    bytes_acked += sent->bytes_in_flight;
                 }
-                ++packet_number;
-            } while (--block_length != 0);
+                if ((ret = quicly_sentmap_update(&sent_space->sentmap, &iter, QUICLY_SENTMAP_EVENT_ACKED, conn)) != 0)
+                    return ret;
+            }
+            packet_number = block_end;
         }
         if (gap_index-- == 0)
             break;
         packet_number += frame->gaps[gap_index];
     }
 
+    /* a key update can be initiated once a packet protected by the current key is acknowledged */
+    if (epoch == QUICLY_EPOCH_1RTT && largest_newly_acked.packet_number != UINT64_MAX &&
+        largest_newly_acked.packet_number >= conn->application->cipher.key_update.egress.first_pn &&
+        conn->application->cipher.key_update.egress.confirmed_at == INT64_MAX)
+        conn->application->cipher.key_update.egress.confirmed_at = now;
+
+    /* ECN */
+    if (conn->egress.ecn.is_capable) {
+        struct st_quicly_pn_space_t *space = epoch == QUICLY_EPOCH_INITIAL
+                                                 ? &conn->initial->super
+                                                 : epoch == QUICLY_EPOCH_HANDSHAKE ? &conn->handshake->super : &conn->application->super;
+        on_ecn_counts_received(conn, space, &frame->ecn_counts, num_newly_acked);
+    }
+
     /* OnPacketAcked */
     uint32_t latest_rtt = UINT32_MAX, ack_delay = 0;
     if (largest_newly_acked.packet_number == frame->largest_acknowledged) {
         int64_t t = now - largest_newly_acked.sent_at;
-        if (0 <= t && t < 100000) { /* ignore RTT above 100 seconds */
+        if (0 <= t && t < 100000000) { /* ignore RTT above 100 seconds */
             latest_rtt = (uint32_t)t;
             uint64_t ack_delay_microsecs = frame->ack_delay << conn->super.peer.transport_params.ack_delay_exponent;
-            ack_delay = (uint32_t)((ack_delay_microsecs * 2 + 1000) / 2000);
+            ack_delay = ack_delay_microsecs < latest_rtt ? (uint32_t)ack_delay_microsecs : latest_rtt;
         }
     }
     quicly_loss_on_ack_received(
         &conn->egress.loss, frame->largest_acknowledged, latest_rtt, ack_delay,
         0 /* this relies on the fact that we do not (yet) retransmit ACKs and therefore latest_rtt becoming UINT32_MAX */);
+    if (largest_newly_acked.packet_number != UINT64_MAX && sent_space->largest_acked < largest_newly_acked.packet_number)
+        sent_space->largest_acked_seq = largest_newly_acked.seq;
+    if (sent_space->largest_acked < frame->largest_acknowledged)
+        sent_space->largest_acked = frame->largest_acknowledged;
     /* OnPacketAckedCC */
     uint32_t cc_type = 0;
     /* TODO (jri): this function should be called for every packet newly acked. (kazuho) I do not think so;
@@ -3326,22 +4360,28 @@ static int handle_ack_frame(quicly_conn_t *conn, size_t epoch, quicly_ack_frame_
             conn->egress.cc.in_first_rto = 0;
         }
     }
+    size_t bytes_in_flight = get_bytes_in_flight(conn);
     if (cc_type != 0)
-        cc_cong_signal(&conn->egress.cc.ccv, cc_type, (uint32_t)(conn->egress.sentmap.bytes_in_flight + bytes_acked));
+        cc_cong_signal(&conn->egress.cc.ccv, cc_type, (uint32_t)(bytes_in_flight + bytes_acked));
     int exit_recovery = frame->largest_acknowledged >= conn->egress.cc.end_of_recovery;
-    cc_ack_received(&conn->egress.cc.ccv, CC_ACK, (uint32_t)(conn->egress.sentmap.bytes_in_flight + bytes_acked),
+    cc_ack_received(&conn->egress.cc.ccv, CC_ACK, (uint32_t)(bytes_in_flight + bytes_acked),
                     (uint16_t)segs_acked, (uint32_t)bytes_acked,
-                    conn->egress.loss.rtt.smoothed / 10 /* TODO better way of converting to cc_ticks */, exit_recovery);
+                    conn->egress.loss.rtt.smoothed / 10000 /* TODO better way of converting to cc_ticks */, exit_recovery);
     LOG_CONNECTION_EVENT(conn, QUICLY_EVENT_TYPE_CC_ACK_RECEIVED, INT_EVENT_ATTR(PACKET_NUMBER, frame->largest_acknowledged),
                          INT_EVENT_ATTR(ACKED_PACKETS, segs_acked), INT_EVENT_ATTR(ACKED_BYTES, bytes_acked),
                          INT_EVENT_ATTR(CC_TYPE, cc_type), INT_EVENT_ATTR(CC_EXIT_RECOVERY, exit_recovery),
-                         INT_EVENT_ATTR(CWND, cc_get_cwnd(&conn->egress.cc.ccv)),
-                         INT_EVENT_ATTR(BYTES_IN_FLIGHT, conn->egress.sentmap.bytes_in_flight));
+                         INT_EVENT_ATTR(CWND, cc_get_cwnd(&conn->egress.cc.ccv)), INT_EVENT_ATTR(BYTES_IN_FLIGHT, bytes_in_flight));
     if (exit_recovery)
         conn->egress.cc.end_of_recovery = UINT64_MAX;
+    careful_resume_on_ack(conn, frame->largest_acknowledged);
 
     /* loss-detection  */
-    quicly_loss_detect_loss(&conn->egress.loss, frame->largest_acknowledged, do_detect_loss);
+    if (conn->ingress.batch.active) {
+        conn->ingress.batch.ack_epochs |= 1u << epoch;
+        return 0;
+    }
+    if ((ret = detect_loss(conn, 1u << epoch)) != 0)
+        return ret;
     update_loss_alarm(conn);
 
     return 0;
@@ -3647,7 +4687,7 @@ Exit:
     return ret;
 }
 
-int quicly_receive(quicly_conn_t *conn, quicly_decoded_packet_t *packet)
+static int receive_packet(quicly_conn_t *conn, quicly_decoded_packet_t *packet)
 {
     ptls_cipher_context_t *header_protection;
     ptls_aead_context_t **aead;
@@ -3657,8 +4697,6 @@ int quicly_receive(quicly_conn_t *conn, quicly_decoded_packet_t *packet)
     uint64_t pn;
     int is_ack_only, ret;
 
-    update_now(conn->super.ctx);
-
     LOG_CONNECTION_EVENT(conn, QUICLY_EVENT_TYPE_RECEIVE, VEC_EVENT_ATTR(DCID, packet->cid.dest),
                          QUICLY_PACKET_IS_LONG_HEADER(packet->octets.base[0])
                              ? VEC_EVENT_ATTR(SCID, packet->cid.src)
@@ -3771,7 +4809,15 @@ int quicly_receive(quicly_conn_t *conn, quicly_decoded_packet_t *packet)
         epoch = 3;
     }
 
-    if ((payload = decrypt_packet(header_protection, aead, &(*space)->next_expected_packet_number, packet, &pn)).base == NULL) {
+    if (packet->decrypted.payload.base != NULL) {
+        /* decrypted by quicly_decrypt_packet */
+        assert(epoch == QUICLY_EPOCH_1RTT);
+        payload = packet->decrypted.payload;
+        pn = packet->decrypted.pn;
+        if ((*space)->next_expected_packet_number <= pn)
+            (*space)->next_expected_packet_number = pn + 1;
+    } else if ((payload = decrypt_packet(header_protection, aead, &(*space)->next_expected_packet_number, packet, &pn)).base ==
+               NULL) {
         ret = QUICLY_ERROR_PACKET_IGNORED;
         goto Exit;
     }
@@ -3784,6 +4830,9 @@ int quicly_receive(quicly_conn_t *conn, quicly_decoded_packet_t *packet)
     LOG_CONNECTION_EVENT(conn, QUICLY_EVENT_TYPE_CRYPTO_DECRYPT, INT_EVENT_ATTR(PACKET_NUMBER, pn),
                          INT_EVENT_ATTR(LENGTH, payload.len));
 
+    if (epoch == QUICLY_EPOCH_1RTT && (ret = on_key_phase_received(conn, (packet->octets.base[0] & QUICLY_KEY_PHASE_BIT) != 0)) != 0)
+        goto Exit;
+
     if (conn->super.state == QUICLY_STATE_FIRSTFLIGHT)
         conn->super.state = QUICLY_STATE_CONNECTED;
 
@@ -3792,7 +4841,7 @@ int quicly_receive(quicly_conn_t *conn, quicly_decoded_packet_t *packet)
     ++conn->super.num_packets.received;
 
     if (*space != NULL) {
-        if ((ret = record_receipt(conn, *space, pn, is_ack_only, epoch)) != 0)
+        if ((ret = record_receipt(conn, *space, pn, packet->ecn, is_ack_only, epoch)) != 0)
             goto Exit;
     }
 
@@ -3809,14 +4858,16 @@ int quicly_receive(quicly_conn_t *conn, quicly_decoded_packet_t *packet)
             assert(stream != NULL);
             quicly_streambuf_t *buf = stream->data;
             if (buf->egress.buf.off == 0) {
-                if ((ret = quicly_sentmap_prepare(&conn->egress.sentmap, conn->egress.packet_number, now,
-                                                  QUICLY_EPOCH_HANDSHAKE)) != 0)
+                quicly_sentmap_t *sentmap = &conn->egress.spaces[QUICLY_EPOCH_HANDSHAKE].sentmap;
+                quicly_sent_t *sent;
+                if ((ret = quicly_sentmap_prepare(sentmap, conn->egress.packet_number, now, QUICLY_EPOCH_HANDSHAKE)) != 0)
                     goto Exit;
-                if (quicly_sentmap_allocate(&conn->egress.sentmap, discard_handshake_context) == NULL) {
+                if ((sent = quicly_sentmap_allocate(sentmap, QUICLY_SENT_TYPE_CALLBACK)) == NULL) {
                     ret = PTLS_ERROR_NO_MEMORY;
                     goto Exit;
                 }
-                quicly_sentmap_commit(&conn->egress.sentmap, 0);
+                sent->data.callback.acked = discard_handshake_context;
+                quicly_sentmap_commit(sentmap, 0);
                 ++conn->egress.packet_number;
                 conn->crypto.handshake_scheduled_for_discard = 1;
             }
@@ -3824,8 +4875,139 @@ int quicly_receive(quicly_conn_t *conn, quicly_decoded_packet_t *packet)
     }
 
 Exit:
-    if (ret == 0)
+    return ret;
+}
+
+int quicly_receive(quicly_conn_t *conn, quicly_decoded_packet_t *packet)
+{
+    int ret;
+
+    update_now(conn->super.ctx);
+
+    if ((ret = receive_packet(conn, packet)) == 0) {
+        assert_consistency(conn, 0);
+        if (conn->crypto.handshake_pending)
+            ret = QUICLY_ERROR_HANDSHAKE_PENDING;
+    }
+    update_timer(conn);
+    return ret;
+}
+
+int quicly_complete_handshake(quicly_conn_t *conn)
+{
+    quicly_stream_t *stream = quicly_get_stream(conn, -(quicly_stream_id_t)(1 + QUICLY_EPOCH_INITIAL));
+    int ret;
+
+    assert(conn->crypto.handshake_pending);
+    assert(stream != NULL);
+
+    update_now(conn->super.ctx);
+
+    conn->crypto.handshake_pending = 0;
+    if ((ret = handle_crypto_messages(stream)) == 0)
+        assert_consistency(conn, 0);
+    /* the timer wheel is not updated here, as the function might be running on a worker thread; the registration is refreshed by
+     * the call to quicly_send that follows */
+    return ret;
+}
+
+quicly_decryptor_t *quicly_new_decryptor(quicly_conn_t *conn)
+{
+    ptls_cipher_suite_t *cipher = ptls_get_cipher(conn->crypto.tls);
+    quicly_decryptor_t *decryptor;
+    uint64_t generation;
+    uint8_t next_secret[PTLS_MAX_DIGEST_SIZE];
+
+    if (conn->application == NULL || conn->application->cipher.ingress.header_protection.one_rtt == NULL)
+        return NULL;
+    generation = conn->application->cipher.key_update.ingress.generation;
+
+    if ((decryptor = malloc(sizeof(*decryptor))) == NULL)
+        return NULL;
+    *decryptor = (quicly_decryptor_t){NULL};
+    /* setup the keys of the current generation and the next */
+    if (setup_cipher(&decryptor->header_protection, &decryptor->aead[ingress_aead_index(generation)], cipher->aead, cipher->hash, 0,
+                     conn->application->cipher.key_update.ingress.secret) != 0)
+        goto Error;
+    if (derive_next_secret(cipher, next_secret, conn->application->cipher.key_update.ingress.secret) != 0)
+        goto Error;
+    if ((decryptor->aead[ingress_aead_index(generation + 1)] =
+             ptls_aead_new(cipher->aead, cipher->hash, 0, next_secret, AEAD_BASE_LABEL)) == NULL)
+        goto Error;
+    ptls_clear_memory(next_secret, sizeof(next_secret));
+
+    return decryptor;
+Error:
+    ptls_clear_memory(next_secret, sizeof(next_secret));
+    quicly_free_decryptor(decryptor);
+    return NULL;
+}
+
+void quicly_free_decryptor(quicly_decryptor_t *decryptor)
+{
+    size_t i;
+
+    if (decryptor->header_protection != NULL)
+        ptls_cipher_free(decryptor->header_protection);
+    for (i = 0; i != sizeof(decryptor->aead) / sizeof(decryptor->aead[0]); ++i)
+        if (decryptor->aead[i] != NULL)
+            ptls_aead_free(decryptor->aead[i]);
+    free(decryptor);
+}
+
+uint64_t quicly_get_next_expected_packet_number(quicly_conn_t *conn)
+{
+    if (conn->application == NULL)
+        return 0;
+    return conn->application->super.next_expected_packet_number;
+}
+
+int quicly_decrypt_packet(quicly_decryptor_t *decryptor, uint64_t *next_expected_pn, quicly_decoded_packet_t *packet)
+{
+    /* long header packets are left untouched, to be decrypted by quicly_receive */
+    if (QUICLY_PACKET_IS_LONG_HEADER(packet->octets.base[0]))
+        return 0;
+
+    if ((packet->decrypted.payload =
+             decrypt_packet(decryptor->header_protection, decryptor->aead, next_expected_pn, packet, &packet->decrypted.pn))
+            .base == NULL)
+        return QUICLY_ERROR_PACKET_IGNORED;
+
+    return 0;
+}
+
+int quicly_receive_batch(quicly_conn_t *conn, quicly_decoded_packet_t *packets, size_t num_packets)
+{
+    size_t i;
+    int ret = 0;
+
+    update_now(conn->super.ctx);
+
+    conn->ingress.batch.active = 1;
+    conn->ingress.batch.ack_epochs = 0;
+    for (i = 0; i != num_packets; ++i) {
+        if ((ret = receive_packet(conn, packets + i)) != 0) {
+            if (ret != QUICLY_ERROR_PACKET_IGNORED)
+                break;
+            ret = 0;
+        }
+    }
+    conn->ingress.batch.active = 0;
+
+    /* run loss detection once for each packet number space in which ACKs have been received */
+    if (conn->ingress.batch.ack_epochs != 0) {
+        int detect_ret;
+        if ((detect_ret = detect_loss(conn, conn->ingress.batch.ack_epochs)) != 0 && ret == 0)
+            ret = detect_ret;
+        update_loss_alarm(conn);
+    }
+
+    if (ret == 0) {
         assert_consistency(conn, 0);
+        if (conn->crypto.handshake_pending)
+            ret = QUICLY_ERROR_HANDSHAKE_PENDING;
+    }
+    update_timer(conn);
     return ret;
 }
 
@@ -3890,6 +5072,7 @@ void quicly_reset_stream(quicly_stream_t *stream, uint16_t error_code)
     /* schedule for delivery */
     sched_stream_control(stream);
     resched_stream_data(stream);
+    update_timer(stream->conn);
 }
 
 void quicly_request_stop(quicly_stream_t *stream, uint16_t error_code)
@@ -3902,6 +5085,7 @@ void quicly_request_stop(quicly_stream_t *stream, uint16_t error_code)
         stream->_send_aux.stop_sending.sender_state = QUICLY_SENDER_STATE_SEND;
         stream->_send_aux.stop_sending.error_code = error_code;
         sched_stream_control(stream);
+        update_timer(stream->conn);
     }
 }
 
@@ -3934,9 +5118,9 @@ void quicly_default_free_stream(quicly_stream_t *stream)
 
 int64_t quicly_default_now(quicly_context_t *ctx)
 {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    return (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
 static void tohex(char *dst, uint8_t v)
@@ -4078,10 +5262,17 @@ const char *quicly_event_type_names[] = {"connect",
                                          "crypto-decrypt",
                                          "crypto-handshake",
                                          "crypto-update-secret",
+                                         "crypto-key-update",
                                          "cc-tlp",
                                          "cc-rto",
                                          "cc-ack-received",
                                          "cc-congestion",
+                                         "cc-ecn-congestion",
+                                         "cc-careful-resume",
+                                         "ecn-disable",
+                                         "pmtu-probe",
+                                         "pmtu-probe-lost",
+                                         "pmtu-update",
                                          "stream-send",
                                          "stream-receive",
                                          "stream-acked",
@@ -4117,6 +5308,8 @@ const char *quicly_event_attribute_names[] = {NULL,
                                               "state",
                                               "error-code",
                                               "frame-type",
+                                              "ecn-ce",
+                                              "key-generation",
                                               "dcid",
                                               "scid",
                                               "reason-phrase"};
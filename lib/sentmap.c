@@ -24,61 +24,218 @@
 #include "picotls.h"
 #include "quicly/sentmap.h"
 
-const quicly_sent_t quicly_sentmap__end_iter = {quicly_sentmap__type_packet, {{UINT64_MAX, INT64_MAX}}};
+/**
+ * initial number of slots in the packet number index; must be a multiple of 64, the number of bits in each word of the bit vector
+ */
+#define INDEX_INITIAL_CAPACITY 64
+/**
+ * maximum number of blocks retained by the pool of each thread
+ */
+#define MAX_BLOCKS_CACHED 1024
 
-static void next_entry(quicly_sentmap_iter_t *iter)
+#define NUM_WORDS(member) ((sizeof(((quicly_sent_t *)NULL)->data.member) + sizeof(uint64_t) - 1) / sizeof(uint64_t))
+
+const quicly_sent_t quicly_sentmap__end_iter = {.data.packet = {QUICLY_SENT_TYPE_PACKET, 0, 0, 0, 0, UINT64_MAX, INT64_MAX}};
+
+const uint8_t quicly_sentmap__num_words[QUICLY_SENT__NUM_TYPES] = {
+    [QUICLY_SENT_TYPE_DISCARDED] = NUM_WORDS(hdr),
+    [QUICLY_SENT_TYPE_PACKET] = NUM_WORDS(packet),
+    [QUICLY_SENT_TYPE_ACK] = NUM_WORDS(ack),
+    [QUICLY_SENT_TYPE_STREAM] = NUM_WORDS(stream),
+    [QUICLY_SENT_TYPE_MAX_STREAM_DATA] = NUM_WORDS(max_stream_data),
+    [QUICLY_SENT_TYPE_MAX_DATA] = NUM_WORDS(max_data),
+    [QUICLY_SENT_TYPE_MAX_STREAMS] = NUM_WORDS(max_streams),
+    [QUICLY_SENT_TYPE_STREAMS_BLOCKED] = NUM_WORDS(streams_blocked),
+    [QUICLY_SENT_TYPE_RST_STREAM] = NUM_WORDS(stream_state_sender),
+    [QUICLY_SENT_TYPE_STOP_SENDING] = NUM_WORDS(stream_state_sender),
+    [QUICLY_SENT_TYPE_PMTU_PROBE] = NUM_WORDS(pmtu_probe),
+    [QUICLY_SENT_TYPE_CALLBACK] = NUM_WORDS(callback)};
+
+/**
+ * per-thread pool of the blocks, linked using st_quicly_sent_block_t::next
+ */
+static __thread struct {
+    struct st_quicly_sent_block_t *head;
+    quicly_sentmap_pool_stats_t stats;
+} pool;
+
+static struct st_quicly_sent_block_t *alloc_block(void)
 {
-    if (--iter->count != 0) {
-        ++iter->p;
-    } else if (*(iter->ref = &(*iter->ref)->next) == NULL) {
-        iter->p = (quicly_sent_t *)&quicly_sentmap__end_iter;
-        iter->count = 0;
+    struct st_quicly_sent_block_t *block;
+
+    if ((block = pool.head) != NULL) {
+        pool.head = block->next;
+        --pool.stats.num_cached;
+        ++pool.stats.num_hits;
+    } else if ((block = malloc(sizeof(*block))) == NULL) {
+        return NULL;
+    }
+    ++pool.stats.num_allocs;
+    if (++pool.stats.num_in_use > pool.stats.peak_in_use)
+        pool.stats.peak_in_use = pool.stats.num_in_use;
+
+    return block;
+}
+
+static void release_block(struct st_quicly_sent_block_t *block)
+{
+    --pool.stats.num_in_use;
+
+    if (pool.stats.num_cached >= MAX_BLOCKS_CACHED) {
+        free(block);
         return;
+    }
+    block->next = pool.head;
+    pool.head = block;
+    ++pool.stats.num_cached;
+}
+
+void quicly_sentmap_pool_clear(void)
+{
+    struct st_quicly_sent_block_t *block;
+
+    while ((block = pool.head) != NULL) {
+        pool.head = block->next;
+        free(block);
+    }
+    pool.stats.num_cached = 0;
+}
+
+void quicly_sentmap_pool_get_stats(quicly_sentmap_pool_stats_t *stats)
+{
+    *stats = pool.stats;
+}
+
+/**
+ * returns the smallest packet number being tracked that is no less than `packet_number`, or `index.end` if there is none
+ */
+static uint64_t find_indexed_packet(quicly_sentmap_t *map, uint64_t packet_number)
+{
+    if (packet_number < map->index.start)
+        packet_number = map->index.start;
+
+    /* scan the bit vector; as it is a ring buffer, the bits found at or beyond `end` belong to the packets that wrapped around from
+     * the head of the ring */
+    while (packet_number < map->index.end) {
+        size_t off = packet_number & (map->index.capacity - 1);
+        uint64_t bits = map->index.occupied[off / 64] >> (off % 64);
+        if (bits != 0) {
+            packet_number += __builtin_ctzll(bits);
+            return packet_number < map->index.end ? packet_number : map->index.end;
+        }
+        packet_number += 64 - off % 64;
+    }
+
+    return map->index.end;
+}
+
+static int reserve_index(quicly_sentmap_t *map, uint64_t packet_number)
+{
+    struct st_quicly_sentmap_slot_t *slots;
+    uint64_t *occupied, pn;
+    size_t capacity;
+
+    if (map->index.start == map->index.end)
+        map->index.start = map->index.end = packet_number;
+    assert(map->index.end <= packet_number);
+
+    if (packet_number - map->index.start < map->index.capacity)
+        return 0;
+
+    /* expand, relocating the slots being used */
+    capacity = map->index.capacity != 0 ? map->index.capacity : INDEX_INITIAL_CAPACITY;
+    while (packet_number - map->index.start >= capacity)
+        capacity *= 2;
+    if ((slots = malloc(sizeof(*slots) * capacity)) == NULL)
+        return PTLS_ERROR_NO_MEMORY;
+    if ((occupied = calloc(capacity / 64, sizeof(*occupied))) == NULL) {
+        free(slots);
+        return PTLS_ERROR_NO_MEMORY;
+    }
+    for (pn = map->index.start; pn != map->index.end; ++pn) {
+        size_t from = pn & (map->index.capacity - 1), to = pn & (capacity - 1);
+        if ((map->index.occupied[from / 64] & ((uint64_t)1 << (from % 64))) != 0) {
+            slots[to] = map->index.slots[from];
+            occupied[to / 64] |= (uint64_t)1 << (to % 64);
+        }
+    }
+    free(map->index.slots);
+    free(map->index.occupied);
+    map->index.slots = slots;
+    map->index.occupied = occupied;
+    map->index.capacity = capacity;
+
+    return 0;
+}
+
+static void unindex_packet(quicly_sentmap_t *map, uint64_t packet_number)
+{
+    size_t off = packet_number & (map->index.capacity - 1);
+
+    assert(map->index.start <= packet_number && packet_number < map->index.end);
+    assert((map->index.occupied[off / 64] & ((uint64_t)1 << (off % 64))) != 0);
+
+    map->index.occupied[off / 64] &= ~((uint64_t)1 << (off % 64));
+    if (packet_number == map->index.start)
+        map->index.start = find_indexed_packet(map, packet_number + 1);
+}
+
+static void next_entry(quicly_sentmap_iter_t *iter)
+{
+    if (iter->count > 1) {
+        --iter->count;
+        iter->p = quicly_sentmap__next_record(iter->p);
     } else {
+        if (iter->count != 0)
+            iter->ref = &(*iter->ref)->next;
+        if (*iter->ref == NULL) {
+            iter->p = (quicly_sent_t *)&quicly_sentmap__end_iter;
+            iter->count = 0;
+            return;
+        }
         assert((*iter->ref)->num_entries != 0);
         iter->count = (*iter->ref)->num_entries;
-        iter->p = (*iter->ref)->entries;
+        iter->p = (quicly_sent_t *)(*iter->ref)->words;
     }
-    while (iter->p->acked == NULL)
-        ++iter->p;
+    while (iter->p->data.hdr._type == QUICLY_SENT_TYPE_DISCARDED)
+        iter->p = quicly_sentmap__next_record(iter->p);
 }
 
+/**
+ * frees the block being referred to by `ref`, returning the reference to the block that follows
+ */
 static struct st_quicly_sent_block_t **free_block(quicly_sentmap_t *map, struct st_quicly_sent_block_t **ref)
 {
-    static const struct st_quicly_sent_block_t dummy = {NULL};
-    static const struct st_quicly_sent_block_t *const dummy_ref = &dummy;
     struct st_quicly_sent_block_t *block = *ref;
 
     if (block->next != NULL) {
         *ref = block->next;
+        block->next->prev = block->prev;
         assert((*ref)->num_entries != 0);
     } else {
         assert(block == map->tail);
-        if (ref == &map->head) {
-            map->head = NULL;
-            map->tail = NULL;
-        } else {
-            map->tail = (void *)((char *)ref - offsetof(struct st_quicly_sent_block_t, next));
+        if ((map->tail = block->prev) != NULL) {
             map->tail->next = NULL;
+            ref = &map->tail->next;
+        } else {
+            map->head = NULL;
+            ref = &map->head;
         }
-        ref = (struct st_quicly_sent_block_t **)&dummy_ref;
     }
 
-    free(block);
+    release_block(block);
     return ref;
 }
 
 static void discard_entry(quicly_sentmap_t *map, quicly_sentmap_iter_t *iter)
 {
-    assert(iter->p->acked != NULL);
-    iter->p->acked = NULL;
+    assert(iter->p->data.hdr._type != QUICLY_SENT_TYPE_DISCARDED);
+    iter->p->data.hdr._type = QUICLY_SENT_TYPE_DISCARDED;
 
     struct st_quicly_sent_block_t *block = *iter->ref;
     if (--block->num_entries == 0) {
         iter->ref = free_block(map, iter->ref);
-        block = *iter->ref;
-        iter->p = block->entries - 1;
-        iter->count = block->num_entries + 1;
+        iter->count = 0;
     }
 }
 
@@ -88,17 +245,38 @@ void quicly_sentmap_dispose(quicly_sentmap_t *map)
 
     while ((block = map->head) != NULL) {
         map->head = block->next;
-        free(block);
+        release_block(block);
     }
+    free(map->index.slots);
+    free(map->index.occupied);
 }
 
 int quicly_sentmap_prepare(quicly_sentmap_t *map, uint64_t packet_number, int64_t now, uint8_t ack_epoch)
 {
+    struct st_quicly_sentmap_slot_t *slot;
+    size_t off;
+    int ret;
+
     assert(map->_pending_packet == NULL);
 
-    if ((map->_pending_packet = quicly_sentmap_allocate(map, quicly_sentmap__type_packet)) == NULL)
+    if ((ret = reserve_index(map, packet_number)) != 0)
+        return ret;
+    if ((map->_pending_packet = quicly_sentmap_allocate(map, QUICLY_SENT_TYPE_PACKET)) == NULL)
         return PTLS_ERROR_NO_MEMORY;
-    map->_pending_packet->data.packet = (quicly_sent_packet_t){packet_number, now, ack_epoch};
+    map->_pending_packet->data.packet.ack_epoch = ack_epoch;
+    map->_pending_packet->data.packet.bytes_in_flight = 0;
+    map->_pending_packet->data.packet.seq = map->next_seq++;
+    map->_pending_packet->data.packet.packet_number = packet_number;
+    map->_pending_packet->data.packet.sent_at = now;
+
+    /* register to the index */
+    off = packet_number & (map->index.capacity - 1);
+    slot = map->index.slots + off;
+    slot->packet = map->_pending_packet;
+    slot->block = map->tail;
+    map->index.occupied[off / 64] |= (uint64_t)1 << (off % 64);
+    map->index.end = packet_number + 1;
+
     return 0;
 }
 
@@ -106,10 +284,11 @@ struct st_quicly_sent_block_t *quicly_sentmap__new_block(quicly_sentmap_t *map)
 {
     struct st_quicly_sent_block_t *block;
 
-    if ((block = malloc(sizeof(*block))) == NULL)
+    if ((block = alloc_block()) == NULL)
         return NULL;
 
     block->next = NULL;
+    block->prev = map->tail;
     block->num_entries = 0;
     block->next_insert_at = 0;
     if (map->tail != NULL) {
@@ -122,11 +301,50 @@ struct st_quicly_sent_block_t *quicly_sentmap__new_block(quicly_sentmap_t *map)
     return block;
 }
 
+void quicly_sentmap_find(quicly_sentmap_t *map, quicly_sentmap_iter_t *iter, uint64_t packet_number)
+{
+    struct st_quicly_sentmap_slot_t *slot;
+    quicly_sent_t *p, *end;
+
+    if ((packet_number = find_indexed_packet(map, packet_number)) == map->index.end) {
+        iter->p = (quicly_sent_t *)&quicly_sentmap__end_iter;
+        iter->count = 0;
+        iter->ref = map->tail != NULL ? &map->tail->next : &map->head;
+        return;
+    }
+
+    slot = map->index.slots + (packet_number & (map->index.capacity - 1));
+    assert(slot->packet->data.packet.packet_number == packet_number);
+    iter->p = slot->packet;
+    iter->ref = slot->block->prev != NULL ? &slot->block->prev->next : &map->head;
+    /* the number of entries in the block, starting from the one being pointed to */
+    iter->count = 0;
+    for (p = slot->packet, end = (quicly_sent_t *)(slot->block->words + slot->block->next_insert_at); p != end;
+         p = quicly_sentmap__next_record(p))
+        if (p->data.hdr._type != QUICLY_SENT_TYPE_DISCARDED)
+            ++iter->count;
+}
+
 void quicly_sentmap_skip(quicly_sentmap_iter_t *iter)
 {
     do {
         next_entry(iter);
-    } while (iter->p->acked != quicly_sentmap__type_packet);
+    } while (iter->p->data.hdr._type != QUICLY_SENT_TYPE_PACKET);
+}
+
+static int invoke_callback(quicly_sentmap_t *map, struct st_quicly_conn_t *conn, const quicly_sent_packet_t *packet,
+                           quicly_sent_t *sent, quicly_sentmap_event_t event)
+{
+    quicly_sent_acked_cb cb;
+
+    if (sent->data.hdr._type == QUICLY_SENT_TYPE_CALLBACK) {
+        cb = sent->data.callback.acked;
+    } else {
+        assert(map->callbacks != NULL);
+        cb = map->callbacks[sent->data.hdr._type];
+    }
+
+    return cb(conn, packet, sent, event);
 }
 
 int quicly_sentmap_update(quicly_sentmap_t *map, quicly_sentmap_iter_t *iter, quicly_sentmap_event_t event,
@@ -136,7 +354,7 @@ int quicly_sentmap_update(quicly_sentmap_t *map, quicly_sentmap_iter_t *iter, qu
     int notify_lost = 0, ret = 0;
 
     assert(iter->p != &quicly_sentmap__end_iter);
-    assert(iter->p->acked == quicly_sentmap__type_packet);
+    assert(iter->p->data.hdr._type == QUICLY_SENT_TYPE_PACKET);
 
     /* copy packet info */
     packet = iter->p->data.packet;
@@ -150,25 +368,20 @@ int quicly_sentmap_update(quicly_sentmap_t *map, quicly_sentmap_iter_t *iter, qu
     }
     iter->p->data.packet.bytes_in_flight = 0;
 
-    if (event != QUICLY_SENTMAP_EVENT_LOST)
+    if (event != QUICLY_SENTMAP_EVENT_LOST) {
+        unindex_packet(map, packet.packet_number);
         discard_entry(map, iter);
+    }
 
     /* iterate through the frames */
-    for (next_entry(iter); iter->p->acked != quicly_sentmap__type_packet; next_entry(iter)) {
+    for (next_entry(iter); iter->p->data.hdr._type != QUICLY_SENT_TYPE_PACKET; next_entry(iter)) {
         if (notify_lost && ret == 0)
-            ret = iter->p->acked(conn, &packet, iter->p, QUICLY_SENTMAP_EVENT_LOST);
+            ret = invoke_callback(map, conn, &packet, iter->p, QUICLY_SENTMAP_EVENT_LOST);
         if (ret == 0)
-            ret = iter->p->acked(conn, &packet, iter->p, event);
+            ret = invoke_callback(map, conn, &packet, iter->p, event);
         if (event != QUICLY_SENTMAP_EVENT_LOST)
             discard_entry(map, iter);
     }
 
     return ret;
 }
-
-int quicly_sentmap__type_packet(struct st_quicly_conn_t *conn, const quicly_sent_packet_t *packet, quicly_sent_t *sent,
-                                quicly_sentmap_event_t event)
-{
-    assert(!"quicly_sentmap__type_packet cannot be called");
-    return QUICLY_ERROR_INTERNAL;
-}
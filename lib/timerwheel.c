@@ -0,0 +1,201 @@
+/*
+ * Copyright (c) 2019 Fastly, Kazuho Oku
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include "quicly/timerwheel.h"
+
+#define SLOT_MASK (QUICLY_TIMERWHEEL_SLOTS_PER_WHEEL - 1)
+
+struct st_quicly_timerwheel_t {
+    /**
+     * the time up to which the wheel has been processed; each timer is placed in the wheel covering the highest group of bits in
+     * which its expiration time differs from this value
+     */
+    int64_t last_run;
+    /**
+     * number of timers being registered
+     */
+    size_t num_timers;
+    /**
+     * bit vector per each wheel indicating the slots that might be non-empty; bits are set when timers are added, and cleared
+     * lazily when the slots are found to be empty
+     */
+    uint64_t occupied[QUICLY_TIMERWHEEL_NUM_WHEELS];
+    /**
+     * the slots, with the first wheel having the finest granularity
+     */
+    quicly_linklist_t slots[QUICLY_TIMERWHEEL_NUM_WHEELS][QUICLY_TIMERWHEEL_SLOTS_PER_WHEEL];
+};
+
+static size_t get_slot(int64_t at, size_t wheel)
+{
+    return (size_t)((uint64_t)at >> (wheel * QUICLY_TIMERWHEEL_BITS_PER_WHEEL)) & SLOT_MASK;
+}
+
+/**
+ * returns the index of the wheel covering the highest group of bits in which the two values differ, or zero if they are equal
+ */
+static size_t get_wheel(int64_t x, int64_t y)
+{
+    uint64_t diff = (uint64_t)x ^ (uint64_t)y;
+    size_t wheel = 0;
+
+    while ((diff >>= QUICLY_TIMERWHEEL_BITS_PER_WHEEL) != 0)
+        ++wheel;
+    return wheel;
+}
+
+static void link_timer(quicly_timerwheel_t *wheel, quicly_timerwheel_timer_t *timer)
+{
+    /* timers that have already expired are placed in the slot being processed next */
+    int64_t at = timer->at < wheel->last_run ? wheel->last_run : timer->at;
+    size_t index = get_wheel(wheel->last_run, at), slot;
+
+    assert(index < QUICLY_TIMERWHEEL_NUM_WHEELS);
+    slot = get_slot(at, index);
+    quicly_linklist_insert(wheel->slots[index][slot].prev, &timer->_link);
+    wheel->occupied[index] |= (uint64_t)1 << slot;
+}
+
+quicly_timerwheel_t *quicly_timerwheel_create(int64_t now)
+{
+    quicly_timerwheel_t *wheel;
+    size_t i, j;
+
+    if ((wheel = malloc(sizeof(*wheel))) == NULL)
+        return NULL;
+    wheel->last_run = now;
+    wheel->num_timers = 0;
+    for (i = 0; i != QUICLY_TIMERWHEEL_NUM_WHEELS; ++i)
+        wheel->occupied[i] = 0;
+    for (i = 0; i != QUICLY_TIMERWHEEL_NUM_WHEELS; ++i)
+        for (j = 0; j != QUICLY_TIMERWHEEL_SLOTS_PER_WHEEL; ++j)
+            quicly_linklist_init(&wheel->slots[i][j]);
+
+    return wheel;
+}
+
+void quicly_timerwheel_destroy(quicly_timerwheel_t *wheel)
+{
+    free(wheel);
+}
+
+void quicly_timerwheel_set(quicly_timerwheel_t *wheel, quicly_timerwheel_timer_t *timer, int64_t at)
+{
+    if (quicly_timerwheel_timer_is_active(timer)) {
+        if (timer->at == at)
+            return;
+        quicly_timerwheel_unset(wheel, timer);
+    }
+    if (at == INT64_MAX)
+        return;
+
+    timer->at = at;
+    link_timer(wheel, timer);
+    ++wheel->num_timers;
+}
+
+void quicly_timerwheel_unset(quicly_timerwheel_t *wheel, quicly_timerwheel_timer_t *timer)
+{
+    if (!quicly_timerwheel_timer_is_active(timer))
+        return;
+    quicly_linklist_unlink(&timer->_link);
+    timer->at = INT64_MAX;
+    --wheel->num_timers;
+}
+
+int64_t quicly_timerwheel_get_first_timeout(quicly_timerwheel_t *wheel)
+{
+    size_t index, slot, shift;
+
+    if (wheel->num_timers == 0)
+        return INT64_MAX;
+
+    /* The timers of a lower wheel expire earlier than those of the higher wheels, and the timers of a slot expire earlier than
+     * those of the succeeding slots. Therefore, the start time of the first non-empty slot is returned without scanning the timers
+     * of the slot. The value is exact for the first wheel, and is a lower bound for the higher wheels; the timers of such slots are
+     * moved to the lower wheels when quicly_timerwheel_get_expired is called at that time. */
+    for (index = 0; index != QUICLY_TIMERWHEEL_NUM_WHEELS; ++index) {
+        uint64_t bits;
+        while ((bits = wheel->occupied[index] & (UINT64_MAX << get_slot(wheel->last_run, index))) != 0) {
+            slot = __builtin_ctzll(bits);
+            if (quicly_linklist_is_linked(&wheel->slots[index][slot]))
+                goto Found;
+            wheel->occupied[index] &= ~((uint64_t)1 << slot);
+        }
+    }
+
+    assert(!"unreachable");
+    return INT64_MAX;
+
+Found:
+    /* timers found in the slot of last_run have already expired */
+    if (slot == get_slot(wheel->last_run, index))
+        return wheel->last_run;
+    shift = index * QUICLY_TIMERWHEEL_BITS_PER_WHEEL;
+    return (int64_t)(((uint64_t)wheel->last_run & ~(((uint64_t)1 << shift << QUICLY_TIMERWHEEL_BITS_PER_WHEEL) - 1)) |
+                     ((uint64_t)slot << shift));
+}
+
+size_t quicly_timerwheel_get_expired(quicly_timerwheel_t *wheel, int64_t now, quicly_timerwheel_timer_t **timers,
+                                     size_t max_timers)
+{
+    quicly_linklist_t pending;
+    size_t top, index, num_expired = 0;
+
+    if (now < wheel->last_run)
+        now = wheel->last_run;
+    quicly_linklist_init(&pending);
+
+    /* Collect the timers from the slots that have been passed. In the wheels below the highest one in which `now` differs from
+     * last_run, all the slots have been passed. */
+    top = get_wheel(wheel->last_run, now);
+    for (index = 0; index <= top; ++index) {
+        uint64_t bits = wheel->occupied[index] & (UINT64_MAX << get_slot(wheel->last_run, index));
+        if (index == top)
+            bits &= UINT64_MAX >> (SLOT_MASK - get_slot(now, index));
+        wheel->occupied[index] &= ~bits;
+        for (; bits != 0; bits &= bits - 1)
+            quicly_linklist_insert_list(&pending, &wheel->slots[index][__builtin_ctzll(bits)]);
+    }
+    wheel->last_run = now;
+
+    /* return the expired timers, and place the rest in the lower wheels */
+    while (quicly_linklist_is_linked(&pending)) {
+        quicly_timerwheel_timer_t *timer = (void *)((char *)pending.next - offsetof(quicly_timerwheel_timer_t, _link));
+        quicly_linklist_unlink(&timer->_link);
+        if (timer->at <= now && num_expired < max_timers) {
+            timers[num_expired++] = timer;
+            --wheel->num_timers;
+        } else {
+            link_timer(wheel, timer);
+        }
+    }
+
+    return num_expired;
+}
+
+size_t quicly_timerwheel_size(quicly_timerwheel_t *wheel)
+{
+    return wheel->num_timers;
+}
@@ -20,16 +20,29 @@
  * IN THE SOFTWARE.
  */
 #include <getopt.h>
+#include <limits.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <stddef.h>
 #include <stdio.h>
+#ifdef __linux__
+#include <linux/net_tstamp.h>
+#include <sys/epoll.h>
+#endif
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 #include "quicly.h"
+#include "quicly/connmap.h"
+#include "quicly/packetpool.h"
+#include "quicly/sentmap.h"
 #include "quicly/streambuf.h"
+#include "quicly/timerwheel.h"
 #include "../deps/picotls/t/util.h"
 
 static unsigned verbosity = 0;
@@ -55,6 +68,8 @@ static int save_ticket_cb(ptls_save_ticket_t *_self, ptls_t *tls, ptls_iovec_t s
 static const char *ticket_file = NULL;
 static ptls_handshake_properties_t hs_properties;
 static quicly_transport_parameters_t resumed_transport_params;
+static quicly_path_state_t resumed_path_state;
+static ptls_iovec_t session_ticket;
 static quicly_context_t ctx;
 static ptls_save_ticket_t save_ticket = {save_ticket_cb};
 static ptls_iovec_t retry_token;
@@ -72,6 +87,8 @@ static int on_stop_sending(quicly_stream_t *stream, uint16_t error_code);
 static int on_receive_reset(quicly_stream_t *stream, uint16_t error_code);
 static int server_on_receive(quicly_stream_t *stream, size_t off, const void *src, size_t len);
 static int client_on_receive(quicly_stream_t *stream, size_t off, const void *src, size_t len);
+static void dump_io_stats(void);
+static void save_session(quicly_conn_t *conn);
 
 static const quicly_stream_callbacks_t server_stream_callbacks = {quicly_streambuf_destroy,
                                                                   quicly_streambuf_egress_shift,
@@ -239,6 +256,7 @@ static int client_on_receive(quicly_stream_t *stream, size_t off, const void *sr
                     "packets: received: %" PRIu64 ", sent: %" PRIu64 ", lost: %" PRIu64 ", ack-received: %" PRIu64
                     ", bytes-sent: %" PRIu64 "\n",
                     num_received, num_sent, num_lost, num_ack_received, num_bytes_sent);
+            dump_io_stats();
             uint16_t error_code = QUICLY_ERROR_NONE;
             quicly_close(stream->conn, &error_code, "");
         }
@@ -263,6 +281,80 @@ static void on_conn_close(quicly_conn_t *conn, uint16_t code, const uint64_t *fr
             reason);
 }
 
+/**
+ * datagrams that are queued to be sent by the next call to flush_sendq
+ */
+static struct {
+    quicly_datagram_t **packets;
+    size_t count;
+    size_t capacity;
+#ifdef __linux__
+    struct mmsghdr *msgs;
+    struct iovec *vecs;
+    union st_sendq_cmsgbuf_t {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(uint16_t)) /* UDP_SEGMENT */ + CMSG_SPACE(sizeof(uint64_t)) /* SCM_TXTIME */ +
+                 CMSG_SPACE(sizeof(int)) /* IP_TOS */];
+    } * cmsgbufs;
+#endif
+    struct {
+        uint64_t datagrams;
+        uint64_t syscalls;
+    } stats;
+} sendq;
+
+static void init_sendq(size_t capacity)
+{
+    sendq.capacity = capacity;
+    sendq.packets = malloc(sizeof(*sendq.packets) * capacity);
+    assert(sendq.packets != NULL);
+#ifdef __linux__
+    sendq.msgs = malloc(sizeof(*sendq.msgs) * capacity);
+    sendq.vecs = malloc(sizeof(*sendq.vecs) * capacity);
+    sendq.cmsgbufs = malloc(sizeof(*sendq.cmsgbufs) * capacity);
+    assert(sendq.msgs != NULL && sendq.vecs != NULL && sendq.cmsgbufs != NULL);
+#endif
+}
+
+/**
+ * lets the kernel pace the datagrams using the departure time attached to each of them (quicly_datagram_t::txtime); falls back to
+ * pacing in userspace if SO_TXTIME is unavailable
+ */
+static void enable_txtime(int fd)
+{
+    if (!ctx.pace_by_txtime)
+        return;
+#ifdef SO_TXTIME
+    struct sock_txtime txtime = {CLOCK_MONOTONIC, 0};
+    if (setsockopt(fd, SOL_SOCKET, SO_TXTIME, &txtime, sizeof(txtime)) == 0)
+        return;
+    perror("setsockopt(SO_TXTIME) failed; pacing in userspace");
+#endif
+    ctx.pace_by_txtime = 0;
+}
+
+/**
+ * sets the DF bit without letting the kernel cap the datagram size by the PMTU it has learned, so that the probes of PMTU discovery
+ * are either delivered as-is or dropped
+ */
+static void enable_pmtud(int fd, int family)
+{
+    if (ctx.max_probed_packet_size <= ctx.max_packet_size)
+        return;
+#ifdef IP_PMTUDISC_PROBE
+    int val = IP_PMTUDISC_PROBE;
+    if (family == AF_INET6) {
+        if (setsockopt(fd, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &val, sizeof(val)) == 0)
+            return;
+    } else {
+        if (setsockopt(fd, IPPROTO_IP, IP_MTU_DISCOVER, &val, sizeof(val)) == 0)
+            return;
+    }
+    perror("setsockopt(IP_MTU_DISCOVER) failed");
+#endif
+}
+
+#ifndef __linux__
 static int send_one(int fd, quicly_datagram_t *p)
 {
     int ret;
@@ -275,32 +367,324 @@ static int send_one(int fd, quicly_datagram_t *p)
     vec.iov_len = p->data.len;
     mess.msg_iov = &vec;
     mess.msg_iovlen = 1;
-    if (verbosity >= 2)
-        hexdump("sendmsg", vec.iov_base, vec.iov_len);
     while ((ret = (int)sendmsg(fd, &mess, 0)) == -1 && errno == EINTR)
         ;
     return ret;
 }
+#endif
+
+static void flush_sendq(int fd)
+{
+    size_t i;
+
+    if (sendq.count == 0)
+        return;
+
+    if (verbosity >= 2) {
+        for (i = 0; i != sendq.count; ++i)
+            hexdump("sendmsg", sendq.packets[i]->data.base, sendq.packets[i]->data.len);
+    }
+
+#ifdef __linux__
+    int64_t txtime_base_usec = 0, txtime_base_nsec = 0;
+    if (ctx.pace_by_txtime) {
+        /* txtime is on the clock of ctx.now, whereas the kernel uses CLOCK_MONOTONIC in nanoseconds */
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        txtime_base_usec = ctx.now(&ctx);
+        txtime_base_nsec = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+    memset(sendq.msgs, 0, sizeof(*sendq.msgs) * sendq.count);
+    for (i = 0; i != sendq.count; ++i) {
+        quicly_datagram_t *p = sendq.packets[i];
+        struct cmsghdr *cmsg = &sendq.cmsgbufs[i].hdr;
+        size_t controllen = 0;
+        sendq.vecs[i].iov_base = p->data.base;
+        sendq.vecs[i].iov_len = p->data.len;
+        sendq.msgs[i].msg_hdr.msg_name = &p->sa;
+        sendq.msgs[i].msg_hdr.msg_namelen = p->salen;
+        sendq.msgs[i].msg_hdr.msg_iov = sendq.vecs + i;
+        sendq.msgs[i].msg_hdr.msg_iovlen = 1;
+#ifdef UDP_SEGMENT
+        if (p->segment_size != 0 && p->data.len > p->segment_size) {
+            /* let the kernel split the payload into multiple UDP datagrams */
+            uint16_t segment_size = (uint16_t)p->segment_size;
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(segment_size));
+            memcpy(CMSG_DATA(cmsg), &segment_size, sizeof(segment_size));
+            controllen += CMSG_SPACE(sizeof(segment_size));
+            cmsg = (struct cmsghdr *)(sendq.cmsgbufs[i].buf + controllen);
+        }
+#endif
+#ifdef SCM_TXTIME
+        if (p->txtime != 0) {
+            /* let the kernel (i.e. fq qdisc) hold the datagram until the departure time */
+            uint64_t txtime = (uint64_t)(txtime_base_nsec + (p->txtime - txtime_base_usec) * 1000);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_TXTIME;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(txtime));
+            memcpy(CMSG_DATA(cmsg), &txtime, sizeof(txtime));
+            controllen += CMSG_SPACE(sizeof(txtime));
+            cmsg = (struct cmsghdr *)(sendq.cmsgbufs[i].buf + controllen);
+        }
+#endif
+        if (p->ecn != QUICLY_ECN_NOT_ECT) {
+            int tos = p->ecn;
+            if (p->sa.sa_family == AF_INET6) {
+                cmsg->cmsg_level = IPPROTO_IPV6;
+                cmsg->cmsg_type = IPV6_TCLASS;
+            } else {
+                cmsg->cmsg_level = IPPROTO_IP;
+                cmsg->cmsg_type = IP_TOS;
+            }
+            cmsg->cmsg_len = CMSG_LEN(sizeof(tos));
+            memcpy(CMSG_DATA(cmsg), &tos, sizeof(tos));
+            controllen += CMSG_SPACE(sizeof(tos));
+        }
+        if (controllen != 0) {
+            sendq.msgs[i].msg_hdr.msg_control = sendq.cmsgbufs[i].buf;
+            sendq.msgs[i].msg_hdr.msg_controllen = controllen;
+        }
+    }
+    for (i = 0; i != sendq.count;) {
+        int ret;
+        while ((ret = sendmmsg(fd, sendq.msgs + i, (unsigned)(sendq.count - i), 0)) == -1 && errno == EINTR)
+            ;
+        ++sendq.stats.syscalls;
+        if (ret == -1) {
+            /* the first datagram of the batch was rejected; skip it and retry the rest */
+            perror("sendmmsg failed");
+            ret = 1;
+        }
+        i += ret;
+    }
+#else
+    for (i = 0; i != sendq.count; ++i) {
+        if (send_one(fd, sendq.packets[i]) == -1)
+            perror("sendmsg failed");
+        ++sendq.stats.syscalls;
+    }
+#endif
+    for (i = 0; i != sendq.count; ++i) {
+        quicly_datagram_t *p = sendq.packets[i];
+        sendq.stats.datagrams += p->segment_size != 0 ? (p->data.len + p->segment_size - 1) / p->segment_size : 1;
+        ctx.free_packet(&ctx, p);
+    }
+    sendq.count = 0;
+}
+
+static void enqueue_one(int fd, quicly_datagram_t *p)
+{
+    if (sendq.count == sendq.capacity)
+        flush_sendq(fd);
+    sendq.packets[sendq.count++] = p;
+}
 
+/**
+ * queues the packets built by quicly_send; they are actually sent when the queue becomes full or when flush_sendq is called
+ */
 static int send_pending(int fd, quicly_conn_t *conn)
 {
-    quicly_datagram_t *packets[16];
-    size_t num_packets, i;
+    size_t num_packets;
     int ret;
 
     do {
-        num_packets = sizeof(packets) / sizeof(packets[0]);
-        if ((ret = quicly_send(conn, packets, &num_packets)) == 0) {
-            for (i = 0; i != num_packets; ++i) {
-                if ((ret = send_one(fd, packets[i])) == -1)
-                    perror("sendmsg failed");
-                ret = 0;
-                quicly_default_free_packet(&ctx, packets[i]);
+        if (sendq.count == sendq.capacity)
+            flush_sendq(fd);
+        num_packets = sendq.capacity - sendq.count;
+        if ((ret = quicly_send(conn, sendq.packets + sendq.count, &num_packets)) == 0)
+            sendq.count += num_packets;
+    } while (ret == 0 && sendq.count == sendq.capacity);
+
+    return ret;
+}
+
+#define RECV_BATCH_SIZE 32
+#define RECV_BUF_SIZE 65536 /* large enough to hold a datagram coalesced by UDP GRO */
+#define RECV_MAX_SLICES (RECV_BATCH_SIZE * 64)
+#define RECV_MAX_PACKETS (RECV_BATCH_SIZE * 4)
+
+/**
+ * buffers used for reading datagrams in batch
+ */
+static struct {
+    uint8_t bufs[RECV_BATCH_SIZE][RECV_BUF_SIZE];
+    struct sockaddr sa[RECV_BATCH_SIZE];
+    socklen_t salen[RECV_BATCH_SIZE];
+    uint8_t ecn[RECV_BATCH_SIZE];
+#ifdef __linux__
+    struct mmsghdr msgs[RECV_BATCH_SIZE];
+    struct iovec vecs[RECV_BATCH_SIZE];
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int)) /* UDP_GRO */ + CMSG_SPACE(sizeof(int)) /* IP_TOS or IPV6_TCLASS */];
+    } cmsgbufs[RECV_BATCH_SIZE];
+#endif
+    /**
+     * the UDP datagrams being received; a buffer filled by UDP GRO is split into multiple slices
+     */
+    struct st_recv_slice_t {
+        uint8_t *base;
+        size_t len;
+        struct sockaddr *sa;
+        socklen_t salen;
+        uint8_t ecn;
+    } slices[RECV_MAX_SLICES];
+    struct {
+        uint64_t datagrams;
+        /**
+         * number of system calls that returned datagrams; the calls that found the socket empty are not counted
+         */
+        uint64_t syscalls;
+    } stats;
+} recvq;
+
+/**
+ * lets the kernel report the ECN codepoint of the datagrams being received
+ */
+static void enable_recvtos(int fd, int family)
+{
+#ifdef __linux__
+    int on = 1;
+    if (family == AF_INET6) {
+        if (setsockopt(fd, IPPROTO_IPV6, IPV6_RECVTCLASS, &on, sizeof(on)) != 0 && verbosity >= 1)
+            perror("setsockopt(IPV6_RECVTCLASS) failed");
+    } else {
+        if (setsockopt(fd, IPPROTO_IP, IP_RECVTOS, &on, sizeof(on)) != 0 && verbosity >= 1)
+            perror("setsockopt(IP_RECVTOS) failed");
+    }
+#endif
+}
+
+static void enable_gro(int fd)
+{
+#ifdef UDP_GRO
+    int on = 1;
+    if (setsockopt(fd, SOL_UDP, UDP_GRO, &on, sizeof(on)) != 0 && verbosity >= 1)
+        perror("setsockopt(UDP_GRO) failed");
+#endif
+}
+
+static size_t add_recv_slices(size_t num_slices, size_t index, size_t len, size_t segment_size)
+{
+    size_t off = 0;
+
+    if (segment_size == 0)
+        segment_size = len;
+    do {
+        struct st_recv_slice_t *slice = recvq.slices + num_slices++;
+        slice->base = recvq.bufs[index] + off;
+        slice->len = len - off < segment_size ? len - off : segment_size;
+        slice->sa = recvq.sa + index;
+        slice->salen = recvq.salen[index];
+        slice->ecn = recvq.ecn[index];
+        off += slice->len;
+    } while (off != len);
+
+    return num_slices;
+}
+
+/**
+ * reads the datagrams that are available on the socket (up to RECV_BATCH_SIZE system-level buffers) without blocking, and returns
+ * the number of UDP datagrams being stored in recvq.slices
+ */
+static size_t receive_datagrams(int fd)
+{
+    size_t num_slices = 0, i;
+
+#ifdef __linux__
+    int ret;
+    memset(recvq.msgs, 0, sizeof(recvq.msgs));
+    for (i = 0; i != RECV_BATCH_SIZE; ++i) {
+        recvq.vecs[i].iov_base = recvq.bufs[i];
+        recvq.vecs[i].iov_len = sizeof(recvq.bufs[i]);
+        recvq.msgs[i].msg_hdr.msg_name = recvq.sa + i;
+        recvq.msgs[i].msg_hdr.msg_namelen = sizeof(recvq.sa[i]);
+        recvq.msgs[i].msg_hdr.msg_iov = recvq.vecs + i;
+        recvq.msgs[i].msg_hdr.msg_iovlen = 1;
+        recvq.msgs[i].msg_hdr.msg_control = recvq.cmsgbufs[i].buf;
+        recvq.msgs[i].msg_hdr.msg_controllen = sizeof(recvq.cmsgbufs[i].buf);
+    }
+    while ((ret = recvmmsg(fd, recvq.msgs, RECV_BATCH_SIZE, MSG_DONTWAIT, NULL)) == -1 && errno == EINTR)
+        ;
+    if (ret <= 0)
+        return 0;
+    ++recvq.stats.syscalls;
+    for (i = 0; i != (size_t)ret; ++i) {
+        size_t segment_size = 0;
+        struct cmsghdr *cmsg;
+        if (recvq.msgs[i].msg_len == 0)
+            continue;
+        recvq.ecn[i] = QUICLY_ECN_NOT_ECT;
+        for (cmsg = CMSG_FIRSTHDR(&recvq.msgs[i].msg_hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(&recvq.msgs[i].msg_hdr, cmsg)) {
+#ifdef UDP_GRO
+            if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+                int gso_size;
+                memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(gso_size));
+                segment_size = gso_size;
+            }
+#endif
+            if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_TOS) {
+                recvq.ecn[i] = *(uint8_t *)CMSG_DATA(cmsg) & 0x3;
+            } else if (cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_TCLASS) {
+                int tclass;
+                memcpy(&tclass, CMSG_DATA(cmsg), sizeof(tclass));
+                recvq.ecn[i] = tclass & 0x3;
             }
         }
-    } while (ret == 0 && num_packets == sizeof(packets) / sizeof(packets[0]));
+        recvq.salen[i] = recvq.msgs[i].msg_hdr.msg_namelen;
+        num_slices = add_recv_slices(num_slices, i, recvq.msgs[i].msg_len, segment_size);
+    }
+#else
+    for (i = 0; i != RECV_BATCH_SIZE; ++i) {
+        struct msghdr mess;
+        struct iovec vec;
+        ssize_t rret;
+        memset(&mess, 0, sizeof(mess));
+        mess.msg_name = recvq.sa + i;
+        mess.msg_namelen = sizeof(recvq.sa[i]);
+        vec.iov_base = recvq.bufs[i];
+        vec.iov_len = sizeof(recvq.bufs[i]);
+        mess.msg_iov = &vec;
+        mess.msg_iovlen = 1;
+        while ((rret = recvmsg(fd, &mess, MSG_DONTWAIT)) == -1 && errno == EINTR)
+            ;
+        if (rret <= 0)
+            break;
+        ++recvq.stats.syscalls;
+        recvq.salen[i] = mess.msg_namelen;
+        recvq.ecn[i] = QUICLY_ECN_NOT_ECT;
+        num_slices = add_recv_slices(num_slices, i, rret, 0);
+    }
+#endif
 
-    return ret;
+    recvq.stats.datagrams += num_slices;
+    if (verbosity >= 2) {
+        for (i = 0; i != num_slices; ++i)
+            hexdump("recvmsg", recvq.slices[i].base, recvq.slices[i].len);
+    }
+
+    return num_slices;
+}
+
+static void dump_io_stats(void)
+{
+    fprintf(stderr, "sendmsg: datagrams: %" PRIu64 ", syscalls: %" PRIu64 ", syscalls-saved: %" PRIu64 "\n",
+            sendq.stats.datagrams, sendq.stats.syscalls, sendq.stats.datagrams - sendq.stats.syscalls);
+    fprintf(stderr, "recvmsg: datagrams: %" PRIu64 ", syscalls: %" PRIu64 "\n", recvq.stats.datagrams, recvq.stats.syscalls);
+    if (ctx.alloc_packet == quicly_pooled_alloc_packet) {
+        quicly_packet_pool_stats_t stats;
+        quicly_packet_pool_get_stats(&stats);
+        fprintf(stderr, "packet-pool: allocs: %" PRIu64 ", hit-rate: %.1f%%, peak-in-use: %zu, bytes-cached: %zu\n", stats.num_allocs,
+                stats.num_allocs != 0 ? (double)stats.num_hits * 100 / stats.num_allocs : 0., stats.peak_in_use, stats.bytes_cached);
+    }
+    {
+        quicly_sentmap_pool_stats_t stats;
+        quicly_sentmap_pool_get_stats(&stats);
+        fprintf(stderr, "sentmap-pool: allocs: %" PRIu64 ", hit-rate: %.1f%%, peak-in-use: %zu, cached: %zu\n", stats.num_allocs,
+                stats.num_allocs != 0 ? (double)stats.num_hits * 100 / stats.num_allocs : 0., stats.peak_in_use, stats.num_cached);
+    }
 }
 
 static void set_alpn(ptls_handshake_properties_t *pro, const char *alpn_str)
@@ -348,10 +732,77 @@ static void send_if_possible(quicly_conn_t *conn)
     }
 }
 
+/**
+ * waits for the socket to become readable; uses epoll on Linux and select elsewhere
+ */
+struct st_event_loop_t {
+    int fd;
+#ifdef __linux__
+    int epfd;
+#endif
+};
+
+static void event_loop_init(struct st_event_loop_t *loop, int fd)
+{
+    loop->fd = fd;
+#ifdef __linux__
+    struct epoll_event ev;
+    if ((loop->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        perror("epoll_create1(2) failed");
+        exit(1);
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        perror("epoll_ctl(2) failed");
+        exit(1);
+    }
+#endif
+}
+
+/**
+ * blocks until the socket becomes readable or the given time (INT64_MAX to wait forever) arrives, and returns if the socket is
+ * readable
+ */
+static int event_loop_wait(struct st_event_loop_t *loop, int64_t timeout_at)
+{
+    int64_t delta = -1;
+    int ret;
+
+    if (timeout_at != INT64_MAX) {
+        if ((delta = timeout_at - ctx.now(&ctx)) < 0)
+            delta = 0;
+    }
+
+#ifdef __linux__
+    /* epoll_wait takes milliseconds; round up so that we do not wake up before the timeout */
+    int64_t delta_msec = delta == -1 ? -1 : (delta + 999) / 1000;
+    struct epoll_event ev;
+    while ((ret = epoll_wait(loop->epfd, &ev, 1, delta_msec > INT_MAX ? INT_MAX : (int)delta_msec)) == -1 && errno == EINTR)
+        ;
+    return ret > 0;
+#else
+    fd_set readfds;
+    struct timeval *tv = NULL, tvbuf;
+    do {
+        if (delta != -1) {
+            tvbuf.tv_sec = delta / 1000000;
+            tvbuf.tv_usec = delta % 1000000;
+            tv = &tvbuf;
+        }
+        FD_ZERO(&readfds);
+        FD_SET(loop->fd, &readfds);
+    } while ((ret = select(loop->fd + 1, &readfds, NULL, NULL, tv)) == -1 && errno == EINTR);
+    return ret > 0 && FD_ISSET(loop->fd, &readfds);
+#endif
+}
+
 static int run_client(struct sockaddr *sa, socklen_t salen, const char *host)
 {
     int fd, ret;
     struct sockaddr_in local;
+    struct st_event_loop_t loop;
     quicly_conn_t *conn = NULL;
 
     if ((fd = socket(sa->sa_family, SOCK_DGRAM, IPPROTO_UDP)) == -1) {
@@ -364,63 +815,48 @@ static int run_client(struct sockaddr *sa, socklen_t salen, const char *host)
         perror("bind(2) failed");
         return 1;
     }
-    ret = quicly_connect(&conn, &ctx, host, sa, salen, &hs_properties, &resumed_transport_params);
+    enable_gro(fd);
+    enable_txtime(fd);
+    enable_pmtud(fd, AF_INET);
+    enable_recvtos(fd, AF_INET);
+    ret = quicly_connect(&conn, &ctx, host, sa, salen, &hs_properties, &resumed_transport_params, &resumed_path_state);
     assert(ret == 0);
     send_if_possible(conn);
     send_pending(fd, conn);
+    flush_sendq(fd);
 
+    event_loop_init(&loop, fd);
     while (1) {
-        fd_set readfds;
-        struct timeval *tv, tvbuf;
-        do {
-            int64_t timeout_at = conn != NULL ? quicly_get_first_timeout(conn) : INT64_MAX;
-            if (timeout_at != INT64_MAX) {
-                int64_t delta = timeout_at - quicly_get_context(conn)->now(quicly_get_context(conn));
-                if (delta > 0) {
-                    tvbuf.tv_sec = delta / 1000;
-                    tvbuf.tv_usec = (delta % 1000) * 1000;
-                } else {
-                    tvbuf.tv_sec = 0;
-                    tvbuf.tv_usec = 0;
+        if (event_loop_wait(&loop, quicly_get_first_timeout(conn))) {
+            quicly_decoded_packet_t packets[RECV_MAX_PACKETS];
+            size_t num_datagrams = receive_datagrams(fd), num_packets = 0, i;
+            for (i = 0; i != num_datagrams; ++i) {
+                struct st_recv_slice_t *slice = recvq.slices + i;
+                size_t off = 0;
+                while (off != slice->len) {
+                    size_t plen = quicly_decode_packet(packets + num_packets, slice->base + off, slice->len - off, 0);
+                    if (plen == SIZE_MAX)
+                        break;
+                    packets[num_packets].datagram_size = slice->len;
+                    packets[num_packets].ecn = slice->ecn;
+                    if (++num_packets == RECV_MAX_PACKETS) {
+                        quicly_receive_batch(conn, packets, num_packets);
+                        num_packets = 0;
+                    }
+                    off += plen;
                 }
-                tv = &tvbuf;
-            } else {
-                tv = NULL;
-            }
-            FD_ZERO(&readfds);
-            FD_SET(fd, &readfds);
-        } while (select(fd + 1, &readfds, NULL, NULL, tv) == -1 && errno == EINTR);
-        if (FD_ISSET(fd, &readfds)) {
-            uint8_t buf[4096];
-            struct msghdr mess;
-            struct sockaddr sa;
-            struct iovec vec;
-            memset(&mess, 0, sizeof(mess));
-            mess.msg_name = &sa;
-            mess.msg_namelen = sizeof(sa);
-            vec.iov_base = buf;
-            vec.iov_len = sizeof(buf);
-            mess.msg_iov = &vec;
-            mess.msg_iovlen = 1;
-            ssize_t rret;
-            while ((rret = recvmsg(fd, &mess, 0)) <= 0)
-                ;
-            if (verbosity >= 2)
-                hexdump("recvmsg", buf, rret);
-            size_t off = 0;
-            while (off != rret) {
-                quicly_decoded_packet_t packet;
-                size_t plen = quicly_decode_packet(&packet, buf + off, rret - off, 0);
-                if (plen == SIZE_MAX)
-                    break;
-                quicly_receive(conn, &packet);
-                off += plen;
             }
+            if (num_packets != 0)
+                quicly_receive_batch(conn, packets, num_packets);
             send_if_possible(conn);
         }
         if (conn != NULL) {
             ret = send_pending(fd, conn);
+            flush_sendq(fd);
             if (ret != 0) {
+                /* save the session again, now that the characteristics of the path are known */
+                if (session_ticket.base != NULL)
+                    save_session(conn);
                 quicly_free(conn);
                 conn = NULL;
                 if (ret == QUICLY_ERROR_FREE_CONNECTION) {
@@ -437,6 +873,41 @@ static int run_client(struct sockaddr *sa, socklen_t salen, const char *host)
 static quicly_conn_t **conns;
 static size_t num_conns = 0;
 
+/**
+ * per-connection state of the server, stored in *quicly_get_data(conn)
+ */
+struct st_server_conn_t {
+    quicly_conn_t *conn;
+};
+
+static void register_server_conn(quicly_conn_t *conn)
+{
+    struct st_server_conn_t *sc;
+
+    sc = malloc(sizeof(*sc));
+    assert(sc != NULL);
+    sc->conn = conn;
+    *quicly_get_data(conn) = sc;
+
+    conns = realloc(conns, sizeof(*conns) * (num_conns + 1));
+    assert(conns != NULL);
+    conns[num_conns++] = conn;
+}
+
+static void free_server_conn(quicly_conn_t *conn)
+{
+    struct st_server_conn_t *sc = *quicly_get_data(conn);
+    size_t i;
+
+    for (i = 0; conns[i] != conn; ++i)
+        ;
+    memmove(conns + i, conns + i + 1, (num_conns - i - 1) * sizeof(*conns));
+    --num_conns;
+
+    free(sc);
+    quicly_free(conn);
+}
+
 static void on_signal(int signo)
 {
     size_t i;
@@ -451,12 +922,43 @@ static void on_signal(int signo)
                 host_cid_hex, num_received, num_sent, num_lost, num_ack_received, num_bytes_sent);
         free(host_cid_hex);
     }
+    dump_io_stats();
     if (signo == SIGINT)
         _exit(0);
 }
 
+struct st_pending_packet_t {
+    quicly_conn_t *conn;
+    quicly_decoded_packet_t packet;
+};
+
+/**
+ * passes the packets to the connections, grouping the packets by connection while retaining the order of packets destined to each
+ * connection
+ */
+static void receive_pending(struct st_pending_packet_t *pending, size_t num_pending)
+{
+    quicly_decoded_packet_t packets[RECV_MAX_PACKETS];
+    size_t i, j, num_packets;
+
+    for (i = 0; i != num_pending; ++i) {
+        quicly_conn_t *conn = pending[i].conn;
+        if (conn == NULL)
+            continue;
+        num_packets = 0;
+        for (j = i; j != num_pending; ++j) {
+            if (pending[j].conn == conn) {
+                packets[num_packets++] = pending[j].packet;
+                pending[j].conn = NULL;
+            }
+        }
+        quicly_receive_batch(conn, packets, num_packets);
+    }
+}
+
 static int run_server(struct sockaddr *sa, socklen_t salen)
 {
+    struct st_event_loop_t loop;
     int fd;
 
     signal(SIGINT, on_signal);
@@ -475,112 +977,100 @@ static int run_server(struct sockaddr *sa, socklen_t salen)
         perror("bind(2) failed");
         return 1;
     }
+    enable_gro(fd);
+    enable_txtime(fd);
+    enable_pmtud(fd, sa->sa_family);
+    enable_recvtos(fd, sa->sa_family);
 
+    if ((ctx.conn_map = quicly_conn_map_create()) == NULL) {
+        fprintf(stderr, "failed to create the connection table\n");
+        return 1;
+    }
+    if ((ctx.timer_wheel = quicly_timerwheel_create(ctx.now(&ctx))) == NULL) {
+        fprintf(stderr, "failed to create the timer wheel\n");
+        return 1;
+    }
+
+    event_loop_init(&loop, fd);
     while (1) {
-        fd_set readfds;
-        struct timeval *tv, tvbuf;
-        do {
-            int64_t timeout_at = INT64_MAX;
-            size_t i;
-            for (i = 0; i != num_conns; ++i) {
-                int64_t conn_to = quicly_get_first_timeout(conns[i]);
-                if (conn_to < timeout_at)
-                    timeout_at = conn_to;
-            }
-            if (timeout_at != INT64_MAX) {
-                int64_t delta = timeout_at - ctx.now(&ctx);
-                if (delta > 0) {
-                    tvbuf.tv_sec = delta / 1000;
-                    tvbuf.tv_usec = (delta % 1000) * 1000;
-                } else {
-                    tvbuf.tv_sec = 0;
-                    tvbuf.tv_usec = 0;
-                }
-                tv = &tvbuf;
-            } else {
-                tv = NULL;
-            }
-            FD_ZERO(&readfds);
-            FD_SET(fd, &readfds);
-        } while (select(fd + 1, &readfds, NULL, NULL, tv) == -1 && errno == EINTR);
-        if (FD_ISSET(fd, &readfds)) {
-            uint8_t buf[4096];
-            struct msghdr mess;
-            struct sockaddr sa;
-            struct iovec vec;
-            memset(&mess, 0, sizeof(mess));
-            mess.msg_name = &sa;
-            mess.msg_namelen = sizeof(sa);
-            vec.iov_base = buf;
-            vec.iov_len = sizeof(buf);
-            mess.msg_iov = &vec;
-            mess.msg_iovlen = 1;
-            ssize_t rret;
-            while ((rret = recvmsg(fd, &mess, 0)) <= 0)
-                ;
-            if (verbosity >= 2)
-                hexdump("recvmsg", buf, rret);
-            size_t off = 0;
-            while (off != rret) {
-                quicly_decoded_packet_t packet;
-                size_t plen = quicly_decode_packet(&packet, buf + off, rret - off, 8);
-                if (plen == SIZE_MAX)
-                    break;
-                quicly_conn_t *conn = NULL;
-                size_t i;
-                for (i = 0; i != num_conns; ++i) {
-                    if (quicly_is_destination(conns[i], (packet.octets.base[0] & 0x80) == 0, packet.cid.dest)) {
-                        conn = conns[i];
+        if (event_loop_wait(&loop, quicly_timerwheel_get_first_timeout(ctx.timer_wheel))) {
+            struct st_pending_packet_t pending[RECV_MAX_PACKETS];
+            size_t num_datagrams = receive_datagrams(fd), num_pending = 0, i;
+            for (i = 0; i != num_datagrams; ++i) {
+                uint8_t *buf = recvq.slices[i].base;
+                size_t len = recvq.slices[i].len, off = 0;
+                struct sockaddr *sa = recvq.slices[i].sa;
+                socklen_t salen = recvq.slices[i].salen;
+                while (off != len) {
+                    quicly_decoded_packet_t packet;
+                    size_t plen = quicly_decode_packet(&packet, buf + off, len - off, 8);
+                    if (plen == SIZE_MAX)
                         break;
-                    }
-                }
-                if (conn != NULL) {
-                    /* existing connection */
-                    quicly_receive(conn, &packet);
-                } else if (retry_token.len != 0 && !(packet.token.len == retry_token.len &&
-                                                     memcmp(packet.token.base, retry_token.base, retry_token.len) == 0)) {
-                    /* unbound connection; send a retry token unless the client has supplied the correct one, but not too many */
-                    if (off == 0) {
-                        quicly_datagram_t *rp =
-                            quicly_send_retry(&ctx, &sa, salen, packet.cid.src, packet.cid.dest, packet.cid.dest, retry_token);
-                        assert(rp != NULL);
-                        if (send_one(fd, rp) == -1)
-                            perror("sendmsg failed");
-                    }
-                } else {
-                    /* new connection */
-                    int ret = quicly_accept(&conn, &ctx, &sa, mess.msg_namelen, NULL, &packet);
-                    if (ret == 0) {
-                        assert(conn != NULL);
-                        conns = realloc(conns, sizeof(*conns) * (num_conns + 1));
-                        assert(conns != NULL);
-                        conns[num_conns++] = conn;
-                    } else {
-                        assert(conn == NULL);
-                        if (ret == QUICLY_ERROR_VERSION_NEGOTIATION) {
+                    packet.datagram_size = len;
+                    packet.ecn = recvq.slices[i].ecn;
+                    quicly_conn_t *conn = quicly_conn_map_lookup(ctx.conn_map, &packet);
+                    if (conn != NULL) {
+                        /* existing connection; the packet is processed once all the datagrams are read */
+                        if (num_pending == RECV_MAX_PACKETS) {
+                            receive_pending(pending, num_pending);
+                            num_pending = 0;
+                        }
+                        pending[num_pending].conn = conn;
+                        pending[num_pending].packet = packet;
+                        ++num_pending;
+                    } else if (retry_token.len != 0 && !(packet.token.len == retry_token.len &&
+                                                         memcmp(packet.token.base, retry_token.base, retry_token.len) == 0)) {
+                        /* unbound connection; send a retry token unless the client has supplied the correct one, but not too
+                         * many */
+                        if (off == 0) {
                             quicly_datagram_t *rp =
-                                quicly_send_version_negotiation(&ctx, &sa, salen, packet.cid.src, packet.cid.dest);
+                                quicly_send_retry(&ctx, sa, salen, packet.cid.src, packet.cid.dest, packet.cid.dest, retry_token);
                             assert(rp != NULL);
-                            if (send_one(fd, rp) == -1)
-                                perror("sendmsg failed");
+                            enqueue_one(fd, rp);
+                        }
+                    } else {
+                        /* new connection */
+                        int ret = quicly_accept(&conn, &ctx, sa, salen, NULL, &packet);
+                        if (ret == 0) {
+                            assert(conn != NULL);
+                            register_server_conn(conn);
+                        } else {
+                            assert(conn == NULL);
+                            if (ret == QUICLY_ERROR_VERSION_NEGOTIATION) {
+                                quicly_datagram_t *rp =
+                                    quicly_send_version_negotiation(&ctx, sa, salen, packet.cid.src, packet.cid.dest);
+                                assert(rp != NULL);
+                                enqueue_one(fd, rp);
+                            }
                         }
                     }
+                    off += plen;
                 }
-                off += plen;
             }
+            receive_pending(pending, num_pending);
         }
-        {
-            size_t i;
-            for (i = 0; i != num_conns; ++i) {
-                if (quicly_get_first_timeout(conns[i]) <= ctx.now(&ctx)) {
-                    if (send_pending(fd, conns[i]) != 0) {
-                        quicly_free(conns[i]);
-                        memmove(conns + i, conns + i + 1, (num_conns - i - 1) * sizeof(*conns));
-                        --i;
-                        --num_conns;
-                    }
+        { /* run the timers that have fired; they are collected first, as a timer might fire again right after being updated */
+            static quicly_timerwheel_timer_t **expired;
+            static size_t expired_capacity;
+            size_t num_expired = 0, i;
+            int64_t now = ctx.now(&ctx);
+            while (1) {
+                if (num_expired == expired_capacity) {
+                    expired_capacity = expired_capacity == 0 ? 16 : expired_capacity * 2;
+                    expired = realloc(expired, sizeof(*expired) * expired_capacity);
+                    assert(expired != NULL);
                 }
+                num_expired +=
+                    quicly_timerwheel_get_expired(ctx.timer_wheel, now, expired + num_expired, expired_capacity - num_expired);
+                if (num_expired != expired_capacity)
+                    break;
+            }
+            for (i = 0; i != num_expired; ++i) {
+                quicly_conn_t *conn = quicly_get_conn_by_timer(expired[i]);
+                if (send_pending(fd, conn) != 0)
+                    free_server_conn(conn);
             }
+            flush_sendq(fd);
         }
     }
 }
@@ -588,21 +1078,40 @@ static int run_server(struct sockaddr *sa, socklen_t salen)
 int save_ticket_cb(ptls_save_ticket_t *_self, ptls_t *tls, ptls_iovec_t src)
 {
     quicly_conn_t *conn = *ptls_get_data_ptr(tls);
-    ptls_buffer_t buf;
-    FILE *fp = NULL;
-    int ret;
 
     if (ticket_file == NULL)
         return 0;
 
+    free(session_ticket.base);
+    session_ticket = ptls_iovec_init(malloc(src.len), src.len);
+    assert(session_ticket.base != NULL);
+    memcpy(session_ticket.base, src.base, src.len);
+
+    save_session(conn);
+    return 0;
+}
+
+static void save_session(quicly_conn_t *conn)
+{
+    quicly_path_state_t path_state;
+    ptls_buffer_t buf;
+    FILE *fp = NULL;
+    int ret;
+
     ptls_buffer_init(&buf, "", 0);
 
-    /* build data (session ticket and transport parameters) */
-    ptls_buffer_push_block(&buf, 2, { ptls_buffer_pushv(&buf, src.base, src.len); });
+    /* build data (session ticket, transport parameters, and the characteristics of the path) */
+    ptls_buffer_push_block(&buf, 2, { ptls_buffer_pushv(&buf, session_ticket.base, session_ticket.len); });
     ptls_buffer_push_block(&buf, 2, {
         if ((ret = quicly_encode_transport_parameter_list(quicly_get_peer_transport_parameters(conn), 1, &buf)) != 0)
             goto Exit;
     });
+    quicly_get_path_state(conn, &path_state);
+    ptls_buffer_push_block(&buf, 2, {
+        ptls_buffer_push32(&buf, path_state.smoothed_rtt);
+        ptls_buffer_push32(&buf, path_state.min_rtt);
+        ptls_buffer_push32(&buf, path_state.cwnd);
+    });
 
     /* write file */
     if ((fp = fopen(ticket_file, "wb")) == NULL) {
@@ -617,7 +1126,6 @@ Exit:
     if (fp != NULL)
         fclose(fp);
     ptls_buffer_dispose(&buf);
-    return 0;
 }
 
 static void load_ticket(void)
@@ -650,6 +1158,14 @@ static void load_ticket(void)
                 goto Exit;
             src = end;
         });
+        if (src != end) {
+            ptls_decode_block(src, end, 2, {
+                if ((ret = ptls_decode32(&resumed_path_state.smoothed_rtt, &src, end)) != 0 ||
+                    (ret = ptls_decode32(&resumed_path_state.min_rtt, &src, end)) != 0 ||
+                    (ret = ptls_decode32(&resumed_path_state.cwnd, &src, end)) != 0)
+                    goto Exit;
+            });
+        }
         hs_properties.client.session_ticket = ticket;
     }
 
@@ -662,17 +1178,27 @@ static void usage(const char *cmd)
            "\n"
            "Options:\n"
            "  -a <alpn list>       a coma separated list of ALPN identifiers\n"
+           "  -b batch-size        maximum number of datagrams to be sent by one system call\n"
+           "                       (default: 16)\n"
            "  -c certificate-file\n"
            "  -k key-file          specifies the credentials to be used for running the\n"
            "                       server. If omitted, the command runs as a client.\n"
+           "  -E                   mark the packets ECN-capable (Linux only)\n"
            "  -e event-log-file    file to log events\n"
+           "  -g max-segments      maximum number of packets to be sent at once using UDP GSO\n"
+           "                       (Linux only)\n"
            "  -l log-file          file to log traffic secrets\n"
+           "  -M max-packet-size   probe the path for packet sizes up to the given value (PMTU\n"
+           "                       discovery)\n"
            "  -N                   enforce HelloRetryRequest (client-only)\n"
            "  -n                   enforce version negotiation (client-only)\n"
+           "  -P                   use malloc instead of the packet pool for allocating datagrams\n"
            "  -p path              path to request (can be set multiple times)\n"
            "  -R                   require Retry (server only)\n"
            "  -r [initial-rto]     initial RTO (in milliseconds)\n"
            "  -s session-file      file to load / store the session ticket\n"
+           "  -T                   let the kernel pace the packets using SO_TXTIME (Linux only,\n"
+           "                       requires the fq qdisc)\n"
            "  -V                   verify peer using the default certificates\n"
            "  -v                   verbose mode (-vv emits packet dumps as well)\n"
            "  -x named-group       named group to be used (default: secp256r1)\n"
@@ -686,27 +1212,45 @@ int main(int argc, char **argv)
     const char *host, *port;
     struct sockaddr_storage sa;
     socklen_t salen;
+    size_t send_batch_size = 16;
     int ch;
 
     ctx = quicly_default_context;
     ctx.tls = &tlsctx;
     ctx.on_stream_open = on_stream_open;
     ctx.on_conn_close = on_conn_close;
+    ctx.alloc_packet = quicly_pooled_alloc_packet;
+    ctx.free_packet = quicly_pooled_free_packet;
+    ctx.pacer = &quicly_pacer_default_conf;
 
     setup_session_cache(ctx.tls);
     quicly_amend_ptls_context(ctx.tls);
 
-    while ((ch = getopt(argc, argv, "a:c:k:e:l:Nnp:Rr:s:Vvx:h")) != -1) {
+    while ((ch = getopt(argc, argv, "a:b:c:k:Ee:g:l:M:NnPp:Rr:s:TVvx:h")) != -1) {
         switch (ch) {
         case 'a':
             set_alpn(&hs_properties, optarg);
             break;
+        case 'b':
+            if (sscanf(optarg, "%zu", &send_batch_size) != 1 || send_batch_size == 0) {
+                fprintf(stderr, "invalid argument passed to `-b`\n");
+                exit(1);
+            }
+            break;
         case 'c':
             load_certificate_chain(ctx.tls, optarg);
             break;
         case 'k':
             load_private_key(ctx.tls, optarg);
             break;
+        case 'E':
+#ifdef __linux__
+            ctx.enable_ecn = 1;
+#else
+            fprintf(stderr, "ECN is not supported on this platform\n");
+            exit(1);
+#endif
+            break;
         case 'e':
             if ((quicly_default_event_log_fp = fopen(optarg, "w")) == NULL) {
                 fprintf(stderr, "failed to open file:%s:%s\n", optarg, strerror(errno));
@@ -716,12 +1260,42 @@ int main(int argc, char **argv)
             ctx.event_log.mask = UINT64_MAX;
             ctx.event_log.cb = quicly_default_event_log;
             break;
+        case 'g':
+#ifdef UDP_SEGMENT
+            if (sscanf(optarg, "%" SCNu16, &ctx.max_gso_segments) != 1 || ctx.max_gso_segments == 0 ||
+                ctx.max_gso_segments > 64 || (size_t)ctx.max_gso_segments * ctx.max_packet_size > QUICLY_MAX_UDP_PAYLOAD_SIZE) {
+                fprintf(stderr, "invalid argument passed to `-g`\n");
+                exit(1);
+            }
+#else
+            fprintf(stderr, "UDP GSO is not supported on this platform\n");
+            exit(1);
+#endif
+            break;
         case 'l':
             setup_log_secret(ctx.tls, optarg);
             break;
+        case 'M':
+            if (sscanf(optarg, "%" SCNu16, &ctx.max_probed_packet_size) != 1 || ctx.max_probed_packet_size <= ctx.max_packet_size) {
+                fprintf(stderr, "invalid argument passed to `-M`\n");
+                exit(1);
+            }
+            break;
+        case 'T':
+#ifdef SO_TXTIME
+            ctx.pace_by_txtime = 1;
+#else
+            fprintf(stderr, "SO_TXTIME is not supported on this platform\n");
+            exit(1);
+#endif
+            break;
         case 'N':
             hs_properties.client.negotiate_before_key_exchange = 1;
             break;
+        case 'P':
+            ctx.alloc_packet = quicly_default_alloc_packet;
+            ctx.free_packet = quicly_default_free_packet;
+            break;
         case 'n':
             ctx.enforce_version_negotiation = 1;
             break;
@@ -739,6 +1313,7 @@ int main(int argc, char **argv)
                 fprintf(stderr, "invalid argument passed to `-r`\n");
                 exit(1);
             }
+            ctx.loss->default_initial_rtt *= 1000;
             break;
         case 's':
             ticket_file = optarg;
@@ -784,6 +1359,8 @@ int main(int argc, char **argv)
     if (key_exchanges[0] == NULL)
         key_exchanges[0] = &ptls_openssl_secp256r1;
 
+    init_sendq(send_batch_size);
+
     if (ctx.tls->certificates.count != 0 || ctx.tls->sign_certificate != NULL) {
         /* server */
         if (ctx.tls->certificates.count == 0 || ctx.tls->sign_certificate == NULL) {
@@ -0,0 +1,322 @@
+/*
+ * Copyright (c) 2019 Fastly, Kazuho Oku
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "quicly/sentmap.h"
+#include "quicly/streambuf.h"
+#include "quicly/timerwheel.h"
+#include "test.h"
+
+/**
+ * Benchmarks that measure the wall-clock time, built as a separate executable (i.e. the `bench` target) so that the numbers, which
+ * depend on the environment, do not slow down or clutter the unit tests.
+ */
+
+static int64_t now_nsec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * transfers a response of 256KB, and returns the time spent by the server in quicly_send per packet (in nanoseconds)
+ */
+static double bench_sealing(int defer_sealing)
+{
+    static char testdata[256 * 1024 + 1];
+    quicly_conn_t *client, *server;
+    quicly_stream_t *client_stream, *server_stream;
+    test_streambuf_t *client_streambuf;
+    quicly_datagram_t *datagrams[32];
+    quicly_decoded_packet_t decoded[32];
+    size_t num_datagrams, num_packets, num_packets_sent = 0, i;
+    int64_t elapsed = 0, start;
+    int ret;
+
+    memset(testdata, 'A', sizeof(testdata) - 1);
+    quic_ctx.defer_sealing = defer_sealing;
+
+    { /* handshake */
+        quicly_datagram_t *raw;
+        size_t num_packets = 1;
+        ret = quicly_connect(&client, &quic_ctx, "example.com", (void *)"abc", 3, NULL, NULL, NULL);
+        assert(ret == 0);
+        ret = quicly_send(client, &raw, &num_packets);
+        assert(ret == 0);
+        decode_packets(decoded, &raw, 1, 8);
+        ret = quicly_accept(&server, &quic_ctx, (void *)"abc", 3, NULL, decoded);
+        assert(ret == 0);
+        free_packets(&raw, 1);
+    }
+    transmit(server, client);
+
+    ret = quicly_open_stream(client, &client_stream, 0);
+    assert(ret == 0);
+    client_streambuf = client_stream->data;
+    quicly_streambuf_egress_write(client_stream, "GET", 3);
+    quicly_streambuf_egress_shutdown(client_stream);
+    transmit(client, server);
+    server_stream = quicly_get_stream(server, client_stream->stream_id);
+    quicly_streambuf_egress_write(server_stream, testdata, strlen(testdata));
+    quicly_streambuf_egress_shutdown(server_stream);
+
+    while (!client_streambuf->is_detached) {
+        do {
+            num_datagrams = sizeof(datagrams) / sizeof(datagrams[0]);
+            start = now_nsec();
+            ret = quicly_send(server, datagrams, &num_datagrams);
+            elapsed += now_nsec() - start;
+            assert(ret == 0);
+            num_packets = decode_packets(decoded, datagrams, num_datagrams, 0);
+            for (i = 0; i != num_packets; ++i)
+                quicly_receive(client, decoded + i);
+            free_packets(datagrams, num_datagrams);
+            num_packets_sent += num_packets;
+        } while (num_datagrams != 0);
+        quic_now += QUICLY_DELAYED_ACK_TIMEOUT * 1000;
+        transmit(client, server);
+    }
+
+    quicly_free(client);
+    quicly_free(server);
+    quic_ctx.defer_sealing = 0;
+
+    return (double)elapsed / num_packets_sent;
+}
+
+struct st_handshake_worker_t {
+    pthread_t tid;
+    quicly_conn_t **conns;
+    size_t num_conns;
+};
+
+static void *handshake_worker_main(void *_worker)
+{
+    struct st_handshake_worker_t *worker = _worker;
+    size_t i;
+
+    for (i = 0; i != worker->num_conns; ++i) {
+        int ret = quicly_complete_handshake(worker->conns[i]);
+        assert(ret == 0);
+    }
+
+    return NULL;
+}
+
+static int cmp_int64(const void *_x, const void *_y)
+{
+    int64_t x = *(const int64_t *)_x, y = *(const int64_t *)_y;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Accepts a number of connections, recording the time the event loop spends on each of them. When running asynchronously, the
+ * handshakes are completed by two worker threads, in batches.
+ */
+static void bench_async_handshake(int async)
+{
+#define NUM_CONNS 200
+#define BATCH_SIZE 8
+    static quicly_datagram_t *client_hellos[NUM_CONNS];
+    static int64_t latencies[NUM_CONNS];
+    quicly_conn_t *client, *conns[BATCH_SIZE];
+    struct st_handshake_worker_t workers[2];
+    quicly_datagram_t *datagrams[32];
+    quicly_decoded_packet_t decoded;
+    size_t num_datagrams, batch_start, i, j;
+    int64_t wall_start, start;
+    int ret;
+
+    /* prepare ClientHellos */
+    for (i = 0; i != NUM_CONNS; ++i) {
+        size_t num_packets = 1;
+        ret = quicly_connect(&client, &quic_ctx, "example.com", (void *)"abc", 3, NULL, NULL, NULL);
+        assert(ret == 0);
+        ret = quicly_send(client, client_hellos + i, &num_packets);
+        assert(ret == 0 && num_packets == 1);
+        quicly_free(client);
+    }
+
+    quic_ctx.async_handshake = async;
+    wall_start = now_nsec();
+
+    for (batch_start = 0; batch_start < NUM_CONNS; batch_start += BATCH_SIZE) {
+        size_t batch_size = NUM_CONNS - batch_start < BATCH_SIZE ? NUM_CONNS - batch_start : BATCH_SIZE;
+        /* accept */
+        for (i = 0; i != batch_size; ++i) {
+            decode_packets(&decoded, client_hellos + batch_start + i, 1, 8);
+            start = now_nsec();
+            ret = quicly_accept(conns + i, &quic_ctx, (void *)"abc", 3, NULL, &decoded);
+            latencies[batch_start + i] = now_nsec() - start;
+            assert(ret == (async ? QUICLY_ERROR_HANDSHAKE_PENDING : 0));
+        }
+        /* complete the handshakes off the event loop */
+        if (async) {
+            for (j = 0; j != sizeof(workers) / sizeof(workers[0]); ++j) {
+                workers[j].conns = conns + batch_size * j / 2;
+                workers[j].num_conns = batch_size * (j + 1) / 2 - batch_size * j / 2;
+                pthread_create(&workers[j].tid, NULL, handshake_worker_main, workers + j);
+            }
+            for (j = 0; j != sizeof(workers) / sizeof(workers[0]); ++j)
+                pthread_join(workers[j].tid, NULL);
+        }
+        /* send the handshake messages */
+        for (i = 0; i != batch_size; ++i) {
+            num_datagrams = sizeof(datagrams) / sizeof(datagrams[0]);
+            start = now_nsec();
+            ret = quicly_send(conns[i], datagrams, &num_datagrams);
+            latencies[batch_start + i] += now_nsec() - start;
+            assert(ret == 0 && num_datagrams != 0);
+            free_packets(datagrams, num_datagrams);
+            quicly_free(conns[i]);
+        }
+    }
+
+    qsort(latencies, NUM_CONNS, sizeof(latencies[0]), cmp_int64);
+    printf("%s handshake: %.1f handshakes/sec, event loop latency per handshake: median %.1f us, p99 %.1f us\n",
+           async ? "asynchronous" : "synchronous", NUM_CONNS * 1e9 / (now_nsec() - wall_start),
+           (double)latencies[NUM_CONNS / 2] / 1e3, (double)latencies[NUM_CONNS * 99 / 100] / 1e3);
+
+    quic_ctx.async_handshake = 0;
+    free_packets(client_hellos, NUM_CONNS);
+#undef NUM_CONNS
+#undef BATCH_SIZE
+}
+
+static int on_sent_acked(struct st_quicly_conn_t *conn, const quicly_sent_packet_t *packet, quicly_sent_t *sent,
+                         quicly_sentmap_event_t event)
+{
+    return 0;
+}
+
+static void sentmap_add(quicly_sentmap_t *map, uint64_t pn)
+{
+    quicly_sentmap_prepare(map, pn, 0, 0);
+    quicly_sentmap_allocate(map, QUICLY_SENT_TYPE_CALLBACK)->data.callback.acked = on_sent_acked;
+    quicly_sentmap_commit(map, 1);
+}
+
+/**
+ * Measures the cost of locating the packets being acknowledged, returning nanoseconds per ACK. Half of the window is deemed lost
+ * and is retained (as is the case for 3 PTO), while the other half is acked one by one.
+ */
+static double bench_sentmap_ack(size_t window, int use_index)
+{
+    static const size_t num_acks = 1000;
+    quicly_sentmap_t map;
+    quicly_sentmap_iter_t iter;
+    uint64_t pn, next_pn = 0;
+    int64_t start, elapsed;
+    size_t i;
+
+    quicly_sentmap_init(&map, NULL);
+    for (; next_pn < window; ++next_pn)
+        sentmap_add(&map, next_pn);
+    quicly_sentmap_init_iter(&map, &iter);
+    while (quicly_sentmap_get(&iter)->packet_number < window / 2)
+        quicly_sentmap_update(&map, &iter, QUICLY_SENTMAP_EVENT_LOST, NULL);
+
+    start = now_nsec();
+    for (i = 0, pn = window / 2; i != num_acks; ++i, ++pn) {
+        if (use_index) {
+            quicly_sentmap_find(&map, &iter, pn);
+        } else {
+            quicly_sentmap_init_iter(&map, &iter);
+            while (quicly_sentmap_get(&iter)->packet_number < pn)
+                quicly_sentmap_skip(&iter);
+        }
+        quicly_sentmap_update(&map, &iter, QUICLY_SENTMAP_EVENT_ACKED, NULL);
+        sentmap_add(&map, next_pn++);
+    }
+    elapsed = now_nsec() - start;
+
+    quicly_sentmap_dispose(&map);
+    return (double)elapsed / num_acks;
+}
+
+/**
+ * Measures the cost of finding and updating the earliest timeout per wakeup, using the timer wheel and using a linear scan (as done
+ * by an event loop that calls quicly_get_first_timeout for every connection).
+ */
+static void bench_timerwheel(size_t num_conns)
+{
+    static const size_t num_wakeups = 100000;
+    quicly_timerwheel_t *wheel = quicly_timerwheel_create(0);
+    quicly_timerwheel_timer_t *timers = malloc(sizeof(*timers) * num_conns);
+    int64_t start, wheel_cost, linear_cost;
+    size_t i, j;
+
+    assert(wheel != NULL && timers != NULL);
+
+    /* timer wheel */
+    for (i = 0; i != num_conns; ++i) {
+        quicly_timerwheel_init_timer(timers + i);
+        quicly_timerwheel_set(wheel, timers + i, rand() % 1000);
+    }
+    start = now_nsec();
+    for (i = 0; i != num_wakeups; ++i) {
+        quicly_timerwheel_timer_t *timer;
+        int64_t at = quicly_timerwheel_get_first_timeout(wheel);
+        /* the wakeup might only move the timers to a finer wheel */
+        if (quicly_timerwheel_get_expired(wheel, at, &timer, 1) != 0)
+            quicly_timerwheel_set(wheel, timer, at + 1 + rand() % 1000);
+    }
+    wheel_cost = now_nsec() - start;
+    quicly_timerwheel_destroy(wheel);
+
+    /* linear scan */
+    for (i = 0; i != num_conns; ++i)
+        timers[i].at = rand() % 1000;
+    start = now_nsec();
+    for (i = 0; i != num_wakeups; ++i) {
+        quicly_timerwheel_timer_t *earliest = timers;
+        for (j = 1; j != num_conns; ++j)
+            if (timers[j].at < earliest->at)
+                earliest = timers + j;
+        earliest->at += 1 + rand() % 1000;
+    }
+    linear_cost = now_nsec() - start;
+
+    printf("timers of %zu connections: %.1f ns/wakeup using the timer wheel, %.1f ns/wakeup using a linear scan\n", num_conns,
+           (double)wheel_cost / num_wakeups, (double)linear_cost / num_wakeups);
+    free(timers);
+}
+
+void run_benchmarks(void)
+{
+    size_t window, num_conns;
+
+    printf("quicly_send: %.1f ns/packet when sealing immediately, %.1f ns/packet when sealing in batches\n", bench_sealing(0),
+           bench_sealing(1));
+    bench_async_handshake(0);
+    bench_async_handshake(1);
+    for (window = 100; window <= 100000; window *= 10)
+        printf("sentmap window %zu: %.1f ns/ack using the index, %.1f ns/ack walking from the head\n", window,
+               bench_sentmap_ack(window, 1), bench_sentmap_ack(window, 0));
+    for (num_conns = 1; num_conns <= 10000; num_conns *= 10)
+        bench_timerwheel(num_conns);
+}
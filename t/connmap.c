@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2019 Fastly, Kazuho Oku
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#include "quicly/connmap.h"
+#include "test.h"
+
+void test_connmap(void)
+{
+    quicly_conn_map_t *map = quicly_conn_map_create();
+    quicly_conn_t *client, *server, *server_dup;
+    quicly_datagram_t *packets[32], *dup_packet;
+    quicly_decoded_packet_t decoded[32], decoded_dup[1], short_header;
+    uint8_t short_header_bytes[1 + 8] = {0x40};
+    size_t num_packets, num_decoded;
+    int ret;
+
+    ok(map != NULL);
+    ok(quicly_conn_map_size(map) == 0);
+    quic_ctx.conn_map = map;
+
+    /* accept a connection, and check that it can be found using the offered CID */
+    ret = quicly_connect(&client, &quic_ctx, "example.com", (void *)"abc", 3, NULL, NULL, NULL);
+    ok(ret == 0);
+    ok(quicly_conn_map_size(map) == 0);
+    num_packets = sizeof(packets) / sizeof(packets[0]);
+    ret = quicly_send(client, packets, &num_packets);
+    ok(ret == 0);
+    dup_packet = quic_ctx.alloc_packet(&quic_ctx, packets[0]->salen, packets[0]->data.len);
+    memcpy(dup_packet->data.base, packets[0]->data.base, packets[0]->data.len);
+    dup_packet->data.len = packets[0]->data.len;
+    dup_packet->segment_size = 0;
+    num_decoded = decode_packets(decoded, packets, num_packets, 8);
+    ok(num_decoded == 1);
+    ok(quicly_conn_map_lookup(map, decoded) == NULL);
+    ret = quicly_accept(&server, &quic_ctx, (void *)"abc", 3, NULL, decoded);
+    ok(ret == 0);
+    ok(quicly_conn_map_size(map) == 1);
+    ok(quicly_conn_map_lookup(map, decoded) == server);
+
+    /* a duplicate of the Initial cannot be accepted as another connection, as the offered CID is in use */
+    num_decoded = decode_packets(decoded_dup, &dup_packet, 1, 8);
+    ok(num_decoded == 1);
+    ret = quicly_accept(&server_dup, &quic_ctx, (void *)"abc", 3, NULL, decoded_dup);
+    ok(ret == QUICLY_ERROR_CID_IN_USE);
+    ok(quicly_conn_map_size(map) == 1);
+    ok(quicly_conn_map_lookup(map, decoded_dup) == server);
+
+    /* short header packets are matched only by the host CID */
+    memcpy(short_header_bytes + 1, quicly_get_offered_cid(server)->cid, 8);
+    ok(quicly_decode_packet(&short_header, short_header_bytes, sizeof(short_header_bytes), 8) == sizeof(short_header_bytes));
+    ok(quicly_conn_map_lookup(map, &short_header) == NULL);
+    memcpy(short_header_bytes + 1, quicly_get_host_cid(server)->cid, 8);
+    ok(quicly_decode_packet(&short_header, short_header_bytes, sizeof(short_header_bytes), 8) == sizeof(short_header_bytes));
+    ok(quicly_conn_map_lookup(map, &short_header) == server);
+
+    /* freeing the connection unregisters it */
+    quicly_free(server);
+    ok(quicly_conn_map_size(map) == 0);
+    ok(quicly_conn_map_lookup(map, decoded) == NULL);
+    ok(quicly_conn_map_lookup(map, &short_header) == NULL);
+
+    free_packets(packets, num_packets);
+    free_packets(&dup_packet, 1);
+    quicly_free(client);
+    quic_ctx.conn_map = NULL;
+    quicly_conn_map_destroy(map);
+}
@@ -103,7 +103,7 @@ static void test_ack_encode(void)
     quicly_ranges_add(&ranges, 0x12, 0x14);
 
     /* encode */
-    end = quicly_encode_ack_frame(buf, buf + sizeof(buf), &ranges, 63);
+    end = quicly_encode_ack_frame(buf, buf + sizeof(buf), &ranges, NULL, 63);
     ok(end - buf == 5);
     /* decode */
     src = buf + 1;
@@ -117,7 +117,7 @@ static void test_ack_encode(void)
     quicly_ranges_add(&ranges, 0x10, 0x11);
 
     /* encode */
-    end = quicly_encode_ack_frame(buf, buf + sizeof(buf), &ranges, 63);
+    end = quicly_encode_ack_frame(buf, buf + sizeof(buf), &ranges, NULL, 63);
     ok(end - buf == 7);
     /* decode */
     src = buf + 1;
@@ -129,6 +129,21 @@ static void test_ack_encode(void)
     ok(decoded.ack_block_lengths[0] == 2);
     ok(decoded.gaps[0] == 1);
     ok(decoded.ack_block_lengths[1] == 1);
+    ok(decoded.ecn_counts.ce == 0);
+
+    { /* ACK_ECN */
+        quicly_ecn_counts_t counts = {100, 0, 5};
+        end = quicly_encode_ack_frame(buf, buf + sizeof(buf), &ranges, &counts, 63);
+        ok(end - buf == 11);
+        ok(buf[0] == QUICLY_FRAME_TYPE_ACK_ECN);
+        src = buf + 1;
+        ok(quicly_decode_ack_frame(&src, end, &decoded, 1) == 0);
+        ok(src == end);
+        ok(decoded.num_gaps == 1);
+        ok(decoded.ecn_counts.ect0 == 100);
+        ok(decoded.ecn_counts.ect1 == 0);
+        ok(decoded.ecn_counts.ce == 5);
+    }
 
     quicly_ranges_clear(&ranges);
 }
@@ -97,7 +97,7 @@ static void test_even(void)
         size_t num_packets;
         quicly_decoded_packet_t decoded;
 
-        ret = quicly_connect(&client, &quic_ctx, "example.com", (void *)"abc", 3, NULL, NULL);
+        ret = quicly_connect(&client, &quic_ctx, "example.com", (void *)"abc", 3, NULL, NULL, NULL);
         ok(ret == 0);
         num_packets = 1;
         ret = quicly_send(client, &raw, &num_packets);
@@ -119,7 +119,7 @@ static void test_even(void)
     ok(quicly_get_state(client) == QUICLY_STATE_CONNECTED);
     ok(!quicly_connection_is_ready(client));
 
-    quic_now += QUICLY_DELAYED_ACK_TIMEOUT;
+    quic_now += QUICLY_DELAYED_ACK_TIMEOUT * 1000;
 
     /* client sends delayed-ack that gets dropped */
     ret = transmit_cond(client, server, &num_sent, &num_received, cond_even_up, 0);
@@ -130,7 +130,7 @@ static void test_even(void)
     ok(quicly_get_state(client) == QUICLY_STATE_CONNECTED);
     ok(!quicly_connection_is_ready(client));
 
-    quic_now += 1000;
+    quic_now += 1000000;
 
     /* server resends the contents of all the packets (in cleartext) */
     ret = transmit_cond(server, client, &num_sent, &num_received, cond_even_down, 0);
@@ -140,7 +140,7 @@ static void test_even(void)
     ok(quicly_get_state(client) == QUICLY_STATE_CONNECTED);
     ok(!quicly_connection_is_ready(client));
 
-    quic_now += QUICLY_DELAYED_ACK_TIMEOUT;
+    quic_now += QUICLY_DELAYED_ACK_TIMEOUT * 1000;
 
     /* client sends delayed-ack that gets accepted */
     ret = transmit_cond(client, server, &num_sent, &num_received, cond_even_up, 0);
@@ -148,12 +148,13 @@ static void test_even(void)
     ok(num_sent == 1);
     ok(num_received == 1);
 
-    quic_now += 1000;
+    quic_now += 1000000;
 
-    /* server resends the contents of all the packets (in cleartext) */
+    /* the ACK for the Handshake packets says nothing about the Initial packet in flight, therefore the server hits RTO; it resends
+     * the lost Handshake data in the first packet, which gets accepted */
     ret = transmit_cond(server, client, &num_sent, &num_received, cond_even_down, 0);
     ok(ret == 0);
-    ok(num_sent == 1);
+    ok(num_sent == 2);
     ok(num_received == 1);
 
     ok(quicly_get_state(client) == QUICLY_STATE_CONNECTED);
@@ -190,19 +191,19 @@ static void loss_core(int downstream_only)
         size_t num_packets;
         quicly_decoded_packet_t decoded;
 
-        ret = quicly_connect(&client, &quic_ctx, "example.com", (void *)"abc", 3, NULL, NULL);
+        ret = quicly_connect(&client, &quic_ctx, "example.com", (void *)"abc", 3, NULL, NULL, NULL);
         ok(ret == 0);
         num_packets = 1;
         ret = quicly_send(client, &raw, &num_packets);
         ok(ret == 0);
         ok(num_packets == 1);
-        quic_now += 10;
+        quic_now += 10000;
         decode_packets(&decoded, &raw, 1, 8);
         ok(num_packets == 1);
         ret = quicly_accept(&server, &quic_ctx, (void *)"abc", 3, NULL, &decoded);
         ok(ret == 0);
         free_packets(&raw, 1);
-        quic_now += 10;
+        quic_now += 10000;
     }
 
     quicly_stream_t *client_stream = NULL, *server_stream = NULL;
@@ -213,13 +214,13 @@ static void loss_core(int downstream_only)
         int64_t client_timeout = quicly_get_first_timeout(client), server_timeout = quicly_get_first_timeout(server),
                 min_timeout = client_timeout < server_timeout ? client_timeout : server_timeout;
         assert(min_timeout != INT64_MAX);
-        assert(min_timeout == 0 || quic_now < min_timeout + 40); /* we might have spent two RTTs in the loop below */
+        assert(min_timeout == 0 || quic_now < min_timeout + 40000); /* we might have spent two RTTs in the loop below */
         if (quic_now < min_timeout)
             quic_now = min_timeout;
-        if ((ret = transmit_cond(server, client, &num_sent_down, &num_received, cond_rand, 10)) != 0)
+        if ((ret = transmit_cond(server, client, &num_sent_down, &num_received, cond_rand, 10000)) != 0)
             goto Fail;
         server_timeout = quicly_get_first_timeout(server);
-        assert(server_timeout > quic_now - 20);
+        assert(server_timeout > quic_now - 20000);
         if (quicly_get_state(client) == QUICLY_STATE_CONNECTED && quicly_connection_is_ready(client)) {
             if (client_stream == NULL) {
                 if ((ret = quicly_open_stream(client, &client_stream, 0)) != 0) {
@@ -235,10 +236,10 @@ static void loss_core(int downstream_only)
                 return;
             }
         }
-        if ((ret = transmit_cond(client, server, &num_sent_up, &num_received, downstream_only ? cond_true : cond_rand, 10)) != 0)
+        if ((ret = transmit_cond(client, server, &num_sent_up, &num_received, downstream_only ? cond_true : cond_rand, 10000)) != 0)
             goto Fail;
         client_timeout = quicly_get_first_timeout(client);
-        assert(client_timeout > quic_now - 20);
+        assert(client_timeout > quic_now - 20000);
         if (client_stream != NULL && (server_stream = quicly_get_stream(server, client_stream->stream_id)) != NULL) {
             if (server_streambuf == NULL && quicly_recvstate_transfer_complete(&server_stream->recvstate)) {
                 server_streambuf = server_stream->data;
@@ -313,9 +314,352 @@ static void test_bidirectional(void)
     }
 }
 
+static size_t num_datagrams_to_drop;
+
+static int cond_drop_leading(void)
+{
+    if (num_datagrams_to_drop == 0)
+        return 1;
+    --num_datagrams_to_drop;
+    return 0;
+}
+
+/**
+ * establishes a connection between `client` and `server`, and lets them exchange the ACKs so that nothing remains to be sent
+ */
+static void establish_connection(void)
+{
+    size_t num_rounds;
+    int ret;
+
+    quic_now = 0;
+
+    { /* transmit first flight */
+        quicly_datagram_t *raw;
+        size_t num_packets;
+        quicly_decoded_packet_t decoded;
+
+        ret = quicly_connect(&client, &quic_ctx, "example.com", (void *)"abc", 3, NULL, NULL, NULL);
+        ok(ret == 0);
+        num_packets = 1;
+        ret = quicly_send(client, &raw, &num_packets);
+        ok(ret == 0);
+        ok(num_packets == 1);
+        decode_packets(&decoded, &raw, 1, 8);
+        ret = quicly_accept(&server, &quic_ctx, (void *)"abc", 3, NULL, &decoded);
+        ok(ret == 0);
+        free_packets(&raw, 1);
+    }
+    for (num_rounds = 0; num_rounds < 10 && !quicly_connection_is_ready(client); ++num_rounds) {
+        transmit(server, client);
+        transmit(client, server);
+    }
+    ok(quicly_connection_is_ready(client));
+    quic_now += QUICLY_DELAYED_ACK_TIMEOUT * 1000;
+    transmit(server, client);
+    transmit(client, server);
+}
+
+/**
+ * Drops the first datagram of a flight and checks that the loss is detected once the datagrams sent after it are acknowledged,
+ * without waiting for the time threshold to elapse.
+ */
+static void test_packet_threshold(void)
+{
+    static char buf[8000];
+    quicly_stream_t *client_stream;
+    uint64_t num_received, num_sent, num_lost_before, num_lost_after, num_ack_received, num_bytes_sent;
+    size_t num_sent_up, num_received_up;
+    int ret;
+
+    establish_connection();
+
+    /* send a flight of datagrams, the first one being dropped */
+    ret = quicly_open_stream(client, &client_stream, 0);
+    ok(ret == 0);
+    memset(buf, 'A', sizeof(buf));
+    quicly_streambuf_egress_write(client_stream, buf, sizeof(buf));
+    quicly_get_packet_stats(client, &num_received, &num_sent, &num_lost_before, &num_ack_received, &num_bytes_sent);
+    num_datagrams_to_drop = 1;
+    ret = transmit_cond(client, server, &num_sent_up, &num_received_up, cond_drop_leading, 0);
+    ok(ret == 0);
+    ok(num_sent_up >= 5);
+    ok(num_received_up == num_sent_up - 1);
+
+    /* the loss is detected as soon as the ACK is received, while no time has elapsed */
+    transmit(server, client);
+    quicly_get_packet_stats(client, &num_received, &num_sent, &num_lost_after, &num_ack_received, &num_bytes_sent);
+    ok(num_lost_after == num_lost_before + 1);
+
+    quicly_free(client);
+    quicly_free(server);
+}
+
+/**
+ * Drops the only packet carrying a request and checks that the tail loss probe retransmits the request.
+ */
+static void test_tail_loss_probe(void)
+{
+    const char *req = "GET / HTTP/1.0\r\n\r\n";
+    quicly_stream_t *client_stream, *server_stream;
+    size_t num_sent_up, num_received_up;
+    int64_t timeout;
+    int ret;
+
+    establish_connection();
+
+    /* the request is lost */
+    ret = quicly_open_stream(client, &client_stream, 0);
+    ok(ret == 0);
+    quicly_streambuf_egress_write(client_stream, req, strlen(req));
+    quicly_streambuf_egress_shutdown(client_stream);
+    num_datagrams_to_drop = 1;
+    ret = transmit_cond(client, server, &num_sent_up, &num_received_up, cond_drop_leading, 0);
+    ok(ret == 0);
+    ok(num_sent_up == 1);
+    ok(num_received_up == 0);
+
+    /* the probe carries the request */
+    timeout = quicly_get_first_timeout(client);
+    ok(quic_now < timeout && timeout != INT64_MAX);
+    quic_now = timeout;
+    ret = transmit_cond(client, server, &num_sent_up, &num_received_up, cond_true, 0);
+    ok(ret == 0);
+    ok(num_sent_up == 1);
+    ok(num_received_up == 1);
+    server_stream = quicly_get_stream(server, client_stream->stream_id);
+    ok(server_stream != NULL);
+    ok(quicly_recvstate_transfer_complete(&server_stream->recvstate));
+
+    quicly_free(client);
+    quicly_free(server);
+}
+
+/**
+ * Drops the packet carrying all the data that the stream-level flow control permits, and checks that the tail loss probe
+ * retransmits the data rather than being spent on a PING.
+ */
+static void test_tail_loss_probe_stream_blocked(void)
+{
+    static char buf[3000];
+    quicly_max_stream_data_t orig_max_stream_data = quic_ctx.transport_params.max_stream_data;
+    quicly_stream_t *client_stream, *server_stream;
+    test_streambuf_t *server_streambuf;
+    size_t num_sent_up, num_received_up;
+    int64_t timeout;
+    int ret;
+
+    quic_ctx.transport_params.max_stream_data.bidi_local = 1000;
+    quic_ctx.transport_params.max_stream_data.bidi_remote = 1000;
+    establish_connection();
+
+    /* the stream is blocked by the stream-level flow control after sending the first 1000 bytes, which are lost */
+    ret = quicly_open_stream(client, &client_stream, 0);
+    ok(ret == 0);
+    memset(buf, 'A', sizeof(buf));
+    quicly_streambuf_egress_write(client_stream, buf, sizeof(buf));
+    num_datagrams_to_drop = 1;
+    ret = transmit_cond(client, server, &num_sent_up, &num_received_up, cond_drop_leading, 0);
+    ok(ret == 0);
+    ok(num_sent_up == 1);
+    ok(num_received_up == 0);
+
+    /* the probe carries the data */
+    timeout = quicly_get_first_timeout(client);
+    ok(quic_now < timeout && timeout != INT64_MAX);
+    quic_now = timeout;
+    ret = transmit_cond(client, server, &num_sent_up, &num_received_up, cond_true, 0);
+    ok(ret == 0);
+    ok(num_received_up >= 1);
+    server_stream = quicly_get_stream(server, client_stream->stream_id);
+    ok(server_stream != NULL);
+    if (server_stream != NULL) {
+        server_streambuf = server_stream->data;
+        ok(server_streambuf->super.ingress.off == 1000);
+    }
+
+    quicly_free(client);
+    quicly_free(server);
+    quic_ctx.transport_params.max_stream_data = orig_max_stream_data;
+}
+
+#define LONG_HAUL_MAX_DATA (128 * 1024 * 1024)
+
+static uint64_t long_haul_bytes_shifted;
+
+static uint8_t long_haul_pattern(uint64_t off)
+{
+    return 'A' + off % 26;
+}
+
+static void long_haul_on_destroy(quicly_stream_t *stream)
+{
+}
+
+static void long_haul_on_send_shift(quicly_stream_t *stream, size_t delta)
+{
+    long_haul_bytes_shifted += delta;
+}
+
+static int long_haul_on_send_emit(quicly_stream_t *stream, size_t off, void *dst, size_t *len, int *wrote_all)
+{
+    uint64_t abs_off = long_haul_bytes_shifted + off;
+    size_t i;
+
+    if (abs_off + *len >= LONG_HAUL_MAX_DATA) {
+        *len = LONG_HAUL_MAX_DATA - abs_off;
+        *wrote_all = 1;
+    } else {
+        *wrote_all = 0;
+    }
+    for (i = 0; i != *len; ++i)
+        ((uint8_t *)dst)[i] = long_haul_pattern(abs_off + i);
+
+    return 0;
+}
+
+static int long_haul_on_send_stop(quicly_stream_t *stream, uint16_t error_code)
+{
+    assert(!"unexpected");
+    return 0;
+}
+
+static int long_haul_on_receive(quicly_stream_t *stream, size_t off, const void *src, size_t len)
+{
+    uint64_t abs_off = stream->recvstate.data_off + off;
+    size_t i;
+
+    for (i = 0; i != len; ++i)
+        if (((const uint8_t *)src)[i] != long_haul_pattern(abs_off + i))
+            return QUICLY_ERROR_PROTOCOL_VIOLATION;
+
+    /* consume everything that has become contiguous */
+    if (stream->recvstate.received.ranges[0].end > stream->recvstate.data_off)
+        quicly_stream_sync_recvbuf(stream, stream->recvstate.received.ranges[0].end - stream->recvstate.data_off);
+
+    return 0;
+}
+
+static int long_haul_on_receive_reset(quicly_stream_t *stream, uint16_t error_code)
+{
+    assert(!"unexpected");
+    return 0;
+}
+
+static int long_haul_on_stream_open(quicly_stream_t *stream)
+{
+    static const quicly_stream_callbacks_t callbacks = {long_haul_on_destroy,   long_haul_on_send_shift,
+                                                        long_haul_on_send_emit, long_haul_on_send_stop,
+                                                        long_haul_on_receive,   long_haul_on_receive_reset};
+    stream->callbacks = &callbacks;
+    return 0;
+}
+
+/**
+ * Runs a bulk transfer in which the client acknowledges the packets once per round trip, until the server sends a flight of more
+ * than 32k packets, the distance from the largest acknowledged packet requiring packet numbers longer than 2 bytes. The client
+ * checks that the server switches to 2-byte and then 3-byte packet numbers, and that all the packets are decoded correctly.
+ */
+static void test_long_haul(void)
+{
+    quicly_transport_parameters_t orig_params = quic_ctx.transport_params;
+    quicly_stream_open_cb orig_on_stream_open = quic_ctx.on_stream_open;
+    size_t num_failed = 0, num_rounds, i;
+    int pn_len_seen[5] = {0};
+    quicly_stream_t *server_stream, *client_stream;
+    int ret;
+
+    quic_ctx.transport_params.max_stream_data.bidi_local = LONG_HAUL_MAX_DATA;
+    quic_ctx.transport_params.max_stream_data.bidi_remote = LONG_HAUL_MAX_DATA;
+    quic_ctx.transport_params.max_stream_data.uni = LONG_HAUL_MAX_DATA;
+    quic_ctx.transport_params.max_data = LONG_HAUL_MAX_DATA;
+    quic_ctx.on_stream_open = long_haul_on_stream_open;
+    long_haul_bytes_shifted = 0;
+
+    quic_now = 0;
+
+    { /* handshake */
+        quicly_datagram_t *raw;
+        size_t num_packets;
+        quicly_decoded_packet_t decoded;
+
+        ret = quicly_connect(&client, &quic_ctx, "example.com", (void *)"abc", 3, NULL, NULL, NULL);
+        ok(ret == 0);
+        num_packets = 1;
+        ret = quicly_send(client, &raw, &num_packets);
+        ok(ret == 0);
+        ok(num_packets == 1);
+        quic_now += 10000;
+        decode_packets(&decoded, &raw, 1, 8);
+        ret = quicly_accept(&server, &quic_ctx, (void *)"abc", 3, NULL, &decoded);
+        ok(ret == 0);
+        free_packets(&raw, 1);
+        quic_now += 10000;
+        transmit(server, client);
+        quic_now += 10000;
+        transmit(client, server);
+        quic_now += 10000;
+        ok(quicly_connection_is_ready(client));
+    }
+
+    /* server opens a stream and sends as much as it can */
+    ret = quicly_open_stream(server, &server_stream, 0);
+    ok(ret == 0);
+    quicly_sendstate_shutdown(&server_stream->sendstate, LONG_HAUL_MAX_DATA);
+    quicly_stream_sync_sendbuf(server_stream, 1);
+
+    for (num_rounds = 0; num_rounds < 20 && !pn_len_seen[3]; ++num_rounds) {
+        /* the server sends the entire congestion window, which is delivered to the client in order */
+        while (1) {
+            quicly_datagram_t *datagrams[32];
+            size_t num_datagrams = sizeof(datagrams) / sizeof(datagrams[0]);
+            ret = quicly_send(server, datagrams, &num_datagrams);
+            ok(ret == 0);
+            if (ret != 0 || num_datagrams == 0)
+                break;
+            for (i = 0; i != num_datagrams; ++i) {
+                quicly_decoded_packet_t decoded[4];
+                size_t num_decoded = decode_packets(decoded, datagrams + i, 1, 0), j;
+                assert(num_decoded != 0);
+                for (j = 0; j != num_decoded; ++j) {
+                    if (quicly_receive(client, decoded + j) != 0) {
+                        ++num_failed;
+                        continue;
+                    }
+                    /* header protection has been removed by quicly_receive */
+                    if (decoded[j].version == 0)
+                        pn_len_seen[(decoded[j].octets.base[0] & 0x3) + 1] = 1;
+                }
+            }
+            free_packets(datagrams, num_datagrams);
+        }
+        quic_now += QUICLY_DELAYED_ACK_TIMEOUT * 1000;
+        /* client acks */
+        transmit(client, server);
+        quic_now += 10000;
+    }
+
+    ok(pn_len_seen[1]);
+    ok(pn_len_seen[2]);
+    ok(pn_len_seen[3]);
+    ok(num_failed == 0);
+    client_stream = quicly_get_stream(client, server_stream->stream_id);
+    ok(client_stream != NULL);
+    ok(client_stream->recvstate.data_off == long_haul_bytes_shifted);
+
+    quicly_free(client);
+    quicly_free(server);
+    quic_ctx.transport_params = orig_params;
+    quic_ctx.on_stream_open = orig_on_stream_open;
+}
+
 void test_loss(void)
 {
     subtest("even", test_even);
+    subtest("packet-threshold", test_packet_threshold);
+    subtest("tail-loss-probe", test_tail_loss_probe);
+    subtest("tail-loss-probe-stream-blocked", test_tail_loss_probe_stream_blocked);
     subtest("downstream", test_downstream);
     subtest("bidirectional", test_bidirectional);
+    subtest("long-haul", test_long_haul);
 }
@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2019 Fastly, Kazuho Oku
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#include "quicly/pacer.h"
+#include "test.h"
+
+void test_pacer(void)
+{
+    static const quicly_pacer_conf_t conf = {1024, 4};
+    quicly_pacer_t pacer;
+    uint64_t rate;
+    int64_t burst;
+    int i;
+
+    /* 10 packets per 100ms, allowing 4-packet bursts */
+    rate = quicly_pacer_calc_rate(&conf, 10000, 100000);
+    ok(rate == 100);
+    burst = quicly_pacer_calc_burst(&conf, rate, 1000);
+    ok(burst == 4000);
+    ok(quicly_pacer_calc_rate(&conf, 10, 100000) == 1);
+    ok(quicly_pacer_calc_rate(&conf, 10000, 200) == 50000);
+    ok(quicly_pacer_calc_burst(&conf, 10000, 1000) == 20000);
+
+    /* an idle pacer allows a burst */
+    quicly_pacer_init(&pacer);
+    quicly_pacer_update(&pacer, 1000000, rate, burst);
+    ok(pacer.credit == burst);
+    ok(quicly_pacer_get_send_at(&pacer, rate, burst, 1000) == 1000000);
+    quicly_pacer_consume(&pacer, 3500);
+    ok(quicly_pacer_get_send_at(&pacer, rate, burst, 1000) == 1005000);
+    quicly_pacer_consume(&pacer, 1000);
+    ok(pacer.credit == -500);
+    ok(quicly_pacer_get_send_at(&pacer, rate, burst, 1000) == 1015000);
+
+    /* refilled at the pacing rate */
+    quicly_pacer_update(&pacer, 1010000, rate, burst);
+    ok(pacer.credit == 500);
+    quicly_pacer_update(&pacer, 1010000, rate, burst);
+    ok(pacer.credit == 500);
+    quicly_pacer_update(&pacer, 1015000, rate, burst);
+    ok(pacer.credit == 1000);
+    ok(quicly_pacer_get_send_at(&pacer, rate, burst, 1000) == 1015000);
+
+    /* fractions of a byte are not lost when the pacer is updated at short intervals */
+    for (i = 1; i <= 100; ++i)
+        quicly_pacer_update(&pacer, 1015000 + i * 5, rate, burst);
+    ok(pacer.credit == 1050);
+
+    /* but not beyond the burst size */
+    quicly_pacer_update(&pacer, 1100000, rate, burst);
+    ok(pacer.credit == burst);
+    quicly_pacer_update(&pacer, 100000000, rate, burst);
+    ok(pacer.credit == burst);
+
+    /* departure times, used when pacing is offloaded */
+    ok(quicly_pacer_get_send_at(&pacer, rate, burst, 1000) == 100000000);
+    quicly_pacer_consume(&pacer, 4500);
+    ok(quicly_pacer_get_send_at(&pacer, rate, burst, 1000) == 100015000);
+}
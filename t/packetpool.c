@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2019 Fastly, Kazuho Oku
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#include <netinet/in.h>
+#include "quicly/packetpool.h"
+#include "test.h"
+
+void test_packetpool(void)
+{
+    quicly_packet_pool_stats_t stats;
+    quicly_datagram_t *p1, *p2, *p3;
+    uint64_t base_allocs, base_hits;
+    size_t base_in_use;
+
+    quicly_packet_pool_clear();
+    quicly_packet_pool_get_stats(&stats);
+    base_allocs = stats.num_allocs;
+    base_hits = stats.num_hits;
+    base_in_use = stats.num_in_use;
+
+    /* the first allocations miss */
+    p1 = quicly_pooled_alloc_packet(&quic_ctx, sizeof(struct sockaddr_in), 1280);
+    p2 = quicly_pooled_alloc_packet(&quic_ctx, sizeof(struct sockaddr_in), 1280);
+    ok(p1 != NULL);
+    ok(p2 != NULL);
+    ok(p1 != p2);
+    ok(((uintptr_t)p1 & 63) == 0);
+    ok(p1->data.base == (uint8_t *)&p1->sa + sizeof(struct sockaddr_in));
+    memset(p1->data.base, 0x55, 1280);
+    quicly_packet_pool_get_stats(&stats);
+    ok(stats.num_allocs - base_allocs == 2);
+    ok(stats.num_hits - base_hits == 0);
+    ok(stats.num_in_use - base_in_use == 2);
+    ok(stats.peak_in_use >= 2);
+
+    /* freed slots are reused */
+    quicly_pooled_free_packet(&quic_ctx, p1);
+    quicly_packet_pool_get_stats(&stats);
+    ok(stats.bytes_cached != 0);
+    p3 = quicly_pooled_alloc_packet(&quic_ctx, sizeof(struct sockaddr_in), 1000);
+    ok(p3 == p1);
+    quicly_packet_pool_get_stats(&stats);
+    ok(stats.num_hits - base_hits == 1);
+    ok(stats.bytes_cached == 0);
+
+    /* slots of a different size are not */
+    p1 = quicly_pooled_alloc_packet(&quic_ctx, sizeof(struct sockaddr_in), 1280 * 10);
+    ok(p1 != NULL);
+    ok(p1 != p2 && p1 != p3);
+    quicly_packet_pool_get_stats(&stats);
+    ok(stats.num_hits - base_hits == 1);
+
+    /* allocations larger than the largest slot size are served by malloc */
+    quicly_pooled_free_packet(&quic_ctx, p1);
+    p1 = quicly_pooled_alloc_packet(&quic_ctx, sizeof(struct sockaddr_in), 1024 * 1024);
+    ok(p1 != NULL);
+    memset(p1->data.base, 0x55, 1024 * 1024);
+    quicly_pooled_free_packet(&quic_ctx, p1);
+
+    quicly_pooled_free_packet(&quic_ctx, p2);
+    quicly_pooled_free_packet(&quic_ctx, p3);
+    quicly_packet_pool_get_stats(&stats);
+    ok(stats.num_in_use == base_in_use);
+    quicly_packet_pool_clear();
+    quicly_packet_pool_get_stats(&stats);
+    ok(stats.bytes_cached == 0);
+}
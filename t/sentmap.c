@@ -33,6 +33,12 @@ static int on_acked(struct st_quicly_conn_t *conn, const quicly_sent_packet_t *p
     return 0;
 }
 
+static void allocate_callback(quicly_sentmap_t *map)
+{
+    quicly_sent_t *sent = quicly_sentmap_allocate(map, QUICLY_SENT_TYPE_CALLBACK);
+    sent->data.callback.acked = on_acked;
+}
+
 static size_t num_blocks(quicly_sentmap_t *map)
 {
     struct st_quicly_sent_block_t *block;
@@ -44,7 +50,7 @@ static size_t num_blocks(quicly_sentmap_t *map)
     return n;
 }
 
-void test_sentmap(void)
+static void test_basic(void)
 {
     quicly_sentmap_t map;
     uint64_t at;
@@ -52,14 +58,14 @@ void test_sentmap(void)
     quicly_sentmap_iter_t iter;
     const quicly_sent_packet_t *sent;
 
-    quicly_sentmap_init(&map);
+    quicly_sentmap_init(&map, NULL);
 
     /* save 50 packets, with 2 frames each */
     for (at = 0; at < 10; ++at) {
         for (i = 1; i <= 5; ++i) {
             quicly_sentmap_prepare(&map, at * 5 + i, at, 0);
-            quicly_sentmap_allocate(&map, on_acked);
-            quicly_sentmap_allocate(&map, on_acked);
+            allocate_callback(&map);
+            allocate_callback(&map);
             quicly_sentmap_commit(&map, 1);
         }
     }
@@ -77,7 +83,8 @@ void test_sentmap(void)
         }
     }
     ok(quicly_sentmap_get(&iter)->packet_number == UINT64_MAX);
-    ok(num_blocks(&map) == 150 / 16 + 1);
+    /* each packet occupies 7 words, therefore a block contains 9 packets */
+    ok(num_blocks(&map) == 6);
 
     /* pop acks between 11 <= packet_number <= 40 */
     quicly_sentmap_init_iter(&map, &iter);
@@ -97,7 +104,202 @@ void test_sentmap(void)
         ++cnt;
     }
     ok(cnt == 20);
-    ok(num_blocks(&map) == 30 / 16 + 1 + 1 + 30 / 16 + 1);
+    ok(num_blocks(&map) == 4);
+
+    quicly_sentmap_dispose(&map);
+}
+
+static void test_find(void)
+{
+    quicly_sentmap_t map;
+    quicly_sentmap_iter_t iter;
+    uint64_t pn;
+    size_t num_failed = 0;
+
+    quicly_sentmap_init(&map, NULL);
+
+    /* save 1000 packets with a gap in the packet numbers, so that the index is expanded a couple of times */
+    for (pn = 1; pn <= 1000; ++pn) {
+        if (pn == 500)
+            continue;
+        quicly_sentmap_prepare(&map, pn, pn, 0);
+        allocate_callback(&map);
+        quicly_sentmap_commit(&map, 1);
+    }
+
+    quicly_sentmap_find(&map, &iter, 0);
+    ok(quicly_sentmap_get(&iter)->packet_number == 1);
+    for (pn = 1; pn <= 1000; ++pn) {
+        quicly_sentmap_find(&map, &iter, pn);
+        if (quicly_sentmap_get(&iter)->packet_number != (pn == 500 ? 501 : pn))
+            ++num_failed;
+    }
+    ok(num_failed == 0);
+    quicly_sentmap_find(&map, &iter, 1001);
+    ok(quicly_sentmap_get(&iter)->packet_number == UINT64_MAX);
+
+    /* ack 100..899, in reverse order */
+    on_acked_ackcnt = 0;
+    for (pn = 899; pn >= 100; --pn) {
+        quicly_sentmap_find(&map, &iter, pn);
+        if (quicly_sentmap_get(&iter)->packet_number == pn)
+            quicly_sentmap_update(&map, &iter, QUICLY_SENTMAP_EVENT_ACKED, NULL);
+    }
+    ok(on_acked_ackcnt == 799);
+    quicly_sentmap_find(&map, &iter, 100);
+    ok(quicly_sentmap_get(&iter)->packet_number == 900);
+    quicly_sentmap_skip(&iter);
+    ok(quicly_sentmap_get(&iter)->packet_number == 901);
+    quicly_sentmap_find(&map, &iter, 99);
+    ok(quicly_sentmap_get(&iter)->packet_number == 99);
+    quicly_sentmap_skip(&iter);
+    ok(quicly_sentmap_get(&iter)->packet_number == 900);
+
+    /* ack the rest by iterating from the front */
+    quicly_sentmap_init_iter(&map, &iter);
+    while (quicly_sentmap_get(&iter)->packet_number != UINT64_MAX)
+        quicly_sentmap_update(&map, &iter, QUICLY_SENTMAP_EVENT_ACKED, NULL);
+    ok(on_acked_ackcnt == 999);
+    ok(map.head == NULL);
+    ok(map.bytes_in_flight == 0);
+
+    /* the index is reused once the map becomes empty */
+    quicly_sentmap_prepare(&map, 5000, 5000, 0);
+    quicly_sentmap_commit(&map, 1);
+    quicly_sentmap_find(&map, &iter, 0);
+    ok(quicly_sentmap_get(&iter)->packet_number == 5000);
+
+    quicly_sentmap_dispose(&map);
 
+    /* fill the index up to its capacity so that the ring wraps around, then look up beyond the last packet being tracked */
+    quicly_sentmap_init(&map, NULL);
+    for (pn = 10; pn < 74; ++pn) {
+        quicly_sentmap_prepare(&map, pn, pn, 0);
+        allocate_callback(&map);
+        quicly_sentmap_commit(&map, 1);
+    }
+    for (pn = 72; pn < 74; ++pn) {
+        quicly_sentmap_find(&map, &iter, pn);
+        quicly_sentmap_update(&map, &iter, QUICLY_SENTMAP_EVENT_ACKED, NULL);
+    }
+    quicly_sentmap_find(&map, &iter, 71);
+    ok(quicly_sentmap_get(&iter)->packet_number == 71);
+    quicly_sentmap_find(&map, &iter, 72);
+    ok(quicly_sentmap_get(&iter)->packet_number == UINT64_MAX);
     quicly_sentmap_dispose(&map);
 }
+
+static int on_stream_acked(struct st_quicly_conn_t *conn, const quicly_sent_packet_t *packet, quicly_sent_t *sent,
+                           quicly_sentmap_event_t event)
+{
+    if (sent->data.stream.stream_id == 4 && sent->data.stream.start == packet->packet_number * 1000 &&
+        sent->data.stream.length == 1000)
+        ++on_acked_ackcnt;
+    return 0;
+}
+
+static void test_records(void)
+{
+    static const quicly_sent_acked_cb callbacks[QUICLY_SENT__NUM_TYPES] = {[QUICLY_SENT_TYPE_STREAM] = on_stream_acked};
+    quicly_sentmap_t map;
+    quicly_sentmap_iter_t iter;
+    quicly_sent_t *sent;
+    uint64_t pn;
+
+    /* small records are packed */
+    ok(quicly_sentmap__num_words[QUICLY_SENT_TYPE_PACKET] == 3);
+    ok(quicly_sentmap__num_words[QUICLY_SENT_TYPE_ACK] == 3);
+    ok(quicly_sentmap__num_words[QUICLY_SENT_TYPE_STREAM] == 3);
+    ok(quicly_sentmap__num_words[QUICLY_SENT_TYPE_MAX_DATA] == 2);
+    ok(quicly_sentmap__num_words[QUICLY_SENT_TYPE_MAX_STREAMS] == 2);
+    ok(quicly_sentmap__num_words[QUICLY_SENT_TYPE_RST_STREAM] == 2);
+    ok(quicly_sentmap__num_words[QUICLY_SENT_TYPE_PMTU_PROBE] == 1);
+
+    /* save 100 packets each carrying one STREAM frame; a block contains 10 of them */
+    quicly_sentmap_init(&map, callbacks);
+    for (pn = 0; pn < 100; ++pn) {
+        quicly_sentmap_prepare(&map, pn, 0, 0);
+        sent = quicly_sentmap_allocate(&map, QUICLY_SENT_TYPE_STREAM);
+        sent->data.stream.stream_id = 4;
+        sent->data.stream.start = pn * 1000;
+        sent->data.stream.length = 1000;
+        quicly_sentmap_commit(&map, 1);
+    }
+    ok(num_blocks(&map) == 10);
+
+    /* the events are dispatched by type */
+    on_acked_ackcnt = 0;
+    quicly_sentmap_init_iter(&map, &iter);
+    while (quicly_sentmap_get(&iter)->packet_number != UINT64_MAX)
+        quicly_sentmap_update(&map, &iter, QUICLY_SENTMAP_EVENT_ACKED, NULL);
+    ok(on_acked_ackcnt == 100);
+    ok(map.head == NULL);
+
+    quicly_sentmap_dispose(&map);
+}
+
+static void test_pool(void)
+{
+    quicly_sentmap_pool_stats_t stats;
+    quicly_sentmap_t map;
+    quicly_sentmap_iter_t iter;
+    uint64_t base_allocs, base_hits, pn;
+    size_t base_in_use, blocks;
+
+    quicly_sentmap_pool_clear();
+    quicly_sentmap_pool_get_stats(&stats);
+    base_allocs = stats.num_allocs;
+    base_hits = stats.num_hits;
+    base_in_use = stats.num_in_use;
+    ok(stats.num_cached == 0);
+
+    /* the first allocations miss */
+    quicly_sentmap_init(&map, NULL);
+    for (pn = 0; pn < 100; ++pn) {
+        quicly_sentmap_prepare(&map, pn, 0, 0);
+        allocate_callback(&map);
+        quicly_sentmap_commit(&map, 1);
+    }
+    blocks = num_blocks(&map);
+    quicly_sentmap_pool_get_stats(&stats);
+    ok(stats.num_allocs - base_allocs == blocks);
+    ok(stats.num_hits - base_hits == 0);
+    ok(stats.num_in_use - base_in_use == blocks);
+    ok(stats.peak_in_use >= blocks);
+
+    /* blocks emptied by acks return to the pool */
+    quicly_sentmap_init_iter(&map, &iter);
+    while (quicly_sentmap_get(&iter)->packet_number < 50)
+        quicly_sentmap_update(&map, &iter, QUICLY_SENTMAP_EVENT_ACKED, NULL);
+    quicly_sentmap_pool_get_stats(&stats);
+    ok(stats.num_cached == blocks - num_blocks(&map));
+    ok(stats.num_in_use - base_in_use == num_blocks(&map));
+    quicly_sentmap_dispose(&map);
+    quicly_sentmap_pool_get_stats(&stats);
+    ok(stats.num_cached == blocks);
+    ok(stats.num_in_use == base_in_use);
+
+    /* and are reused by the next map */
+    quicly_sentmap_init(&map, NULL);
+    for (pn = 0; pn < 100; ++pn) {
+        quicly_sentmap_prepare(&map, pn, 0, 0);
+        allocate_callback(&map);
+        quicly_sentmap_commit(&map, 1);
+    }
+    quicly_sentmap_pool_get_stats(&stats);
+    ok(stats.num_hits - base_hits == blocks);
+    ok(stats.num_cached == 0);
+    quicly_sentmap_dispose(&map);
+
+    quicly_sentmap_pool_clear();
+    quicly_sentmap_pool_get_stats(&stats);
+    ok(stats.num_cached == 0);
+}
+
+void test_sentmap(void)
+{
+    subtest("basic", test_basic);
+    subtest("find", test_find);
+    subtest("records", test_records);
+    subtest("pool", test_pool);
+}
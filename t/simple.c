@@ -19,6 +19,7 @@
  * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
  * IN THE SOFTWARE.
  */
+#include <pthread.h>
 #include <string.h>
 #include "quicly/streambuf.h"
 #include "test.h"
@@ -33,7 +34,7 @@ static void test_handshake(void)
     int ret, i;
 
     /* send CH */
-    ret = quicly_connect(&client, &quic_ctx, "example.com", (void *)"abc", 3, NULL, NULL);
+    ret = quicly_connect(&client, &quic_ctx, "example.com", (void *)"abc", 3, NULL, NULL, NULL);
     ok(ret == 0);
     num_packets = sizeof(packets) / sizeof(packets[0]);
     ret = quicly_send(client, packets, &num_packets);
@@ -101,7 +102,7 @@ static void simple_http(void)
     ok(quicly_num_streams(client) == 1);
     ok(!server_streambuf->is_detached);
 
-    quic_now += QUICLY_DELAYED_ACK_TIMEOUT;
+    quic_now += QUICLY_DELAYED_ACK_TIMEOUT * 1000;
     transmit(client, server);
 
     ok(server_streambuf->is_detached);
@@ -135,7 +136,7 @@ static void test_rst_then_close(void)
     ok(server_streambuf->error_received.reset_stream == 12345);
     ok(server_streambuf->error_received.stop_sending == 54321);
 
-    quic_now += QUICLY_DELAYED_ACK_TIMEOUT;
+    quic_now += QUICLY_DELAYED_ACK_TIMEOUT * 1000;
     transmit(server, client);
 
     /* client closes the stream */
@@ -144,7 +145,7 @@ static void test_rst_then_close(void)
     ok(client_streambuf->error_received.reset_stream == 54321);
     ok(quicly_num_streams(client) == 1);
 
-    quic_now += QUICLY_DELAYED_ACK_TIMEOUT;
+    quic_now += QUICLY_DELAYED_ACK_TIMEOUT * 1000;
     transmit(client, server);
 
     ok(server_streambuf->is_detached);
@@ -170,7 +171,7 @@ static void test_send_then_close(void)
     ok(buffer_is(&server_streambuf->super.ingress, "hello"));
     quicly_streambuf_ingress_shift(server_stream, 5);
 
-    quic_now += QUICLY_DELAYED_ACK_TIMEOUT;
+    quic_now += QUICLY_DELAYED_ACK_TIMEOUT * 1000;
     transmit(server, client);
 
     ok(client_stream->sendstate.acked.num_ranges == 1);
@@ -189,7 +190,7 @@ static void test_send_then_close(void)
     ok(client_streambuf->is_detached);
     ok(!server_streambuf->is_detached);
 
-    quic_now += QUICLY_DELAYED_ACK_TIMEOUT;
+    quic_now += QUICLY_DELAYED_ACK_TIMEOUT * 1000;
     transmit(client, server);
 
     ok(server_streambuf->is_detached);
@@ -207,7 +208,7 @@ static void test_reset_after_close(void)
     quicly_streambuf_egress_write(client_stream, "hello", 5);
 
     transmit(client, server);
-    quic_now += QUICLY_DELAYED_ACK_TIMEOUT;
+    quic_now += QUICLY_DELAYED_ACK_TIMEOUT * 1000;
     transmit(server, client);
 
     server_stream = quicly_get_stream(server, client_stream->stream_id);
@@ -232,7 +233,7 @@ static void test_reset_after_close(void)
 
     ok(client_streambuf->is_detached);
 
-    quic_now += QUICLY_DELAYED_ACK_TIMEOUT;
+    quic_now += QUICLY_DELAYED_ACK_TIMEOUT * 1000;
     transmit(client, server);
 
     ok(server_streambuf->is_detached);
@@ -296,7 +297,7 @@ static void tiny_stream_window(void)
     ok(quicly_num_streams(client) == 1);
     ok(quicly_num_streams(server) == 2);
 
-    quic_now += QUICLY_DELAYED_ACK_TIMEOUT;
+    quic_now += QUICLY_DELAYED_ACK_TIMEOUT * 1000;
     transmit(client, server);
 
     /* server should have recieved ACK to the RST_STREAM it has sent */
@@ -378,7 +379,7 @@ static void test_rst_during_loss(void)
     ok(client_streambuf->is_detached);
     ok(quicly_num_streams(client) == 1);
     ok(quicly_num_streams(server) == 2);
-    quic_now += QUICLY_DELAYED_ACK_TIMEOUT;
+    quic_now += QUICLY_DELAYED_ACK_TIMEOUT * 1000;
     transmit(client, server);
     ok(server_streambuf->is_detached);
     ok(quicly_num_streams(server) == 1);
@@ -421,7 +422,7 @@ static void test_close(void)
     ret = quicly_send(client, &datagram, &num_datagrams);
     assert(num_datagrams == 1);
     client_timeout = quicly_get_first_timeout(client);
-    ok(quic_now < client_timeout && client_timeout < quic_now + 1000); /* 3 pto or something */
+    ok(quic_now < client_timeout && client_timeout < quic_now + 1000000); /* 3 pto or something */
 
     { /* server receives close */
         quicly_decoded_packet_t decoded;
@@ -431,7 +432,7 @@ static void test_close(void)
         ok(test_close_error_code == 12345);
         ok(quicly_get_state(server) == QUICLY_STATE_DRAINING);
         server_timeout = quicly_get_first_timeout(server);
-        ok(quic_now < server_timeout && server_timeout < quic_now + 1000); /* 3 pto or something */
+        ok(quic_now < server_timeout && server_timeout < quic_now + 1000000); /* 3 pto or something */
     }
 
     /* nothing sent by the server in response */
@@ -475,7 +476,7 @@ static void tiny_connection_window(void)
         size_t num_packets;
         quicly_decoded_packet_t decoded;
 
-        ret = quicly_connect(&client, &quic_ctx, "example.com", (void *)"abc", 3, NULL, NULL);
+        ret = quicly_connect(&client, &quic_ctx, "example.com", (void *)"abc", 3, NULL, NULL, NULL);
         ok(ret == 0);
         num_packets = 1;
         ret = quicly_send(client, &raw, &num_packets);
@@ -514,7 +515,7 @@ static void tiny_connection_window(void)
         quicly_streambuf_ingress_shift(server_stream, strlen(testdata));
     }
 
-    quic_now += QUICLY_DELAYED_ACK_TIMEOUT;
+    quic_now += QUICLY_DELAYED_ACK_TIMEOUT * 1000;
     transmit(server, client);
 
     ok(client_streambuf->super.egress.buf.off == 0);
@@ -522,6 +523,966 @@ static void tiny_connection_window(void)
     quic_ctx.transport_params.max_data = max_data_orig;
 }
 
+static void transmit_batch(quicly_conn_t *src, quicly_conn_t *dst)
+{
+    quicly_datagram_t *datagrams[32];
+    quicly_decoded_packet_t decoded[32];
+    size_t num_datagrams, num_packets;
+    int ret;
+
+    num_datagrams = sizeof(datagrams) / sizeof(datagrams[0]);
+    ret = quicly_send(src, datagrams, &num_datagrams);
+    ok(ret == 0);
+    num_packets = decode_packets(decoded, datagrams, num_datagrams, quicly_is_client(dst) ? 0 : 8);
+    ret = quicly_receive_batch(dst, decoded, num_packets);
+    ok(ret == 0);
+    free_packets(datagrams, num_datagrams);
+}
+
+static void test_receive_batch(void)
+{
+    quicly_conn_t *client, *server;
+    quicly_stream_t *client_stream, *server_stream;
+    test_streambuf_t *client_streambuf, *server_streambuf;
+    char testdata[6001];
+    int ret;
+
+    memset(testdata, 'A', sizeof(testdata) - 1);
+    testdata[sizeof(testdata) - 1] = '\0';
+
+    { /* handshake */
+        quicly_datagram_t *raw;
+        size_t num_packets = 1;
+        quicly_decoded_packet_t decoded;
+        ret = quicly_connect(&client, &quic_ctx, "example.com", (void *)"abc", 3, NULL, NULL, NULL);
+        ok(ret == 0);
+        ret = quicly_send(client, &raw, &num_packets);
+        ok(ret == 0);
+        ok(num_packets == 1);
+        decode_packets(&decoded, &raw, 1, 8);
+        ret = quicly_accept(&server, &quic_ctx, (void *)"abc", 3, NULL, &decoded);
+        ok(ret == 0);
+        free_packets(&raw, 1);
+    }
+    transmit_batch(server, client);
+    ok(quicly_connection_is_ready(client));
+
+    /* client sends a request, server responds with multiple packets that are received at once */
+    ret = quicly_open_stream(client, &client_stream, 0);
+    ok(ret == 0);
+    client_streambuf = client_stream->data;
+    quicly_streambuf_egress_write(client_stream, "GET", 3);
+    quicly_streambuf_egress_shutdown(client_stream);
+    transmit_batch(client, server);
+    server_stream = quicly_get_stream(server, client_stream->stream_id);
+    ok(server_stream != NULL);
+    server_streambuf = server_stream->data;
+    ok(buffer_is(&server_streambuf->super.ingress, "GET"));
+    quicly_streambuf_egress_write(server_stream, testdata, strlen(testdata));
+    quicly_streambuf_egress_shutdown(server_stream);
+
+    transmit_batch(server, client);
+    ok(buffer_is(&client_streambuf->super.ingress, testdata));
+    ok(client_streambuf->is_detached);
+
+    /* server receives the ACKs in one batch */
+    quic_now += QUICLY_DELAYED_ACK_TIMEOUT * 1000;
+    transmit_batch(client, server);
+    ok(server_streambuf->is_detached);
+
+    quicly_free(client);
+    quicly_free(server);
+}
+
+static void test_gso(void)
+{
+    quicly_stream_t *client_stream, *server_stream;
+    test_streambuf_t *client_streambuf;
+    quicly_datagram_t *datagrams[32];
+    quicly_decoded_packet_t decoded[64];
+    size_t num_datagrams, num_packets, i;
+    char testdata[6001];
+    int ret;
+
+    memset(testdata, 'A', sizeof(testdata) - 1);
+    testdata[sizeof(testdata) - 1] = '\0';
+
+    quic_ctx.max_gso_segments = 4;
+
+    { /* handshake */
+        quicly_datagram_t *raw;
+        size_t num_packets = 1;
+        ret = quicly_connect(&client, &quic_ctx, "example.com", (void *)"abc", 3, NULL, NULL, NULL);
+        ok(ret == 0);
+        ret = quicly_send(client, &raw, &num_packets);
+        ok(ret == 0);
+        ok(num_packets == 1);
+        ok(raw->segment_size == 0);
+        decode_packets(decoded, &raw, 1, 8);
+        ret = quicly_accept(&server, &quic_ctx, (void *)"abc", 3, NULL, decoded);
+        ok(ret == 0);
+        free_packets(&raw, 1);
+    }
+    transmit(server, client);
+    ok(quicly_connection_is_ready(client));
+
+    ret = quicly_open_stream(client, &client_stream, 0);
+    ok(ret == 0);
+    client_streambuf = client_stream->data;
+    quicly_streambuf_egress_write(client_stream, "GET", 3);
+    quicly_streambuf_egress_shutdown(client_stream);
+    transmit(client, server);
+    server_stream = quicly_get_stream(server, client_stream->stream_id);
+    ok(server_stream != NULL);
+    quicly_streambuf_egress_write(server_stream, testdata, strlen(testdata));
+    quicly_streambuf_egress_shutdown(server_stream);
+
+    /* the response is sent using GSO; every segment but the last one is full-sized */
+    num_datagrams = sizeof(datagrams) / sizeof(datagrams[0]);
+    ret = quicly_send(server, datagrams, &num_datagrams);
+    ok(ret == 0);
+    for (i = 0; i != num_datagrams; ++i)
+        if (datagrams[i]->segment_size != 0)
+            break;
+    ok(i != num_datagrams);
+    if (i != num_datagrams) {
+        ok(datagrams[i]->segment_size == quic_ctx.max_packet_size);
+        ok(datagrams[i]->data.len > quic_ctx.max_packet_size);
+        ok(datagrams[i]->data.len <= quic_ctx.max_packet_size * quic_ctx.max_gso_segments);
+    }
+    num_packets = decode_packets(decoded, datagrams, num_datagrams, 0);
+    ok(num_packets > num_datagrams);
+    for (i = 0; i != num_packets; ++i) {
+        ret = quicly_receive(client, decoded + i);
+        ok(ret == 0);
+    }
+    free_packets(datagrams, num_datagrams);
+    ok(buffer_is(&client_streambuf->super.ingress, testdata));
+
+    quic_ctx.max_gso_segments = 0;
+}
+
+/**
+ * GSO datagrams are capped at the maximum UDP payload size, even if max_gso_segments permits more
+ */
+static void test_gso_limit(void)
+{
+    quicly_stream_t *client_stream, *server_stream;
+    test_streambuf_t *client_streambuf;
+    quicly_datagram_t *datagrams[8];
+    static quicly_decoded_packet_t decoded[8 * 64];
+    size_t num_datagrams, num_packets, num_rounds, max_len = 0, i;
+    static char testdata[1000001];
+    int64_t at;
+    int ret;
+
+    memset(testdata, 'A', sizeof(testdata) - 1);
+    testdata[sizeof(testdata) - 1] = '\0';
+
+    quic_ctx.max_gso_segments = 64;
+    ok((size_t)quic_ctx.max_gso_segments * quic_ctx.max_packet_size > QUICLY_MAX_UDP_PAYLOAD_SIZE);
+
+    { /* handshake */
+        quicly_datagram_t *raw;
+        size_t num_packets = 1;
+        ret = quicly_connect(&client, &quic_ctx, "example.com", (void *)"abc", 3, NULL, NULL, NULL);
+        ok(ret == 0);
+        ret = quicly_send(client, &raw, &num_packets);
+        ok(ret == 0);
+        decode_packets(decoded, &raw, 1, 8);
+        ret = quicly_accept(&server, &quic_ctx, (void *)"abc", 3, NULL, decoded);
+        ok(ret == 0);
+        free_packets(&raw, 1);
+    }
+    transmit(server, client);
+    ok(quicly_connection_is_ready(client));
+
+    ret = quicly_open_stream(client, &client_stream, 0);
+    ok(ret == 0);
+    client_streambuf = client_stream->data;
+    quicly_streambuf_egress_write(client_stream, "GET", 3);
+    quicly_streambuf_egress_shutdown(client_stream);
+    transmit(client, server);
+    server_stream = quicly_get_stream(server, client_stream->stream_id);
+    ok(server_stream != NULL);
+    quicly_streambuf_egress_write(server_stream, testdata, strlen(testdata));
+    quicly_streambuf_egress_shutdown(server_stream);
+
+    /* as the CWND grows, the datagrams grow up to the limit */
+    for (num_rounds = 0; num_rounds < 100 && !client_streambuf->is_detached; ++num_rounds) {
+        if ((at = quicly_get_first_timeout(server)) > quic_now)
+            quic_now = at;
+        num_datagrams = sizeof(datagrams) / sizeof(datagrams[0]);
+        ret = quicly_send(server, datagrams, &num_datagrams);
+        ok(ret == 0);
+        for (i = 0; i != num_datagrams; ++i) {
+            if (datagrams[i]->data.len > QUICLY_MAX_UDP_PAYLOAD_SIZE)
+                break;
+            if (max_len < datagrams[i]->data.len)
+                max_len = datagrams[i]->data.len;
+        }
+        ok(i == num_datagrams);
+        num_packets = decode_packets(decoded, datagrams, num_datagrams, 0);
+        for (i = 0; i != num_packets; ++i) {
+            ret = quicly_receive(client, decoded + i);
+            ok(ret == 0);
+        }
+        free_packets(datagrams, num_datagrams);
+        if ((at = quicly_get_first_timeout(client)) > quic_now)
+            quic_now = at;
+        transmit(client, server);
+    }
+    ok(buffer_is(&client_streambuf->super.ingress, testdata));
+    ok(max_len > QUICLY_MAX_UDP_PAYLOAD_SIZE - quic_ctx.max_packet_size);
+
+    quic_ctx.max_gso_segments = 0;
+}
+
+static void do_test_pacing(int by_txtime)
+{
+    static quicly_pacer_conf_t pacer_conf = {QUICLY_PACER_DEFAULT_GAIN_1024THS, 2};
+    quicly_stream_t *client_stream, *server_stream;
+    test_streambuf_t *client_streambuf;
+    quicly_datagram_t *datagrams[32];
+    quicly_decoded_packet_t decoded[32];
+    size_t num_datagrams, num_packets, num_rounds, i;
+    int64_t send_at;
+    char testdata[6001];
+    int ret;
+
+    memset(testdata, 'A', sizeof(testdata) - 1);
+    testdata[sizeof(testdata) - 1] = '\0';
+
+    quic_ctx.pacer = &pacer_conf;
+    quic_ctx.pace_by_txtime = by_txtime;
+
+    /* handshake, taking 100ms for each flight so that the connections would have an RTT of 100ms */
+    {
+        quicly_datagram_t *raw;
+        size_t num_packets = 1;
+        ret = quicly_connect(&client, &quic_ctx, "example.com", (void *)"abc", 3, NULL, NULL, NULL);
+        ok(ret == 0);
+        ret = quicly_send(client, &raw, &num_packets);
+        ok(ret == 0);
+        decode_packets(decoded, &raw, 1, 8);
+        quic_now += 100000;
+        ret = quicly_accept(&server, &quic_ctx, (void *)"abc", 3, NULL, decoded);
+        ok(ret == 0);
+        free_packets(&raw, 1);
+    }
+    for (num_rounds = 0; num_rounds < 10 && !quicly_connection_is_ready(client); ++num_rounds) {
+        if ((send_at = quicly_get_first_timeout(server)) > quic_now)
+            quic_now = send_at;
+        transmit(server, client);
+    }
+    ok(quicly_connection_is_ready(client));
+    quic_now += 100000;
+
+    ret = quicly_open_stream(client, &client_stream, 0);
+    ok(ret == 0);
+    client_streambuf = client_stream->data;
+    quicly_streambuf_egress_write(client_stream, "GET", 3);
+    quicly_streambuf_egress_shutdown(client_stream);
+    transmit(client, server);
+    server_stream = quicly_get_stream(server, client_stream->stream_id);
+    ok(server_stream != NULL);
+    quicly_streambuf_egress_write(server_stream, testdata, strlen(testdata));
+    quicly_streambuf_egress_shutdown(server_stream);
+
+    if (by_txtime) {
+        /* the response is sent at once, but with the departure times being spread */
+        int64_t last_txtime = 0;
+        num_datagrams = sizeof(datagrams) / sizeof(datagrams[0]);
+        ret = quicly_send(server, datagrams, &num_datagrams);
+        ok(ret == 0);
+        ok(num_datagrams >= 5);
+        for (i = 0; i != num_datagrams; ++i) {
+            if (datagrams[i]->txtime != 0) {
+                ok(datagrams[i]->txtime > last_txtime);
+                last_txtime = datagrams[i]->txtime;
+            }
+        }
+        ok(last_txtime > quic_now);
+        num_packets = decode_packets(decoded, datagrams, num_datagrams, 0);
+        for (i = 0; i != num_packets; ++i) {
+            ret = quicly_receive(client, decoded + i);
+            ok(ret == 0);
+        }
+        free_packets(datagrams, num_datagrams);
+        ok(buffer_is(&client_streambuf->super.ingress, testdata));
+        goto Exit;
+    }
+
+    /* the response fits in CWND, but is sent in bursts of two packets */
+    for (num_rounds = 0; num_rounds < 100; ++num_rounds) {
+        send_at = quicly_get_first_timeout(server);
+        ok(send_at < quic_now + 100000);
+        if (send_at > quic_now)
+            quic_now = send_at;
+        num_datagrams = sizeof(datagrams) / sizeof(datagrams[0]);
+        ret = quicly_send(server, datagrams, &num_datagrams);
+        ok(ret == 0);
+        ok(num_datagrams <= 3); /* two packets carrying stream data, and at most one carrying ACK */
+        num_packets = decode_packets(decoded, datagrams, num_datagrams, 0);
+        for (i = 0; i != num_packets; ++i) {
+            ret = quicly_receive(client, decoded + i);
+            ok(ret == 0);
+        }
+        free_packets(datagrams, num_datagrams);
+        if (buffer_is(&client_streambuf->super.ingress, testdata))
+            break;
+    }
+    ok(num_rounds >= 2);
+    ok(buffer_is(&client_streambuf->super.ingress, testdata));
+
+Exit:
+    quic_ctx.pacer = NULL;
+    quic_ctx.pace_by_txtime = 0;
+}
+
+static void test_pacing(void)
+{
+    do_test_pacing(0);
+}
+
+static void test_pacing_txtime(void)
+{
+    do_test_pacing(1);
+}
+
+static void test_pmtud(void)
+{
+    quicly_stream_t *client_stream;
+    quicly_datagram_t *datagrams[32];
+    quicly_decoded_packet_t decoded[32];
+    quicly_path_state_t path_state;
+    size_t num_datagrams, num_packets, num_rounds, num_probes, i;
+    uint32_t cwnd;
+    int64_t at;
+    int ret;
+
+    quic_ctx.max_probed_packet_size = 1400;
+
+    { /* handshake */
+        quicly_datagram_t *raw;
+        size_t num_packets = 1;
+        ret = quicly_connect(&client, &quic_ctx, "example.com", (void *)"abc", 3, NULL, NULL, NULL);
+        ok(ret == 0);
+        ret = quicly_send(client, &raw, &num_packets);
+        ok(ret == 0);
+        decode_packets(decoded, &raw, 1, 8);
+        ret = quicly_accept(&server, &quic_ctx, (void *)"abc", 3, NULL, decoded);
+        ok(ret == 0);
+        free_packets(&raw, 1);
+    }
+    transmit(server, client);
+    ok(quicly_connection_is_ready(client));
+
+    /* once the handshake is complete, the client probes the upper bound; the probe is dropped */
+    num_datagrams = sizeof(datagrams) / sizeof(datagrams[0]);
+    ret = quicly_send(client, datagrams, &num_datagrams);
+    ok(ret == 0);
+    for (i = 0, num_probes = 0; i != num_datagrams; ++i) {
+        if (datagrams[i]->data.len == 1400) {
+            quicly_datagram_t *probe = datagrams[i];
+            datagrams[i] = datagrams[num_datagrams - 1];
+            datagrams[num_datagrams - 1] = probe;
+            ++num_probes;
+        }
+    }
+    ok(num_probes == 1);
+    num_packets = decode_packets(decoded, datagrams, num_datagrams - 1, 8);
+    for (i = 0; i != num_packets; ++i) {
+        ret = quicly_receive(server, decoded + i);
+        ok(ret == 0);
+    }
+    free_packets(datagrams, num_datagrams);
+    quicly_get_path_state(client, &path_state);
+    cwnd = path_state.cwnd;
+
+    /* the loss of the probe is detected by the acks for the packets that follow, and the probe is resent; once the probe gets
+     * acked, the packet size is raised */
+    ret = quicly_open_stream(client, &client_stream, 0);
+    ok(ret == 0);
+    quicly_streambuf_egress_write(client_stream, "GET", 3);
+    for (num_rounds = 0, num_probes = 0; num_rounds < 20 && num_probes == 0; ++num_rounds) {
+        if ((at = quicly_get_first_timeout(client)) > quic_now)
+            quic_now = at;
+        num_datagrams = sizeof(datagrams) / sizeof(datagrams[0]);
+        ret = quicly_send(client, datagrams, &num_datagrams);
+        ok(ret == 0);
+        for (i = 0; i != num_datagrams; ++i)
+            if (datagrams[i]->data.len == 1400)
+                ++num_probes;
+        num_packets = decode_packets(decoded, datagrams, num_datagrams, 8);
+        for (i = 0; i != num_packets; ++i) {
+            ret = quicly_receive(server, decoded + i);
+            ok(ret == 0);
+        }
+        free_packets(datagrams, num_datagrams);
+        if ((at = quicly_get_first_timeout(server)) > quic_now)
+            quic_now = at;
+        transmit(server, client);
+    }
+    ok(num_probes == 1);
+    ok(quicly_get_max_packet_size(client) == 1400);
+
+    /* the loss of the probe is not a sign of congestion */
+    quicly_get_path_state(client, &path_state);
+    ok(path_state.cwnd >= cwnd);
+
+    /* fall back to the base size when the larger packets stop reaching the peer */
+    quicly_streambuf_egress_write(client_stream, "GET", 3);
+    for (num_rounds = 0; num_rounds < 20 && quicly_get_max_packet_size(client) != 1280; ++num_rounds) {
+        if ((at = quicly_get_first_timeout(client)) > quic_now)
+            quic_now = at;
+        num_datagrams = sizeof(datagrams) / sizeof(datagrams[0]);
+        ret = quicly_send(client, datagrams, &num_datagrams);
+        ok(ret == 0);
+        free_packets(datagrams, num_datagrams);
+    }
+    ok(quicly_get_max_packet_size(client) == 1280);
+
+    quic_ctx.max_probed_packet_size = 0;
+}
+
+static size_t num_ecn_congestion_events, num_ecn_disable_events;
+
+static void on_ecn_event(quicly_context_t *ctx, quicly_event_type_t type, const quicly_event_attribute_t *attributes,
+                         size_t num_attributes)
+{
+    switch (type) {
+    case QUICLY_EVENT_TYPE_CC_ECN_CONGESTION:
+        ++num_ecn_congestion_events;
+        break;
+    case QUICLY_EVENT_TYPE_ECN_DISABLE:
+        ++num_ecn_disable_events;
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * transmits the datagrams with the ECN codepoints being set by the sender, or with the ECT marks being rewritten to `remark` unless
+ * it is negative
+ */
+static void transmit_ecn(quicly_conn_t *src, quicly_conn_t *dst, int remark)
+{
+    quicly_datagram_t *datagrams[32];
+    quicly_decoded_packet_t decoded[32];
+    size_t num_datagrams, num_packets, i, j;
+    int ret;
+
+    num_datagrams = sizeof(datagrams) / sizeof(datagrams[0]);
+    ret = quicly_send(src, datagrams, &num_datagrams);
+    ok(ret == 0);
+    for (i = 0; i != num_datagrams; ++i) {
+        num_packets = decode_packets(decoded, datagrams + i, 1, quicly_is_client(dst) ? 0 : 8);
+        for (j = 0; j != num_packets; ++j) {
+            decoded[j].ecn = remark >= 0 && datagrams[i]->ecn != QUICLY_ECN_NOT_ECT ? (uint8_t)remark : datagrams[i]->ecn;
+            ret = quicly_receive(dst, decoded + j);
+            ok(ret == 0 || ret == QUICLY_ERROR_PACKET_IGNORED);
+        }
+    }
+    free_packets(datagrams, num_datagrams);
+}
+
+static void ecn_handshake(int remark)
+{
+    quicly_datagram_t *raw;
+    quicly_decoded_packet_t decoded;
+    size_t num_packets = 1;
+    int ret;
+
+    ret = quicly_connect(&client, &quic_ctx, "example.com", (void *)"abc", 3, NULL, NULL, NULL);
+    ok(ret == 0);
+    ret = quicly_send(client, &raw, &num_packets);
+    ok(ret == 0);
+    ok(raw->ecn == QUICLY_ECN_ECT0);
+    decode_packets(&decoded, &raw, 1, 8);
+    decoded.ecn = remark >= 0 ? (uint8_t)remark : raw->ecn;
+    ret = quicly_accept(&server, &quic_ctx, (void *)"abc", 3, NULL, &decoded);
+    ok(ret == 0);
+    free_packets(&raw, 1);
+    transmit_ecn(server, client, remark);
+    ok(quicly_connection_is_ready(client));
+    transmit_ecn(client, server, remark);
+}
+
+static void test_ecn(void)
+{
+    quicly_stream_t *client_stream, *server_stream;
+    test_streambuf_t *client_streambuf;
+    size_t num_rounds;
+    char testdata[6001];
+    int ret;
+
+    memset(testdata, 'A', sizeof(testdata) - 1);
+    testdata[sizeof(testdata) - 1] = '\0';
+
+    quic_ctx.enable_ecn = 1;
+    quic_ctx.event_log.mask = ((uint64_t)1 << QUICLY_EVENT_TYPE_CC_ECN_CONGESTION) | ((uint64_t)1 << QUICLY_EVENT_TYPE_ECN_DISABLE);
+    quic_ctx.event_log.cb = on_ecn_event;
+    num_ecn_congestion_events = 0;
+    num_ecn_disable_events = 0;
+
+    /* the marks are echoed back by the peer */
+    ecn_handshake(-1);
+    ok(num_ecn_disable_events == 0);
+
+    ret = quicly_open_stream(client, &client_stream, 0);
+    ok(ret == 0);
+    client_streambuf = client_stream->data;
+    quicly_streambuf_egress_write(client_stream, "GET", 3);
+    quicly_streambuf_egress_shutdown(client_stream);
+    transmit_ecn(client, server, -1);
+    server_stream = quicly_get_stream(server, client_stream->stream_id);
+    ok(server_stream != NULL);
+    quicly_streambuf_egress_write(server_stream, testdata, strlen(testdata));
+    quicly_streambuf_egress_shutdown(server_stream);
+
+    /* CE marks are reported by the client immediately, and the server reacts as if the packets were lost, once */
+    transmit_ecn(server, client, QUICLY_ECN_CE);
+    transmit_ecn(client, server, -1);
+    ok(num_ecn_congestion_events == 1);
+    for (num_rounds = 0; num_rounds < 10 && !buffer_is(&client_streambuf->super.ingress, testdata); ++num_rounds) {
+        quic_now += 10000;
+        transmit_ecn(server, client, -1);
+        transmit_ecn(client, server, -1);
+    }
+    ok(buffer_is(&client_streambuf->super.ingress, testdata));
+    ok(num_ecn_congestion_events == 1);
+    ok(num_ecn_disable_events == 0);
+
+    /* both endpoints stop marking when the path bleaches the marks */
+    ecn_handshake(QUICLY_ECN_NOT_ECT);
+    ok(num_ecn_disable_events == 2);
+
+    quic_ctx.enable_ecn = 0;
+    quic_ctx.event_log.mask = 0;
+    quic_ctx.event_log.cb = NULL;
+}
+
+/**
+ * transfers a response of 256KB
+ */
+static void do_test_deferred_sealing(int defer_sealing)
+{
+    static char testdata[256 * 1024 + 1];
+    quicly_stream_t *client_stream, *server_stream;
+    test_streambuf_t *client_streambuf;
+    quicly_datagram_t *datagrams[32];
+    quicly_decoded_packet_t decoded[32];
+    size_t num_datagrams, num_packets, num_packets_sent = 0, num_failed = 0, num_rounds, i;
+    int ret;
+
+    memset(testdata, 'A' + defer_sealing, sizeof(testdata) - 1);
+    testdata[sizeof(testdata) - 1] = '\0';
+
+    quic_ctx.defer_sealing = defer_sealing;
+
+    { /* handshake */
+        quicly_datagram_t *raw;
+        size_t num_packets = 1;
+        ret = quicly_connect(&client, &quic_ctx, "example.com", (void *)"abc", 3, NULL, NULL, NULL);
+        ok(ret == 0);
+        ret = quicly_send(client, &raw, &num_packets);
+        ok(ret == 0);
+        decode_packets(decoded, &raw, 1, 8);
+        ret = quicly_accept(&server, &quic_ctx, (void *)"abc", 3, NULL, decoded);
+        ok(ret == 0);
+        free_packets(&raw, 1);
+    }
+    transmit(server, client);
+    ok(quicly_connection_is_ready(client));
+
+    ret = quicly_open_stream(client, &client_stream, 0);
+    ok(ret == 0);
+    client_streambuf = client_stream->data;
+    quicly_streambuf_egress_write(client_stream, "GET", 3);
+    quicly_streambuf_egress_shutdown(client_stream);
+    transmit(client, server);
+    server_stream = quicly_get_stream(server, client_stream->stream_id);
+    ok(server_stream != NULL);
+    quicly_streambuf_egress_write(server_stream, testdata, strlen(testdata));
+    quicly_streambuf_egress_shutdown(server_stream);
+
+    for (num_rounds = 0; num_rounds < 100 && !client_streambuf->is_detached; ++num_rounds) {
+        /* server sends everything it can, which is received by the client */
+        do {
+            num_datagrams = sizeof(datagrams) / sizeof(datagrams[0]);
+            ret = quicly_send(server, datagrams, &num_datagrams);
+            if (ret != 0)
+                ++num_failed;
+            num_packets = decode_packets(decoded, datagrams, num_datagrams, 0);
+            for (i = 0; i != num_packets; ++i)
+                if (quicly_receive(client, decoded + i) != 0)
+                    ++num_failed;
+            free_packets(datagrams, num_datagrams);
+            num_packets_sent += num_packets;
+        } while (ret == 0 && num_datagrams != 0);
+        quic_now += QUICLY_DELAYED_ACK_TIMEOUT * 1000;
+        transmit(client, server);
+    }
+    ok(num_failed == 0);
+    ok(num_packets_sent != 0);
+    ok(buffer_is(&client_streambuf->super.ingress, testdata));
+    ok(client_streambuf->is_detached);
+
+    quicly_free(client);
+    quicly_free(server);
+    quic_ctx.defer_sealing = 0;
+}
+
+static void test_deferred_sealing(void)
+{
+    do_test_deferred_sealing(0);
+    do_test_deferred_sealing(1);
+}
+
+struct st_decrypt_worker_t {
+    pthread_t tid;
+    quicly_decryptor_t *decryptor;
+    uint64_t next_expected_pn;
+    quicly_decoded_packet_t *packets[32];
+    size_t num_packets;
+    size_t num_failed;
+};
+
+static void *decrypt_worker_main(void *_worker)
+{
+    struct st_decrypt_worker_t *worker = _worker;
+    size_t i;
+
+    for (i = 0; i != worker->num_packets; ++i)
+        if (quicly_decrypt_packet(worker->decryptor, &worker->next_expected_pn, worker->packets[i]) != 0)
+            ++worker->num_failed;
+
+    return NULL;
+}
+
+static void test_decrypt_on_worker(void)
+{
+    struct st_decrypt_worker_t workers[2] = {{0}};
+    quicly_stream_t *client_stream, *server_stream;
+    test_streambuf_t *client_streambuf;
+    quicly_datagram_t *datagrams[32];
+    quicly_decoded_packet_t decoded[32];
+    size_t num_datagrams, num_packets, num_decrypted = 0, num_total_packets = 0, num_rounds, i;
+    static char testdata[500001];
+    int ret;
+
+    memset(testdata, 'A', sizeof(testdata) - 1);
+    testdata[sizeof(testdata) - 1] = '\0';
+
+    { /* handshake */
+        quicly_datagram_t *raw;
+        size_t num_packets = 1;
+        ret = quicly_connect(&client, &quic_ctx, "example.com", (void *)"abc", 3, NULL, NULL, NULL);
+        ok(ret == 0);
+        ret = quicly_send(client, &raw, &num_packets);
+        ok(ret == 0);
+        decode_packets(decoded, &raw, 1, 8);
+        ret = quicly_accept(&server, &quic_ctx, (void *)"abc", 3, NULL, decoded);
+        ok(ret == 0);
+        free_packets(&raw, 1);
+    }
+    transmit(server, client);
+    ok(quicly_connection_is_ready(client));
+
+    /* each worker uses its own copy of the keys */
+    for (i = 0; i != sizeof(workers) / sizeof(workers[0]); ++i) {
+        workers[i].decryptor = quicly_new_decryptor(client);
+        ok(workers[i].decryptor != NULL);
+    }
+
+    ret = quicly_open_stream(client, &client_stream, 0);
+    ok(ret == 0);
+    client_streambuf = client_stream->data;
+    quicly_streambuf_egress_write(client_stream, "GET", 3);
+    quicly_streambuf_egress_shutdown(client_stream);
+    transmit(client, server);
+    server_stream = quicly_get_stream(server, client_stream->stream_id);
+    ok(server_stream != NULL);
+    quicly_streambuf_egress_write(server_stream, testdata, strlen(testdata));
+    quicly_streambuf_egress_shutdown(server_stream);
+
+    for (num_rounds = 0; num_rounds < 1000 && !buffer_is(&client_streambuf->super.ingress, testdata); ++num_rounds) {
+        num_datagrams = sizeof(datagrams) / sizeof(datagrams[0]);
+        ret = quicly_send(server, datagrams, &num_datagrams);
+        ok(ret == 0);
+        num_packets = decode_packets(decoded, datagrams, num_datagrams, 0);
+        /* Decrypt the packets concurrently. The mix is skewed; the second worker receives one packet out of 256, sitting idle while
+         * the connection moves far beyond the window of the truncated packet numbers. */
+        for (i = 0; i != sizeof(workers) / sizeof(workers[0]); ++i) {
+            workers[i].next_expected_pn = quicly_get_next_expected_packet_number(client);
+            workers[i].num_packets = 0;
+        }
+        for (i = 0; i != num_packets; ++i) {
+            struct st_decrypt_worker_t *worker = workers + (num_total_packets++ % 256 == 255);
+            worker->packets[worker->num_packets++] = decoded + i;
+        }
+        for (i = 0; i != sizeof(workers) / sizeof(workers[0]); ++i)
+            pthread_create(&workers[i].tid, NULL, decrypt_worker_main, workers + i);
+        for (i = 0; i != sizeof(workers) / sizeof(workers[0]); ++i)
+            pthread_join(workers[i].tid, NULL);
+        for (i = 0; i != num_packets; ++i)
+            if (decoded[i].decrypted.payload.base != NULL)
+                ++num_decrypted;
+        /* apply them in order */
+        ret = quicly_receive_batch(client, decoded, num_packets);
+        ok(ret == 0);
+        free_packets(datagrams, num_datagrams);
+        quic_now += QUICLY_DELAYED_ACK_TIMEOUT * 1000;
+        transmit(client, server);
+    }
+    ok(buffer_is(&client_streambuf->super.ingress, testdata));
+    ok(num_total_packets > 256);
+    ok(workers[0].num_failed == 0);
+    ok(workers[1].num_failed == 0);
+    ok(num_decrypted != 0);
+
+    for (i = 0; i != sizeof(workers) / sizeof(workers[0]); ++i)
+        quicly_free_decryptor(workers[i].decryptor);
+    quicly_free(client);
+    quicly_free(server);
+}
+
+static void test_key_update(void)
+{
+    quicly_stream_t *client_stream, *server_stream;
+    test_streambuf_t *client_streambuf;
+    quicly_datagram_t *delayed[1];
+    quicly_decoded_packet_t decoded;
+    size_t num_delayed, num_rounds, off;
+    static char testdata[100001];
+    int ret;
+
+    memset(testdata, 'A', sizeof(testdata) - 1);
+    testdata[sizeof(testdata) - 1] = '\0';
+
+    { /* handshake */
+        quicly_datagram_t *raw;
+        size_t num_packets = 1;
+        ret = quicly_connect(&client, &quic_ctx, "example.com", (void *)"abc", 3, NULL, NULL, NULL);
+        ok(ret == 0);
+        ret = quicly_send(client, &raw, &num_packets);
+        ok(ret == 0);
+        decode_packets(&decoded, &raw, 1, 8);
+        ret = quicly_accept(&server, &quic_ctx, (void *)"abc", 3, NULL, &decoded);
+        ok(ret == 0);
+        free_packets(&raw, 1);
+    }
+    transmit(server, client);
+    ok(quicly_connection_is_ready(client));
+
+    /* exchange some data using the initial keys */
+    ret = quicly_open_stream(client, &client_stream, 0);
+    ok(ret == 0);
+    client_streambuf = client_stream->data;
+    quicly_streambuf_egress_write(client_stream, "GET", 3);
+    quicly_streambuf_egress_shutdown(client_stream);
+    transmit(client, server);
+    server_stream = quicly_get_stream(server, client_stream->stream_id);
+    ok(server_stream != NULL);
+    quicly_streambuf_egress_write(server_stream, testdata, 10000);
+    transmit(server, client);
+    ok(quicly_get_key_generation(client, 1) == 0);
+    ok(quicly_get_key_generation(server, 1) == 0);
+
+    /* server sends a packet using the initial key, which gets delayed */
+    quicly_streambuf_egress_write(server_stream, testdata + 10000, 1000);
+    num_delayed = sizeof(delayed) / sizeof(delayed[0]);
+    ret = quicly_send(server, delayed, &num_delayed);
+    ok(ret == 0);
+    ok(num_delayed == 1);
+
+    /* client initiates the update after giving the server time to derive the next key, and the server follows */
+    quicly_initiate_key_update(client);
+    quic_now += 1000000;
+    transmit(client, server);
+    ok(quicly_get_key_generation(client, 1) == 1);
+    ok(quicly_get_key_generation(server, 0) == 1);
+    ok(quicly_get_key_generation(server, 1) == 1);
+    quicly_streambuf_egress_write(server_stream, testdata + 11000, 1000);
+    transmit(server, client);
+    ok(quicly_get_key_generation(client, 0) == 1);
+
+    /* the delayed packet can be decrypted after the client sends packets, as the previous key is retained */
+    transmit(client, server);
+    decode_packets(&decoded, delayed, 1, 0);
+    ret = quicly_receive(client, &decoded);
+    ok(ret == 0);
+    free_packets(delayed, 1);
+    ok(quicly_get_key_generation(client, 0) == 1);
+
+    /* then, updates happen automatically, each after the peer has had time to derive the next key; the response is sent in
+     * chunks so that the exchange lasts for many round trips */
+    quic_ctx.max_packets_per_key = 10;
+    for (num_rounds = 0, off = 12000; num_rounds < 200 && !client_streambuf->is_detached; ++num_rounds) {
+        if (off < sizeof(testdata) - 1) {
+            quicly_streambuf_egress_write(server_stream, testdata + off, 1000);
+            if ((off += 1000) == sizeof(testdata) - 1)
+                quicly_streambuf_egress_shutdown(server_stream);
+        }
+        quic_now += QUICLY_DELAYED_ACK_TIMEOUT * 1000;
+        transmit(client, server);
+        transmit(server, client);
+    }
+    ok(buffer_is(&client_streambuf->super.ingress, testdata));
+    ok(quicly_get_key_generation(server, 1) >= 3);
+    ok(quicly_get_key_generation(client, 0) == quicly_get_key_generation(server, 1));
+
+    quic_ctx.max_packets_per_key = quicly_default_context.max_packets_per_key;
+    quicly_free(client);
+    quicly_free(server);
+}
+
+static void *complete_handshake_main(void *_conn)
+{
+    quicly_conn_t *conn = _conn;
+    return (void *)(intptr_t)quicly_complete_handshake(conn);
+}
+
+static void test_async_handshake(void)
+{
+    void *thread_ret;
+    pthread_t tid;
+    int ret;
+
+    quic_ctx.async_handshake = 1;
+
+    { /* ClientHello is buffered until the handshake is completed by another thread */
+        quicly_datagram_t *raw;
+        quicly_decoded_packet_t decoded;
+        size_t num_packets = 1;
+        ret = quicly_connect(&client, &quic_ctx, "example.com", (void *)"abc", 3, NULL, NULL, NULL);
+        ok(ret == 0);
+        ret = quicly_send(client, &raw, &num_packets);
+        ok(ret == 0);
+        decode_packets(&decoded, &raw, 1, 8);
+        ret = quicly_accept(&server, &quic_ctx, (void *)"abc", 3, NULL, &decoded);
+        ok(ret == QUICLY_ERROR_HANDSHAKE_PENDING);
+        free_packets(&raw, 1);
+    }
+    ok(!quicly_connection_is_ready(server));
+    pthread_create(&tid, NULL, complete_handshake_main, server);
+    pthread_join(tid, &thread_ret);
+    ok(thread_ret == NULL);
+    ok(quicly_connection_is_ready(server));
+
+    transmit(server, client);
+    ok(quicly_connection_is_ready(client));
+    transmit(client, server);
+    ok(quicly_get_state(server) == QUICLY_STATE_CONNECTED);
+
+    quicly_free(client);
+    quicly_free(server);
+    quic_ctx.async_handshake = 0;
+}
+
+static struct {
+    uint8_t bytes[2048];
+    size_t len;
+} saved_ticket;
+
+static int encrypt_ticket_cb(ptls_encrypt_ticket_t *self, ptls_t *tls, int is_encrypt, ptls_buffer_t *dst, ptls_iovec_t src)
+{
+    int ret;
+
+    /* the tickets are not encrypted, as there is no need to protect them in the test */
+    ptls_buffer_pushv(dst, src.base, src.len);
+    ret = 0;
+Exit:
+    return ret;
+}
+
+static int save_ticket_cb(ptls_save_ticket_t *self, ptls_t *tls, ptls_iovec_t src)
+{
+    if (src.len > sizeof(saved_ticket.bytes))
+        return PTLS_ERROR_NO_MEMORY;
+    memcpy(saved_ticket.bytes, src.base, src.len);
+    saved_ticket.len = src.len;
+    return 0;
+}
+
+/**
+ * runs the handshake, and returns the congestion window of the client once the handshake is confirmed
+ */
+static uint32_t do_test_careful_resume(int resume, const quicly_path_state_t *path_state, quicly_path_state_t *new_path_state)
+{
+    ptls_handshake_properties_t hs_properties = {{{{NULL}}}};
+    quicly_path_state_t client_path_state;
+    size_t i;
+    int ret;
+
+    if (resume)
+        hs_properties.client.session_ticket = ptls_iovec_init(saved_ticket.bytes, saved_ticket.len);
+
+    { /* handshake */
+        quicly_datagram_t *raw;
+        quicly_decoded_packet_t decoded;
+        size_t num_packets = 1;
+        ret = quicly_connect(&client, &quic_ctx, "example.com", (void *)"abc", 3, &hs_properties, NULL, path_state);
+        ok(ret == 0);
+        ret = quicly_send(client, &raw, &num_packets);
+        ok(ret == 0);
+        decode_packets(&decoded, &raw, 1, 8);
+        ret = quicly_accept(&server, &quic_ctx, (void *)"abc", 3, NULL, &decoded);
+        ok(ret == 0);
+        free_packets(&raw, 1);
+    }
+    for (i = 0; i != 3; ++i) {
+        transmit(server, client);
+        quic_now += QUICLY_DELAYED_ACK_TIMEOUT * 1000;
+        transmit(client, server);
+    }
+    ok(quicly_connection_is_ready(client));
+
+    quicly_get_path_state(client, &client_path_state);
+    if (new_path_state != NULL)
+        *new_path_state = client_path_state;
+
+    quicly_free(client);
+    quicly_free(server);
+
+    return client_path_state.cwnd;
+}
+
+static void test_careful_resume(void)
+{
+    static ptls_encrypt_ticket_t encrypt_ticket = {encrypt_ticket_cb};
+    static ptls_save_ticket_t save_ticket = {save_ticket_cb};
+    quicly_path_state_t path_state, mismatch;
+    uint32_t initial_cwnd;
+
+    quic_ctx.tls->encrypt_ticket = &encrypt_ticket;
+    quic_ctx.tls->save_ticket = &save_ticket;
+    quic_ctx.tls->ticket_lifetime = 86400;
+
+    /* obtain the session ticket and the characteristics of the path, then pretend that the window had grown */
+    saved_ticket.len = 0;
+    initial_cwnd = do_test_careful_resume(0, NULL, &path_state);
+    ok(saved_ticket.len != 0);
+    ok(path_state.smoothed_rtt != 0);
+    path_state.cwnd = initial_cwnd * 20;
+
+    /* the remembered window is used when resuming */
+    ok(do_test_careful_resume(1, &path_state, NULL) >= path_state.cwnd / 2);
+    /* but not when the handshake is a full one */
+    ok(do_test_careful_resume(0, &path_state, NULL) < path_state.cwnd / 2);
+    /* nor when the RTT differs */
+    mismatch = path_state;
+    mismatch.smoothed_rtt *= 100;
+    mismatch.min_rtt *= 100;
+    ok(do_test_careful_resume(1, &mismatch, NULL) < path_state.cwnd / 2);
+
+    quic_ctx.tls->encrypt_ticket = NULL;
+    quic_ctx.tls->save_ticket = NULL;
+    quic_ctx.tls->ticket_lifetime = 0;
+}
+
 void test_simple(void)
 {
     subtest("handshake", test_handshake);
@@ -533,4 +1494,16 @@ void test_simple(void)
     subtest("rst-during-loss", test_rst_during_loss);
     subtest("close", test_close);
     subtest("tiny-connection-window", tiny_connection_window);
+    subtest("receive-batch", test_receive_batch);
+    subtest("gso", test_gso);
+    subtest("gso-limit", test_gso_limit);
+    subtest("pacing", test_pacing);
+    subtest("pacing-txtime", test_pacing_txtime);
+    subtest("pmtud", test_pmtud);
+    subtest("ecn", test_ecn);
+    subtest("deferred-sealing", test_deferred_sealing);
+    subtest("decrypt-on-worker", test_decrypt_on_worker);
+    subtest("key-update", test_key_update);
+    subtest("async-handshake", test_async_handshake);
+    subtest("careful-resume", test_careful_resume);
 }
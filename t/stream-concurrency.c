@@ -37,7 +37,7 @@ void test_stream_concurrency(void)
         size_t num_packets;
         quicly_decoded_packet_t decoded;
 
-        ret = quicly_connect(&client, &quic_ctx, "example.com", (void *)"abc", 3, NULL, NULL);
+        ret = quicly_connect(&client, &quic_ctx, "example.com", (void *)"abc", 3, NULL, NULL, NULL);
         ok(ret == 0);
         num_packets = 1;
         ret = quicly_send(client, &raw, &num_packets);
@@ -86,7 +86,7 @@ void test_stream_concurrency(void)
     /* the last stream is still ID-blocked */
     ok(client_streams[i]->streams_blocked);
 
-    quic_now += QUICLY_DELAYED_ACK_TIMEOUT;
+    quic_now += QUICLY_DELAYED_ACK_TIMEOUT * 1000;
     transmit(client, server);
     transmit(server, client);
 
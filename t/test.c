@@ -231,7 +231,7 @@ void free_packets(quicly_datagram_t **packets, size_t cnt)
 {
     size_t i;
     for (i = 0; i != cnt; ++i)
-        quicly_default_free_packet(&quic_ctx, packets[i]);
+        quic_ctx.free_packet(&quic_ctx, packets[i]);
 }
 
 size_t decode_packets(quicly_decoded_packet_t *decoded, quicly_datagram_t **raw, size_t cnt, size_t host_cidl)
@@ -239,13 +239,18 @@ size_t decode_packets(quicly_decoded_packet_t *decoded, quicly_datagram_t **raw,
     size_t ri, dc = 0;
 
     for (ri = 0; ri != cnt; ++ri) {
-        size_t off = 0;
+        size_t seg_off = 0, seg_size = raw[ri]->segment_size != 0 ? raw[ri]->segment_size : raw[ri]->data.len;
         do {
-            size_t dl = quicly_decode_packet(decoded + dc, raw[ri]->data.base + off, raw[ri]->data.len - off, host_cidl);
-            assert(dl != SIZE_MAX);
-            ++dc;
-            off += dl;
-        } while (off != raw[ri]->data.len);
+            uint8_t *seg = raw[ri]->data.base + seg_off;
+            size_t seg_len = raw[ri]->data.len - seg_off < seg_size ? raw[ri]->data.len - seg_off : seg_size, off = 0;
+            do {
+                size_t dl = quicly_decode_packet(decoded + dc, seg + off, seg_len - off, host_cidl);
+                assert(dl != SIZE_MAX);
+                ++dc;
+                off += dl;
+            } while (off != seg_len);
+            seg_off += seg_len;
+        } while (seg_off != raw[ri]->data.len);
     }
 
     return dc;
@@ -306,6 +311,96 @@ static void test_next_packet_number(void)
     ok(n == 0xa82f9b32);
 }
 
+/**
+ * the PN of 1-RTT packets are encoded relative to the 1-RTT packet number space, even if the handshake has consumed more packet
+ * numbers than the shortest encoding can represent
+ */
+static void test_pn_len_after_long_handshake(void)
+{
+    quicly_conn_t *client, *server;
+    quicly_stream_t *client_stream, *server_stream;
+    test_streambuf_t *client_streambuf;
+    int ret;
+
+    { /* send Initial */
+        quicly_datagram_t *raw;
+        quicly_decoded_packet_t decoded;
+        size_t num_packets = 1;
+        ret = quicly_connect(&client, &quic_ctx, "example.com", (void *)"abc", 3, NULL, NULL, NULL);
+        ok(ret == 0);
+        ret = quicly_send(client, &raw, &num_packets);
+        ok(ret == 0);
+        decode_packets(&decoded, &raw, 1, 8);
+        ret = quicly_accept(&server, &quic_ctx, (void *)"abc", 3, NULL, &decoded);
+        ok(ret == 0);
+        free_packets(&raw, 1);
+    }
+
+    /* emulate a handshake that has consumed many packet numbers, e.g., by retransmitting the server's flight */
+    server->egress.packet_number += 300;
+    transmit(server, client);
+    ok(quicly_connection_is_ready(client));
+
+    ret = quicly_open_stream(client, &client_stream, 0);
+    ok(ret == 0);
+    client_streambuf = client_stream->data;
+    quicly_streambuf_egress_write(client_stream, "GET", 3);
+    quicly_streambuf_egress_shutdown(client_stream);
+    transmit(client, server);
+    server_stream = quicly_get_stream(server, client_stream->stream_id);
+    ok(server_stream != NULL);
+
+    /* the first 1-RTT packets of the server are decodable */
+    quicly_streambuf_egress_write(server_stream, "hello world", 11);
+    quicly_streambuf_egress_shutdown(server_stream);
+    transmit(server, client);
+    ok(buffer_is(&client_streambuf->super.ingress, "hello world"));
+
+    quicly_free(client);
+    quicly_free(server);
+}
+
+/**
+ * the packet threshold of loss detection is counted within each packet number space, although the PNs are shared by the spaces
+ */
+static void test_packet_threshold_per_space(void)
+{
+    static quicly_ack_frame_t ack;
+    quicly_conn_t *client;
+    quicly_datagram_t *raw;
+    size_t num_packets = 1;
+    uint64_t pn, num_lost;
+    int ret;
+
+    ret = quicly_connect(&client, &quic_ctx, "example.com", (void *)"abc", 3, NULL, NULL, NULL);
+    ok(ret == 0);
+    ret = quicly_send(client, &raw, &num_packets);
+    ok(ret == 0);
+    free_packets(&raw, num_packets);
+
+    /* an Initial packet followed by a few 1-RTT packets, then by another Initial packet */
+    for (pn = 100; pn <= 105; ++pn) {
+        quicly_sentmap_t *sentmap =
+            &client->egress.spaces[pn == 100 || pn == 105 ? QUICLY_EPOCH_INITIAL : QUICLY_EPOCH_1RTT].sentmap;
+        ret = quicly_sentmap_prepare(sentmap, pn, quic_now, QUICLY_EPOCH_INITIAL);
+        ok(ret == 0);
+        quicly_sentmap_commit(sentmap, 100);
+    }
+    client->egress.packet_number = pn;
+    num_lost = client->super.num_packets.lost;
+
+    /* acking the last one does not cause the former to be deemed lost, as only one Initial packet has been sent in between */
+    quic_now += 1000;
+    ack.largest_acknowledged = 105;
+    ack.smallest_acknowledged = 105;
+    ack.ack_block_lengths[0] = 1;
+    ret = handle_ack_frame(client, QUICLY_EPOCH_INITIAL, &ack);
+    ok(ret == 0);
+    ok(client->super.num_packets.lost == num_lost);
+
+    quicly_free(client);
+}
+
 int main(int argc, char **argv)
 {
     static ptls_iovec_t cert;
@@ -359,7 +454,13 @@ int main(int argc, char **argv)
 
     quicly_amend_ptls_context(quic_ctx.tls);
 
+#ifdef QUICLY_BENCH
+    run_benchmarks();
+    return 0;
+#else
     subtest("next-packet-number", test_next_packet_number);
+    subtest("pn-len-after-long-handshake", test_pn_len_after_long_handshake);
+    subtest("packet-threshold-per-space", test_packet_threshold_per_space);
     subtest("ranges", test_ranges);
     subtest("frame", test_frame);
     subtest("maxsender", test_maxsender);
@@ -368,6 +469,11 @@ int main(int argc, char **argv)
     subtest("simple", test_simple);
     subtest("stream-concurrency", test_stream_concurrency);
     subtest("loss", test_loss);
+    subtest("connmap", test_connmap);
+    subtest("packetpool", test_packetpool);
+    subtest("pacer", test_pacer);
+    subtest("timerwheel", test_timerwheel);
 
     return done_testing();
+#endif
 }
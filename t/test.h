@@ -47,6 +47,9 @@ int buffer_is(ptls_buffer_t *buf, const char *s);
 size_t transmit(quicly_conn_t *src, quicly_conn_t *dst);
 int max_data_is_equal(quicly_conn_t *client, quicly_conn_t *server);
 
+void test_connmap(void);
+void test_packetpool(void);
+void test_pacer(void);
 void test_ranges(void);
 void test_frame(void);
 void test_maxsender(void);
@@ -54,5 +57,8 @@ void test_sentmap(void);
 void test_simple(void);
 void test_loss(void);
 void test_stream_concurrency(void);
+void test_timerwheel(void);
+
+void run_benchmarks(void);
 
 #endif
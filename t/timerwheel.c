@@ -0,0 +1,215 @@
+/*
+ * Copyright (c) 2019 Fastly, Kazuho Oku
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#include "quicly/timerwheel.h"
+#include "test.h"
+
+static int64_t collect_expired(quicly_timerwheel_t *wheel, int64_t now, quicly_timerwheel_timer_t **timers, size_t *num_timers)
+{
+    size_t capacity = *num_timers, i;
+    int64_t max_at = INT64_MIN;
+
+    *num_timers = quicly_timerwheel_get_expired(wheel, now, timers, capacity);
+    for (i = 0; i != *num_timers; ++i) {
+        if (max_at < timers[i]->at)
+            max_at = timers[i]->at;
+        ok(!quicly_timerwheel_timer_is_active(timers[i]));
+    }
+    return max_at;
+}
+
+/**
+ * Calls quicly_timerwheel_get_expired at the times being returned by quicly_timerwheel_get_first_timeout, without consuming the
+ * timers, until the value becomes exact. Returns that value.
+ */
+static int64_t settle_first_timeout(quicly_timerwheel_t *wheel)
+{
+    int64_t at, prev = INT64_MIN;
+    size_t num_wakeups = 0;
+
+    while ((at = quicly_timerwheel_get_first_timeout(wheel)) != prev) {
+        ok(quicly_timerwheel_get_expired(wheel, at, NULL, 0) == 0);
+        prev = at;
+        ++num_wakeups;
+    }
+    ok(num_wakeups <= QUICLY_TIMERWHEEL_NUM_WHEELS);
+
+    return at;
+}
+
+static void test_basic(void)
+{
+    quicly_timerwheel_t *wheel = quicly_timerwheel_create(1000);
+    quicly_timerwheel_timer_t a, b, c, *expired[4];
+    size_t num_expired;
+
+    quicly_timerwheel_init_timer(&a);
+    quicly_timerwheel_init_timer(&b);
+    quicly_timerwheel_init_timer(&c);
+    ok(quicly_timerwheel_size(wheel) == 0);
+    ok(quicly_timerwheel_get_first_timeout(wheel) == INT64_MAX);
+
+    /* register, update, unregister */
+    quicly_timerwheel_set(wheel, &a, 1010);
+    quicly_timerwheel_set(wheel, &b, 5000);
+    quicly_timerwheel_set(wheel, &c, 1000000);
+    ok(quicly_timerwheel_size(wheel) == 3);
+    ok(quicly_timerwheel_get_first_timeout(wheel) == 1010);
+    quicly_timerwheel_set(wheel, &a, 100000);
+    ok(quicly_timerwheel_size(wheel) == 3);
+    ok(quicly_timerwheel_get_first_timeout(wheel) < 5000);
+    ok(settle_first_timeout(wheel) == 5000);
+    quicly_timerwheel_unset(wheel, &b);
+    ok(!quicly_timerwheel_timer_is_active(&b));
+    ok(quicly_timerwheel_size(wheel) == 2);
+    ok(quicly_timerwheel_get_first_timeout(wheel) <= 100000);
+    quicly_timerwheel_unset(wheel, &b);
+    ok(quicly_timerwheel_size(wheel) == 2);
+    quicly_timerwheel_set(wheel, &c, INT64_MAX);
+    ok(!quicly_timerwheel_timer_is_active(&c));
+    ok(quicly_timerwheel_size(wheel) == 1);
+
+    /* nothing expires before the deadline */
+    num_expired = sizeof(expired) / sizeof(expired[0]);
+    collect_expired(wheel, 99999, expired, &num_expired);
+    ok(num_expired == 0);
+    ok(quicly_timerwheel_get_first_timeout(wheel) == 100000);
+    num_expired = sizeof(expired) / sizeof(expired[0]);
+    collect_expired(wheel, 100000, expired, &num_expired);
+    ok(num_expired == 1);
+    ok(expired[0] == &a);
+    ok(quicly_timerwheel_size(wheel) == 0);
+
+    /* timers set in the past expire immediately, and are reported as being due at the time the wheel was last run */
+    quicly_timerwheel_set(wheel, &a, 10);
+    quicly_timerwheel_set(wheel, &b, 100001);
+    ok(quicly_timerwheel_get_first_timeout(wheel) == 100000);
+    num_expired = sizeof(expired) / sizeof(expired[0]);
+    collect_expired(wheel, 100000, expired, &num_expired);
+    ok(num_expired == 1);
+    ok(expired[0] == &a);
+    ok(quicly_timerwheel_get_first_timeout(wheel) == 100001);
+
+    /* the number of timers being returned is capped */
+    quicly_timerwheel_set(wheel, &a, 100001);
+    quicly_timerwheel_set(wheel, &c, 100001);
+    num_expired = 2;
+    collect_expired(wheel, 200000, expired, &num_expired);
+    ok(num_expired == 2);
+    ok(quicly_timerwheel_size(wheel) == 1);
+    num_expired = sizeof(expired) / sizeof(expired[0]);
+    collect_expired(wheel, 200000, expired, &num_expired);
+    ok(num_expired == 1);
+    ok(quicly_timerwheel_size(wheel) == 0);
+
+    quicly_timerwheel_destroy(wheel);
+}
+
+static void test_many(void)
+{
+    quicly_timerwheel_t *wheel = quicly_timerwheel_create(0);
+    quicly_timerwheel_timer_t timers[1000], *expired[1000];
+    int64_t now = 0, last_expired_at = INT64_MIN;
+    size_t i, num_expired, num_total_expired = 0, num_empty_wakeups = 0;
+    uint64_t seed = 1;
+
+    /* register timers spread across all the wheels */
+    for (i = 0; i != sizeof(timers) / sizeof(timers[0]); ++i) {
+        seed = seed * 6364136223846793005 + 1442695040888963407;
+        quicly_timerwheel_init_timer(timers + i);
+        quicly_timerwheel_set(wheel, timers + i, (int64_t)((seed >> 1) >> (seed % 62)));
+    }
+    ok(quicly_timerwheel_size(wheel) == sizeof(timers) / sizeof(timers[0]));
+
+    /* advance to each wakeup time, checking that the timers are returned in order and exactly when they expire; wakeups that only
+     * move the timers to the finer wheels are bounded by the number of wheels each timer passes through */
+    while (quicly_timerwheel_size(wheel) != 0) {
+        int64_t first = quicly_timerwheel_get_first_timeout(wheel), max_at;
+        if (first > now) {
+            num_expired = sizeof(expired) / sizeof(expired[0]);
+            collect_expired(wheel, first - 1, expired, &num_expired);
+            if (num_expired != 0)
+                break;
+        }
+        now = first;
+        num_expired = sizeof(expired) / sizeof(expired[0]);
+        max_at = collect_expired(wheel, now, expired, &num_expired);
+        if (num_expired == 0) {
+            ++num_empty_wakeups;
+            continue;
+        }
+        if (max_at != now || max_at < last_expired_at)
+            break;
+        last_expired_at = max_at;
+        num_total_expired += num_expired;
+    }
+    ok(quicly_timerwheel_size(wheel) == 0);
+    ok(num_total_expired == sizeof(timers) / sizeof(timers[0]));
+    ok(num_empty_wakeups <= sizeof(timers) / sizeof(timers[0]) * (QUICLY_TIMERWHEEL_NUM_WHEELS - 1));
+
+    quicly_timerwheel_destroy(wheel);
+}
+
+static void test_conn(void)
+{
+    quicly_timerwheel_t *wheel = quicly_timerwheel_create(quic_now);
+    quicly_timerwheel_timer_t *expired[4];
+    quicly_conn_t *client;
+    quicly_datagram_t *packets[32];
+    size_t num_packets, num_expired;
+    int ret;
+
+    quic_ctx.timer_wheel = wheel;
+
+    /* connections register their timeouts, and update them as they send */
+    ret = quicly_connect(&client, &quic_ctx, "example.com", (void *)"abc", 3, NULL, NULL, NULL);
+    ok(ret == 0);
+    ok(quicly_timerwheel_size(wheel) == 1);
+    ok(quicly_get_first_timeout(client) <= quic_now);
+    ok(quicly_timerwheel_get_first_timeout(wheel) <= quic_now);
+    num_expired = sizeof(expired) / sizeof(expired[0]);
+    num_expired = quicly_timerwheel_get_expired(wheel, quic_now, expired, num_expired);
+    ok(num_expired == 1);
+    ok(quicly_get_conn_by_timer(expired[0]) == client);
+    num_packets = sizeof(packets) / sizeof(packets[0]);
+    ret = quicly_send(client, packets, &num_packets);
+    ok(ret == 0);
+    ok(num_packets != 0);
+    free_packets(packets, num_packets);
+    ok(quicly_timerwheel_size(wheel) == 1);
+    ok(quicly_timerwheel_get_first_timeout(wheel) > quic_now);
+    ok(quicly_timerwheel_get_first_timeout(wheel) <= quicly_get_first_timeout(client));
+    ok(settle_first_timeout(wheel) == quicly_get_first_timeout(client));
+
+    /* freeing the connection unregisters it */
+    quicly_free(client);
+    ok(quicly_timerwheel_size(wheel) == 0);
+
+    quic_ctx.timer_wheel = NULL;
+    quicly_timerwheel_destroy(wheel);
+}
+
+void test_timerwheel(void)
+{
+    subtest("basic", test_basic);
+    subtest("many", test_many);
+    subtest("conn", test_conn);
+}